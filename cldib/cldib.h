@@ -10,6 +10,7 @@
 #include "cldib_core.h"
 #include "cldib_tools.h"
 #include "cldib_tmap.h"
+#include "cldib_par.h"
 
 #include "cldib_files.h"
 
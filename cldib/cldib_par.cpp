@@ -0,0 +1,60 @@
+//
+//! \file cldib_par.cpp
+//!  Simple parallel loops
+//! \date 20261017 - 20261017
+//
+
+#include "cldib_par.h"
+
+
+// --------------------------------------------------------------------
+// GLOBALS
+// --------------------------------------------------------------------
+
+
+static int __par_threads= 0;		// 0: one per core
+static thread_local int __par_depth= 0;	// >0: inside a par_for body
+
+
+// --------------------------------------------------------------------
+// FUNCTIONS
+// --------------------------------------------------------------------
+
+
+//! Set the number of threads for par_for().
+/*!	\param count	Thread count. 0 (or less) means one per core; 
+		1 runs everything on the calling thread.
+*/
+void par_set_threads(int count)
+{
+	__par_threads= count > 0 ? count : 0;
+}
+
+//! Get the number of threads used by par_for().
+/*!	\note	Inside a par_for body this is 1: nested loops run inline.
+*/
+int par_get_threads()
+{
+	if(__par_depth > 0)
+		return 1;
+
+	if(__par_threads > 0)
+		return __par_threads;
+
+	int count= std::thread::hardware_concurrency();
+	return count > 0 ? count : 1;
+}
+
+//! Mark the calling thread as running par_for() work.
+void par_enter()
+{
+	__par_depth++;
+}
+
+//! Undo par_enter().
+void par_leave()
+{
+	__par_depth--;
+}
+
+// EOF
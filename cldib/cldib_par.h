@@ -0,0 +1,81 @@
+//
+//! \file cldib_par.h
+//!  Simple parallel loops
+//! \date 20261017 - 20261017
+//
+/* === NOTES ===
+  * The work is spread over std::threads that are created per call. 
+	That's cheap next to the image and compression jobs it's meant 
+	for; don't use it for tiny loops.
+  * par_for inside a par_for body runs inline on the worker, so 
+	nested parallel jobs don't multiply the thread count.
+*/
+
+#ifndef __CLDIB_PAR_H__
+#define __CLDIB_PAR_H__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+
+// --------------------------------------------------------------------
+// PROTOTYPES
+// --------------------------------------------------------------------
+
+/*!	\addtogroup grpMisc
+*	\{
+*/
+
+void par_set_threads(int count);
+int par_get_threads();
+void par_enter();
+void par_leave();
+
+
+//! Run \a body(ii) for ii in [0, \a count), spread over the worker threads.
+/*!	Items are handed out in order, but may finish in any order, so 
+	\a body should only write to its own part of the output. 
+	With one thread (or one item) this is a plain loop, as it is 
+	when called from inside another par_for's \a body.
+*/
+template<class Fn>
+void par_for(int count, Fn body)
+{
+	int ii, nthreads= par_get_threads();
+	if(nthreads > count)
+		nthreads= count;
+
+	if(nthreads <= 1)
+	{
+		for(ii=0; ii<count; ii++)
+			body(ii);
+		return;
+	}
+
+	std::atomic<int> next(0);
+	auto worker= [&]()
+	{
+		int jj;
+		par_enter();
+		while( (jj= next++) < count)
+			body(jj);
+		par_leave();
+	};
+
+	std::vector<std::thread> threads;
+	for(ii=1; ii<nthreads; ii++)
+		threads.push_back(std::thread(worker));
+
+	worker();
+
+	for(ii=0; ii<(int)threads.size(); ii++)
+		threads[ii].join();
+}
+
+/*!	\}	*/
+
+
+#endif // __CLDIB_PAR_H__
+
+// EOF
@@ -5,13 +5,94 @@
 //! \author cearn
 /* === NOTES ===
   * 20100115, JV: yay, finally some actual work done in here.
+  * 20261017: added tmap_reorder() / TMAP_ORDER: chains new tiles by 
+    similarity so that LZ77 finds more matches in the tileset.
+  * 20261017: tmap_init_from_dib keeps a hash index of the tileset 
+    (TileIndex) so dib_find doesn't rescan every tile; linear in the 
+    number of map tiles instead of quadratic. Results are unchanged.
+  * 20261017: dib_find tries flips by reading the tile in flipped 
+    order instead of flipping copies; one bucket serves all four.
+  * 20261017: Tile compares go through tile_eq(), with fixed-size 
+    kernels for 8x8 and 16x16 tiles at 8 and 16bpp (SSE2 / AVX2, 
+    64-bit words otherwise). dib_get_pbank and dib_set_pbank work 
+    16 or 32 bytes at a time.
+  * 20261017: tmap_init_from_dib hashes the map cells in parallel 
+    (par_for), straight from the source dib. Only the index 
+    assignment is serial; the new tiles are copied to the tileset 
+    in parallel afterwards. No temporary tile dib anymore.
+  * 20261017: The tileset starts with just the blank or external 
+    tiles and is grown in place (tile_grow) once the number of new 
+    tiles is known, instead of allocating room for every map cell 
+    and copying the survivors out.
+  * 20261017: Cells are hashed, assigned and checked TMAP_CELL_BLOCK 
+    at a time, and the TileIndex starts small and doubles. Scratch 
+    memory follows the unique tiles, not the map size.
 */
 
 #include <algorithm>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #include "cldib_core.h"
 #include "cldib_tools.h"
 #include "cldib_tmap.h"
+#include "cldib_par.h"
+
+// --------------------------------------------------------------------
+// CONSTANTS
+// --------------------------------------------------------------------
+
+//! Map cells or tiles per par_for item in tmap_init_from_dib.
+#define TMAP_PAR_BLOCK		256
+
+//! Map cells hashed and assigned per round in tmap_init_from_dib.
+#define TMAP_CELL_BLOCK		8192
+
+//! Initial number of tiles a TileIndex has room for.
+#define TMAP_TIDX_MIN		64
+
+//! Bytes of a tile row that tile_hash() mixes per piece.
+#define TMAP_HASH_CHUNK		64
+
+//! Flips (1:H, 2:V) in order of preference for dib_find().
+static const int c_flipOrder[4]= { 0, 1, 3, 2 };
+
+
+// --------------------------------------------------------------------
+// TYPES
+// --------------------------------------------------------------------
+
+//! Hash index over the tiles of a tileset, for dib_find().
+/*!	Buckets are chained in tile order, so a lookup finds the same 
+	(lowest) tile index that a linear scan would. With flips, tiles 
+	are bucketed by a flip-invariant hash; see tidx_add(). 
+	The index points to each tile's pixels, which need not be in the 
+	tileset yet.
+*/
+struct TileIndex
+{
+	u32	mask;		//!< Pixel mask the hashes were made with.
+	int	flipN;		//!< Orientations bucketed together (1 or 4).
+	u32	bucketMask;	//!< Number of buckets - 1 (power of two).
+	int	*heads;		//!< First tile in each bucket; -1 if empty.
+	int	*tails;		//!< Last tile in each bucket.
+	int	*next;		//!< Next tile in the same bucket; -1 if last.
+	uint64_t *hashes;	//!< Unflipped hash of each tile.
+	u32	*keys;		//!< Bucket key of each tile, for rehashing.
+	const u8 **tiles;	//!< Pixels of each tile (any pitch).
+	int	*pitches;	//!< Row pitch of each tile.
+	u32	count;		//!< Number of indexed tiles.
+	u32	capacity;	//!< Tiles there's room for; doubles when full.
+};
+
 
 // --------------------------------------------------------------------
 // PROTOTYPES
@@ -23,7 +104,31 @@
 int dib_get_pbank(CLDIB *dib);
 bool dib_set_pbank(CLDIB *dib, int pbank);
 bool dib_tilecmp(CLDIB *dib, CLDIB *tileset, int tid, u32 mask);
-Mapsel dib_find(CLDIB *dib, CLDIB *tileset, u32 tileN, u32 flags);
+Mapsel dib_find(CLDIB *dib, CLDIB *tileset, u32 tileN, u32 flags, 
+	const TileIndex *tidx=NULL);
+
+static bool tidx_init(TileIndex *tidx, u32 mask, int flipN);
+static void tidx_free(TileIndex *tidx);
+static bool tidx_grow(TileIndex *tidx);
+static bool tidx_add(TileIndex *tidx, const u8 *tileD, int tileP, 
+	int tileW, int tileH, int nb, const uint64_t *hashes);
+static uint64_t tile_hash(const u8 *tileD, int tileW, int tileH, int tileP, 
+	int nb, u32 mask, int flip);
+static bool tile_cmp(const u8 *dibD, int dibP, const u8 *tileD, int tileP, 
+	int tileW, int tileH, int nb, u32 mask, int flip);
+static Mapsel tile_find(const u8 *tileD, int tileP, const uint64_t *hashes, 
+	int pbank, CLDIB *tileset, int tileH, u32 tileN, u32 flags, 
+	const TileIndex *tidx, bool bExact=true, bool *pFound=NULL);
+static void tile_lookup(const u8 *dibD, int dibP, const uint64_t *hashes, 
+	CLDIB *tileset, int tileH, u32 tileN, u32 mask, int flipN, 
+	const TileIndex *tidx, bool bExact, u32 found[4]);
+static int tile_get_pbank(const u8 *dibD, int dibW, int dibH, int dibP);
+static bool tile_grow(CLDIB *tileset, int tileH, u32 tileN);
+static bool tile_eq(const u8 *tileA, int pitchA, const u8 *tileB, int pitchB, 
+	int lineS, int tileH, u8 bmask);
+
+static uint tile_dist(const u8 *tileA, const u8 *tileB, 
+	int lineS, int pitch, int height, u32 mask);
 
 /*!	\}	*/
 
@@ -32,6 +137,18 @@ Mapsel dib_find(CLDIB *dib, CLDIB *tileset, u32 tileN, u32 flags);
 // FUNCTIONS
 // --------------------------------------------------------------------
 
+//! Index of the lowest set bit; \a mask may not be 0.
+static inline uint tmap_ctz(u32 mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
 uint tmap_get_tilecount(const Tilemap *tm)
 {
 	if(tm==NULL || tm->tiles==NULL || tm->tileHeight==0)
@@ -176,7 +293,8 @@ void tmap_init(Tilemap *tm, int mapW, int mapH, int tileW, int tileH, ETmapFlags
 *	@param extTiles	External tileset to use as a base for internal tileset.
 *	@return	Success status.
 *	@note	On bitdepth: Both bitmaps must be of the same bitdepth, 
-*	  which must be either multiples of 8 bpp.
+*	  which must be either multiples of 8 bpp. Anything below 8 bpp 
+*	  returns false.
 *	@note	If \a dib's sizes aren't multiples of the tiles, the incomplete
 *	  rows will be truncated.
 *	@note	\a extTiles is considered a column of tiles, not a matrix. 
@@ -193,6 +311,10 @@ bool tmap_init_from_dib(Tilemap *tm, CLDIB *dib, int tileW, int tileH,
 	int dibW, dibH, dibB, dibP;
 	dib_get_attr(dib, &dibW, &dibH, &dibB, &dibP);
 
+	// Tiles are hashed, compared and copied in whole bytes.
+	if(dibB < 8)
+		return false;
+
 	int mapW= dibW/tileW, mapH= dibH/tileH, mapN= mapW*mapH;
 
 	if(mapW==0 || mapH==0)
@@ -205,84 +327,199 @@ bool tmap_init_from_dib(Tilemap *tm, CLDIB *dib, int tileW, int tileH,
 	if(extTiles != NULL && dibB == dib_get_bpp(extTiles))
 	{
 		rdxN= dib_get_height(extTiles)/tileH;
-		rdx = dib_copy(extTiles, 0, 0, tileW, (mapN+rdxN)*tileH, false);
+		rdx = dib_copy(extTiles, 0, 0, tileW, rdxN*tileH, false);
 	}
 	else
 	{
 		rdxN= 1;					
-		rdx = dib_alloc(tileW, (mapN+rdxN)*tileH, dibB, NULL);
-		memset(dib_get_img(rdx), 0, dib_get_pitch(rdx)*tileH);
-		dib_pal_cpy(rdx, dib);
+		rdx = dib_alloc(tileW, rdxN*tileH, dibB, NULL);
+		if(rdx)
+			dib_pal_cpy(rdx, dib);
 	}
 
 	if(rdx == NULL)
 		return false;
 
+	u32 fixN= rdxN;		// Blank or external tiles; kept in place
 	Mapsel *mapD= (Mapsel*)malloc(mapW*mapH*sizeof(Mapsel)), me;
 
-	// Create temporary tile for comparisons
-	CLDIB *tmpDib= dib_copy(dib, 0, 0, tileW, tileH, false);
-	int tmpP= dib_get_pitch(tmpDib);	
-	u8 *tmpD= dib_get_img(tmpDib);
-	
-	int iy, tx, ty;
+	int nb= dibB/8, lineS= tileW*nb;
+	int flipN= (flags & TMAP_FLIP) ? 4 : 1;
+	u32 mask= (dibB == 8 && (flags & TMAP_PBANK)) ? 0x0F : 0xFFFFFFFF;
+	bool bHash= (flags & TMAP_TILE) != 0, bBank= (mask == 0x0F);
 
-	if(flags & TMAP_COLMAJOR)
+	// Index of the tileset for tile_find, with the mask it will use.
+	TileIndex tidx, *ptidx= bHash ? &tidx : NULL;
+	memset(&tidx, 0, sizeof(TileIndex));
+
+	// Map order to map cell.
+	auto cell_at= [&](int ii) -> int
 	{
-		for(tx=0; tx<mapW; tx++)
+		return (flags & TMAP_COLMAJOR) ? (ii%mapH)*mapW + ii/mapH : ii;
+	};
+
+	// Assign indices in map order, TMAP_CELL_BLOCK cells at a time. 
+	// This has to be serial: whether a cell makes a new tile depends 
+	// on all the cells before it. Each block is prepared and checked 
+	// in parallel, though:
+	// - Hash its cells and find their palette banks. These don't 
+	//   depend on the tileset, only on the cell itself.
+	// - Assign them, trusting the hashes (first pass only).
+	// - Check every match the hashes made. Should two different tiles 
+	//   ever share a hash, it's all redone with compares.
+	// New tiles are indexed straight from their cells and only copied 
+	// to the tileset at the end, so memory goes with the block size 
+	// and the number of unique tiles, not the size of the map.
+	uint64_t *blkHashes= bHash ? 
+		(uint64_t*)malloc(TMAP_CELL_BLOCK*flipN*sizeof(uint64_t)) : NULL;
+	u8 *blkBanks= bBank ? (u8*)malloc(TMAP_CELL_BLOCK) : NULL;
+	bool *found= (bool*)malloc(TMAP_CELL_BLOCK*sizeof(bool));
+	bool bOK= mapD && found && (!bHash || blkHashes) && (!bBank || blkBanks);
+	bool bExact= !bHash, bCollision= false;
+
+	auto cell_ptr= [&](int cell) -> const u8*
+	{
+		return dib_get_img_at(dib, (cell%mapW)*tileW, (cell/mapW)*tileH);
+	};
+
+	do
+	{
+		rdxN= fixN;
+		bCollision= false;
+		if(bOK && ptidx)
 		{
-			for(ty=0; ty<mapH; ty++)
+			bOK= tidx_init(ptidx, mask, flipN);
+			while(bOK && ptidx->count < fixN)
+				bOK= tidx_add(ptidx, dib_get_img_at(rdx, 0, ptidx->count*tileH), 
+					dib_get_pitch(rdx), tileW, tileH, nb, NULL);
+		}
+
+		int blk0;
+		for(blk0=0; bOK && !bCollision && blk0<mapN; blk0 += TMAP_CELL_BLOCK)
+		{
+			int ii, blkN= MIN(TMAP_CELL_BLOCK, mapN-blk0);
+
+			if(bHash || bBank)
 			{
-				// Prep comparison DIB
-				for(iy=0; iy<tileH; iy++)
-					memcpy(&tmpD[iy*tmpP], 
-						dib_get_img_at(dib, tx*tileW, ty*tileH+iy), tmpP);
+				par_for((blkN+TMAP_PAR_BLOCK-1)/TMAP_PAR_BLOCK, [&](int sub)
+				{
+					int jj, end= MIN(blkN, (sub+1)*TMAP_PAR_BLOCK);
+					for(jj=sub*TMAP_PAR_BLOCK; jj<end; jj++)
+					{
+						const u8 *cellD= cell_ptr(cell_at(blk0+jj));
+
+						if(bHash)
+							for(int flip=0; flip<flipN; flip++)
+								blkHashes[jj*flipN+flip]= tile_hash(cellD, 
+									tileW, tileH, dibP, nb, mask, flip);
+						if(bBank)
+							blkBanks[jj]= tile_get_pbank(cellD, tileW, tileH, dibP);
+					}
+				});
+			}
 
-				me= dib_find(tmpDib, rdx, rdxN, flags);
+			for(ii=0; ii<blkN; ii++)
+			{
+				const u8 *cellD= cell_ptr(cell_at(blk0+ii));
+				const uint64_t *hashes= bHash ? &blkHashes[ii*flipN] : NULL;
+
+				me= tile_find(cellD, dibP, hashes, bBank ? blkBanks[ii] : 0, 
+					rdx, tileH, rdxN, flags, ptidx, bExact, &found[ii]);
 
 				// Not found? Add to tileset
-				if(me.index() >= rdxN)
+				if((u32)me.index() >= rdxN)
 				{
-					memcpy(dib_get_img_at(rdx, 0, tileH*rdxN), tmpD,
-						dib_get_size_img(tmpDib));
 					rdxN++;
+					if(ptidx && !tidx_add(ptidx, cellD, dibP, 
+							tileW, tileH, nb, hashes))
+					{
+						bOK= false;
+						break;
+					}
 				}
 
-				mapD[tx*mapH+ty]= me;
+				mapD[blk0+ii]= me;
 			}
+
+			if(!bOK || bExact)
+				continue;
+
+			std::atomic<bool> bBad(false);
+			par_for((blkN+TMAP_PAR_BLOCK-1)/TMAP_PAR_BLOCK, [&](int sub)
+			{
+				int jj, end= MIN(blkN, (sub+1)*TMAP_PAR_BLOCK);
+				for(jj=sub*TMAP_PAR_BLOCK; jj<end && !bBad; jj++)
+				{
+					if(!found[jj])
+						continue;
+
+					Mapsel mm= mapD[blk0+jj];
+					u32 tid= mm.index();
+					int flip= (mm.value_ & ME_FLIP_MASK)>>ME_FLIP_SHIFT;
+					if(!tile_cmp(cell_ptr(cell_at(blk0+jj)), dibP, 
+							ptidx->tiles[tid], ptidx->pitches[tid], 
+							tileW, tileH, nb, mask, flip))
+						bBad= true;
+				}
+			});
+			bCollision= bBad;
 		}
-		std::swap(mapW, mapH);
-	}
-	else
+
+		if(bCollision)
+		{
+			tidx_free(ptidx);
+			bExact= true;
+		}
+	} while(bCollision);
+
+	free(found);
+	free(blkBanks);
+	free(blkHashes);
+
+	// Make room for the new tiles and copy them, a block at a time.
+	// Without reduction, every cell is a new tile, in map order.
+	// NOTE: the fixed tiles in the index point into rdx, which may 
+	// move now; only the new ones (in the source dib) are used.
+	int newN= rdxN-fixN;
+	if(!bOK || !tile_grow(rdx, tileH, rdxN))
 	{
-	for(ty=0; ty<mapH; ty++)
+		if(ptidx)
+			tidx_free(ptidx);
+		free(mapD);
+		dib_free(rdx);
+		return false;
+	}
+
+	int rdxP= dib_get_pitch(rdx);
+	par_for((newN+TMAP_PAR_BLOCK-1)/TMAP_PAR_BLOCK, [&](int blk)
 	{
-		for(tx=0; tx<mapW; tx++)
+		int jj, end= MIN(newN, (blk+1)*TMAP_PAR_BLOCK);
+		for(jj=blk*TMAP_PAR_BLOCK; jj<end; jj++)
 		{
-			// Prep comparison DIB
-			for(iy=0; iy<tileH; iy++)
-				memcpy(&tmpD[iy*tmpP], 
-					dib_get_img_at(dib, tx*tileW, ty*tileH+iy), tmpP);
-			
-			me= dib_find(tmpDib, rdx, rdxN, flags);
-
-			// Not found? Add to tileset
-				if(me.index() >= rdxN)
+			const u8 *tileD;
+			int tileP;
+			if(ptidx)
+			{
+				tileD= ptidx->tiles[fixN+jj];
+				tileP= ptidx->pitches[fixN+jj];
+			}
+			else
 			{
-				memcpy(dib_get_img_at(rdx, 0, tileH*rdxN), tmpD,
-					dib_get_size_img(tmpDib));
-				rdxN++;
+				tileD= cell_ptr(cell_at(jj));
+				tileP= dibP;
 			}
 
-			mapD[ty*mapW+tx]= me;
+			u8 *rdxD= dib_get_img_at(rdx, 0, (fixN+jj)*tileH);
+			for(int iy=0; iy<tileH; iy++)
+				memcpy(&rdxD[iy*rdxP], &tileD[iy*tileP], lineS);
 		}
-	}
-	}
+	});
 
-	// Shrink tileset
-	dib_free(tmpDib);
-	tmpDib= dib_copy(rdx, 0, 0, tileW, rdxN*tileH, false);
-	dib_free(rdx);
+	if(ptidx)
+		tidx_free(ptidx);
+
+	if(flags & TMAP_COLMAJOR)
+		std::swap(mapW, mapH);
 
 	// Attach map and tileset to tmap
 	free(tm->data);
@@ -293,9 +530,105 @@ bool tmap_init_from_dib(Tilemap *tm, CLDIB *dib, int tileW, int tileH,
 	tm->data= mapD;
 	tm->tileWidth= tileW;
 	tm->tileHeight= tileH;
-	tm->tiles= tmpDib;
+	tm->tiles= rdx;
 	tm->flags= flags;
 
+	// Chain the new tiles; the initial ones (blank or external) stay put.
+	// Without reduction there's no tileset of its own to reorder.
+	if((flags & TMAP_ORDER) && (flags & TMAP_TILE))
+		tmap_reorder(tm, fixN);
+
+	return true;
+}
+
+//! Reorder the tileset of \a tm for compression locality.
+/*!	Greedy nearest-neighbour chain: starting from the last fixed tile,
+*	each next tile is the unplaced one closest to its predecessor, so 
+*	that similar tiles end up next to each other and LZ77 can reach 
+*	them. The map indices are remapped to match.
+*	@param tm		Tilemap to reorder.
+*	@param tileFixed	Number of leading tiles that keep their place.
+*	  Tile 0 is always kept.
+*	@return	Success status.
+*	@note	Assumes the tileset is a column. Distances are O(n&sup2;) in 
+*	  the number of tiles; fine for anything that fits in a map.
+*/
+bool tmap_reorder(Tilemap *tm, uint tileFixed)
+{
+	uint tileN= tmap_get_tilecount(tm);
+	if(tileN == 0 || tm->data == NULL)
+		return false;
+
+	tileFixed= MAX(tileFixed, 1);
+	if(tileFixed+1 >= tileN)
+		return true;
+
+	CLDIB *tiles= tm->tiles;
+	int tileH= tm->tileHeight;
+	int tileB= dib_get_bpp(tiles), tileP= dib_get_pitch(tiles);
+	int lineS= tm->tileWidth*tileB/8, tileS= tileP*tileH;
+	u32 mask= (tileB == 8 && (tm->flags & TMAP_PBANK)) ? 0x0F : 0xFF;
+	u8 *tileD= dib_get_img(tiles);
+
+	uint ii, jj;
+	uint *order= (uint*)malloc(tileN*sizeof(uint));	// new -> old
+	uint *remap= (uint*)malloc(tileN*sizeof(uint));	// old -> new
+	bool *used= (bool*)malloc(tileN*sizeof(bool));
+
+	for(ii=0; ii<tileN; ii++)
+	{
+		order[ii]= ii;
+		used[ii]= ii<tileFixed;
+	}
+
+	// Ties go to the lowest original index, so that an already 
+	// well-ordered tileset stays as it is.
+	for(ii=tileFixed; ii<tileN; ii++)
+	{
+		const u8 *prevD= &tileD[order[ii-1]*tileS];
+		uint best= tileN, bestDist= 0xFFFFFFFF;
+
+		for(jj=tileFixed; jj<tileN; jj++)
+		{
+			if(used[jj])
+				continue;
+
+			uint dist= tile_dist(prevD, &tileD[jj*tileS], 
+				lineS, tileP, tileH, mask);
+			if(dist < bestDist)
+			{
+				best= jj;
+				bestDist= dist;
+				if(dist == 0)
+					break;
+			}
+		}
+		order[ii]= best;
+		used[best]= true;
+	}
+
+	// Shuffle the tiles and remap the map.
+	u8 *tmpD= (u8*)malloc(tileN*tileS);
+	memcpy(tmpD, tileD, tileN*tileS);
+	for(ii=tileFixed; ii<tileN; ii++)
+		memcpy(&tileD[ii*tileS], &tmpD[order[ii]*tileS], tileS);
+
+	for(ii=0; ii<tileN; ii++)
+		remap[order[ii]]= ii;
+
+	int ime, mapN= tm->width*tm->height;
+	for(ime=0; ime<mapN; ime++)
+	{
+		uint tid= tm->data[ime].index();
+		if(tid < tileN)
+			tm->data[ime].index(remap[tid]);
+	}
+
+	free(tmpD);
+	free(used);
+	free(remap);
+	free(order);
+
 	return true;
 }
 
@@ -518,17 +851,52 @@ int dib_get_pbank(CLDIB *dib)
 	if(dibB != 8)
 		return 0;
 
-	int ix, iy, clrid;
-	u8 *dibD= dib_get_img(dib);
+	return tile_get_pbank(dib_get_img(dib), dibW, dibH, dibP);
+}
+
+//! Palette bank of the first pixel with a non-zero low nybble (8bpp).
+static int tile_get_pbank(const u8 *dibD, int dibW, int dibH, int dibP)
+{
+	int ix, iy;
+	const u8 *dibL;
+
+	// Contiguous rows can be scanned as one.
+	if(dibP == dibW)
+	{
+		dibW *= dibH;
+		dibH= 1;
+	}
 
 	for(iy=0; iy<dibH; iy++)
 	{
-		for(ix=0; ix<dibW; ix++)
+		dibL= &dibD[iy*dibP];
+		ix= 0;
+
+#if defined(__AVX2__)
+		const __m256i nybble= _mm256_set1_epi8(0x0F);
+		for( ; ix+32 <= dibW; ix += 32)
+		{
+			__m256i v= _mm256_loadu_si256((const __m256i*)&dibL[ix]);
+			u32 zero= _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+				_mm256_and_si256(v, nybble), _mm256_setzero_si256()));
+			if(zero != 0xFFFFFFFF)
+				return dibL[ix + tmap_ctz(~zero)]>>4;
+		}
+#elif defined(__SSE2__) || defined(_M_X64)
+		const __m128i nybble= _mm_set1_epi8(0x0F);
+		for( ; ix+16 <= dibW; ix += 16)
 		{
-			clrid= dibD[iy*dibP+ix];
-			if(clrid&0x0F)
-				return (clrid>>4)&0x0F;
+			__m128i v= _mm_loadu_si128((const __m128i*)&dibL[ix]);
+			u32 zero= _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_and_si128(v, nybble), _mm_setzero_si128()));
+			if(zero != 0xFFFF)
+				return dibL[ix + tmap_ctz(~zero)]>>4;
 		}
+#endif
+
+		for( ; ix<dibW; ix++)
+			if(dibL[ix]&0x0F)
+				return dibL[ix]>>4;
 	}
 	return 0;
 }
@@ -545,13 +913,45 @@ bool dib_set_pbank(CLDIB *dib, int pbank)
 		return false;
 
 	int ix, iy;
-	u8 *dibD= dib_get_img(dib);
+	u8 *dibD= dib_get_img(dib), *dibL;
 
 	pbank <<= 4;
 
+	// Contiguous rows can be done as one.
+	if(dibP == dibW)
+	{
+		dibW *= dibH;
+		dibH= 1;
+	}
+
 	for(iy=0; iy<dibH; iy++)
-		for(ix=0; ix<dibW; ix++)
-			dibD[iy*dibP+ix]= (dibD[iy*dibP+ix]&15) | pbank;
+	{
+		dibL= &dibD[iy*dibP];
+		ix= 0;
+
+#if defined(__AVX2__)
+		const __m256i nybble= _mm256_set1_epi8(0x0F);
+		const __m256i bank= _mm256_set1_epi8((char)pbank);
+		for( ; ix+32 <= dibW; ix += 32)
+		{
+			__m256i v= _mm256_loadu_si256((const __m256i*)&dibL[ix]);
+			v= _mm256_or_si256(_mm256_and_si256(v, nybble), bank);
+			_mm256_storeu_si256((__m256i*)&dibL[ix], v);
+		}
+#elif defined(__SSE2__) || defined(_M_X64)
+		const __m128i nybble= _mm_set1_epi8(0x0F);
+		const __m128i bank= _mm_set1_epi8((char)pbank);
+		for( ; ix+16 <= dibW; ix += 16)
+		{
+			__m128i v= _mm_loadu_si128((const __m128i*)&dibL[ix]);
+			v= _mm_or_si128(_mm_and_si128(v, nybble), bank);
+			_mm_storeu_si128((__m128i*)&dibL[ix], v);
+		}
+#endif
+
+		for( ; ix<dibW; ix++)
+			dibL[ix]= (dibL[ix]&15) | pbank;
+	}
 
 	return true;
 }
@@ -567,31 +967,9 @@ bool dib_tilecmp(CLDIB *dib, CLDIB *tileset, int tid, u32 dwMask)
 	int tileW, tileH, tileB, tileP;
 	dib_get_attr(dib, &tileW, &tileH, &tileB, &tileP);
 
-	int ix, iy, ib, nb;		// x, y, byte indices; #bytes/pixel
-
-	nb= tileB/8;
-
-	u32 dibP= dib_get_pitch(dib);
-	u8 *dibD= dib_get_img(dib), *dibL;
-	u8 *tileD= dib_get_img_at(tileset, 0, tid*tileH), *tileL;
-
-		for(iy=0; iy<tileH; iy++)
-		{
-		dibL = &dibD[iy*dibP];
-		tileL= &tileD[iy*tileP];
-		for(ix=0; ix<tileW; ix++)
-		{
-			u32 mask= dwMask;
-			for(ib=0; ib<nb; ib++)
-			{
-				if((*dibL++ ^ *tileL++) & mask)
-					return false;
-		mask >>= 8;
-	}
-		}
-	}
-	
-	return true;	
+	return tile_cmp(dib_get_img(dib), tileP, 
+		dib_get_img_at(tileset, 0, tid*tileH), dib_get_pitch(tileset), 
+		tileW, tileH, tileB/8, dwMask, 0);
 }
 
 
@@ -599,24 +977,53 @@ bool dib_tilecmp(CLDIB *dib, CLDIB *tileset, int tid, u32 dwMask)
 /*!	@param dib		Dib to compare.
 	@param tileset	Tileset to find \a dib in.
 	@param tileN	Number of used tiles in \a tileset.
-	@param mask		Color mask for pixels.
+	@param flags	Tilemap flags (TMAP_*).
+	@param tidx		Hash index of \a tileset, or NULL to scan it.
 	@return	Map entry with found information. If not found, the index 
 	  will be equal to \a tileN.
 	@note	\a dib represents a single tile. As such, it gives the 
-	  size and bitdepth of the tiles. If you want flipped tiled, 
-	  flip \a dib outside.
+	  size and bitdepth of the tiles. Flips are tried in place, in 
+	  the order straight, H, HV, V.
+*/
+Mapsel dib_find(CLDIB *dib, CLDIB *tileset, u32 tileN, u32 flags, 
+	const TileIndex *tidx)
+{
+	int pbank= 0;
+	if( dib_get_bpp(dib) == 8 && (flags & TMAP_PBANK) )
+		pbank= dib_get_pbank(dib);
+
+	return tile_find(dib_get_img(dib), dib_get_pitch(dib), NULL, pbank, 
+		tileset, dib_get_height(dib), tileN, flags, tidx);
+}
+
+//! Find a tile given by its pixels inside a tileset.
+/*!	Does the work for dib_find(); see there.
+	@param tileD	Tile pixels, \a tileP bytes per row.
+	@param hashes	The tile's hashes (tile_hash()) for each searched 
+	  flip, or NULL to have them computed.
+	@param pbank	Palette bank of the tile (for TMAP_PBANK).
+	@param tileH	Tile height. The width and bitdepth come from 
+	  \a tileset.
+	@param bExact	If false, equal hashes count as a match without 
+	  comparing the pixels; the caller has to check them later.
+	@param pFound	If not NULL, receives whether a match was found. 
+	  The index alone can't tell once \a tileN no longer fits in it.
 */
-Mapsel dib_find(CLDIB *dib, CLDIB *tileset, u32 tileN, u32 flags)
+static Mapsel tile_find(const u8 *tileD, int tileP, const uint64_t *hashes, 
+	int pbank, CLDIB *tileset, int tileH, u32 tileN, u32 flags, 
+	const TileIndex *tidx, bool bExact, bool *pFound)
 {
-	int i;
-	int dibB= dib_get_bpp(dib);
-	u32 mask;
+	int ii;
+	u32 mask, found[4];
 	Mapsel me= { tileN };
 
-	if( dibB == 8 && (flags & TMAP_PBANK) )
+	if(pFound)
+		*pFound= false;
+
+	if( dib_get_bpp(tileset) == 8 && (flags & TMAP_PBANK) )
 	{
 		mask= 0x0F;
-		me.pbank(dib_get_pbank(dib));
+		me.pbank(pbank);
 	}
 	else
 		mask= 0xFFFFFFFF;
@@ -627,63 +1034,501 @@ Mapsel dib_find(CLDIB *dib, CLDIB *tileset, u32 tileN, u32 flags)
 		me.index(tileN);
 		return me;
 	}
-	
 
-	// --- Straight ---
-	for(i=0; i<tileN; i++)
+	int flipN= (flags & TMAP_FLIP) ? 4 : 1;
+	tile_lookup(tileD, tileP, hashes, tileset, tileH, tileN, mask, flipN, 
+		tidx, bExact, found);
+
+	for(ii=0; ii<flipN; ii++)
 	{
-		if(dib_tilecmp(dib, tileset, i, mask))
+		int flip= c_flipOrder[ii];
+		if(found[flip] < tileN)
 		{
-			me.index(i);
+			me.index(found[flip]);
+			me.value_ |= flip<<ME_FLIP_SHIFT;
+			if(pFound)
+				*pFound= true;
 			return me;
 		}
 	}
 
-	// --- Flips, if requested ---
-	//# TODO: could be compressed a little.
-	//# PONDER: taking care of flipping inside dib_tilecmp 
-	//#		could be faster, but I'm not sure.
+	me.index(tileN);
+	return me;
+}
 
-	if(~flags & TMAP_FLIP)
-		return me;
 
-	dib= dib_clone(dib);	// Create temp copy for flipping
+//! Resize a tile column to \a tileN tiles, in place.
+/*!	Reallocates the dib's data instead of copying to a new dib, so 
+*	the tileset can start small and grow to what it needs. Added 
+*	rows are zeroed.
+*	@param tileset	Top-down tile column.
+*	@param tileH	Tile height.
+*	@param tileN	New number of tiles.
+*	@return	Success status; \a tileset is untouched on failure.
+*/
+static bool tile_grow(CLDIB *tileset, int tileH, u32 tileN)
+{
+	if(tileset == NULL || !dib_is_topdown(tileset))
+		return false;
 
-	do
+	int oldS= dib_get_pitch(tileset)*dib_get_height(tileset);
+	int newH= tileN*tileH, newS= dib_get_pitch(tileset)*newH;
+	int headS= dib_get_img(tileset) - tileset->data;
+
+	if(newS == oldS)
+		return true;
+
+	BYTE *data= (BYTE*)realloc(tileset->data, headS+newS);
+	if(data == NULL)
+		return false;
+
+	tileset->data= data;
+	if(newS > oldS)
+		memset(&data[headS+oldS], 0, newS-oldS);
+
+	BITMAPINFOHEADER *bmih= dib_get_hdr(tileset);
+	bmih->biHeight= -newH;
+	bmih->biSizeImage= newS;
+
+	return true;
+}
+
+// === Tile index =====================================================
+
+//! Set up an empty index, with room for TMAP_TIDX_MIN tiles.
+/*!	@return	Success status; on failure there's nothing to free.
+*/
+static bool tidx_init(TileIndex *tidx, u32 mask, int flipN)
+{
+	memset(tidx, 0, sizeof(TileIndex));
+	tidx->mask= mask;
+	tidx->flipN= flipN;
+
+	if(tidx_grow(tidx))
+		return true;
+
+	tidx_free(tidx);
+	return false;
+}
+
+static void tidx_free(TileIndex *tidx)
+{
+	free(tidx->heads);
+	free(tidx->tails);
+	free(tidx->next);
+	free(tidx->hashes);
+	free(tidx->keys);
+	free(tidx->tiles);
+	free(tidx->pitches);
+	memset(tidx, 0, sizeof(TileIndex));
+}
+
+//! Realloc \a *pdata to \a count items; leaves it alone on failure.
+template<class T>
+static bool tidx_realloc(T **pdata, u32 count)
+{
+	T *data= (T*)realloc((void*)*pdata, count*sizeof(T));
+	if(data == NULL)
+		return false;
+
+	*pdata= data;
+	return true;
+}
+
+//! Double the room in the index (or start it) and rehash.
+/*!	Buckets are twice the capacity. The tiles are relinked in tile 
+	order, so the chains stay in tile order as well.
+	@return	Success status; the index is still usable on failure.
+*/
+static bool tidx_grow(TileIndex *tidx)
+{
+	u32 tileMax= tidx->capacity ? 2*tidx->capacity : TMAP_TIDX_MIN;
+	u32 bucketN= 2*tileMax;
+
+	if( !tidx_realloc(&tidx->next, tileMax) || 
+		!tidx_realloc(&tidx->hashes, tileMax) || 
+		!tidx_realloc(&tidx->keys, tileMax) || 
+		!tidx_realloc(&tidx->tiles, tileMax) || 
+		!tidx_realloc(&tidx->pitches, tileMax) )
+		return false;
+
+	int *heads= (int*)malloc(bucketN*sizeof(int));
+	int *tails= (int*)malloc(bucketN*sizeof(int));
+	if(heads == NULL || tails == NULL)
 	{
-		// --- H-flip ---
-		dib_hflip(dib);
-		for(i=0; i<tileN; i++)
-			if(dib_tilecmp(dib, tileset, i, mask))
-				break;
-		if(i<tileN)
-		{	me.value_ |= ME_HFLIP;	break;				}
+		free(heads);
+		free(tails);
+		return false;
+	}
 
-		// --- HV-flip ---
-		dib_vflip(dib);
-		
-		for(i=0; i<tileN; i++)
-			if(dib_tilecmp(dib, tileset, i, mask))
-				break;
-		if(i<tileN)
-		{	me.value_ |= ME_HFLIP | ME_VFLIP;	break;	}
-
-		// --- V-flip ---
-		dib_hflip(dib);
-		me.value_ &= ~ME_HFLIP;
-		for(i=0; i<tileN; i++)
-			if(dib_tilecmp(dib, tileset, i, mask))
-				break;
-		if(i<tileN)
-		{	me.value_ |= ME_VFLIP;	break;				}
-
-	} while(0);
-	
-	dib_free(dib);
-	me.index(i);
+	free(tidx->heads);
+	free(tidx->tails);
+	tidx->heads= heads;
+	tidx->tails= tails;
+	tidx->bucketMask= bucketN-1;
+	tidx->capacity= tileMax;
 
-	return me;
+	memset(heads, 0xFF, bucketN*sizeof(int));
+	for(u32 tid=0; tid<tidx->count; tid++)
+	{
+		u32 bucket= tidx->keys[tid] & tidx->bucketMask;
+		tidx->next[tid]= -1;
+		if(heads[bucket] < 0)
+			heads[bucket]= tid;
+		else
+			tidx->next[tails[bucket]]= tid;
+		tails[bucket]= tid;
+	}
+
+	return true;
+}
+
+//! Add tile \a tidx->count, with pixels at \a tileD, to the index.
+/*!	With flips, the tile goes in the bucket of the smallest hash over 
+	its four orientations, so flipped copies of it land in the same 
+	bucket.
+	@param hashes	The tile's hashes for each of the \a tidx->flipN 
+	  flips if already known, or NULL.
+	@return	Success status; false if the index couldn't grow.
+	@note	\a tileD has to stay valid while the index is used.
+*/
+static bool tidx_add(TileIndex *tidx, const u8 *tileD, int tileP, 
+	int tileW, int tileH, int nb, const uint64_t *hashes)
+{
+	if(tidx->count == tidx->capacity && !tidx_grow(tidx))
+		return false;
+
+	int tid= tidx->count++;
+
+	uint64_t hash, canon;
+	hash= canon= hashes ? hashes[0] : 
+		tile_hash(tileD, tileW, tileH, tileP, nb, tidx->mask, 0);
+	for(int flip=1; flip<tidx->flipN; flip++)
+	{
+		uint64_t fhash= hashes ? hashes[flip] : 
+			tile_hash(tileD, tileW, tileH, tileP, nb, tidx->mask, flip);
+		canon= MIN(canon, fhash);
+	}
+
+	u32 bucket= (u32)canon & tidx->bucketMask;
+
+	tidx->hashes[tid]= hash;
+	tidx->keys[tid]= (u32)canon;
+	tidx->tiles[tid]= tileD;
+	tidx->pitches[tid]= tileP;
+	tidx->next[tid]= -1;
+	if(tidx->heads[bucket] < 0)
+		tidx->heads[bucket]= tid;
+	else
+		tidx->next[tidx->tails[bucket]]= tid;
+	tidx->tails[bucket]= tid;
+
+	return true;
+}
+
+//! Hash of a tile's pixels as seen with flip \a flip (1:H, 2:V).
+/*!	Masked like dib_tilecmp(). Reads the tile in flipped order, 
+	so nothing needs to be flipped or allocated. Each row goes 
+	through a small buffer in pieces of up to TMAP_HASH_CHUNK bytes, 
+	which are mixed in 8 bytes at a time. 64 bits, so that 
+	tmap_init_from_dib can trust it until the pixels are checked.
+*/
+static uint64_t tile_hash(const u8 *tileD, int tileW, int tileH, int tileP, 
+	int nb, u32 mask, int flip)
+{
+	int ix, iy, ib, ii, pieceW= TMAP_HASH_CHUNK/nb;
+	u8 line[TMAP_HASH_CHUNK+8];
+	uint64_t word, wordMask, hash= 0x9E3779B97F4A7C15ULL ^ (tileW*nb);
+
+	// Same mask for each byte: apply it per word.
+	bool bUniform= (nb == 1 || mask == 0xFFFFFFFF);
+	wordMask= bUniform ? (mask & 0xFF) * 0x0101010101010101ULL : ~0ULL;
+
+	for(iy=0; iy<tileH; iy++)
+	{
+		const u8 *tileL= &tileD[((flip & 2) ? tileH-1-iy : iy)*tileP];
+
+		for(ix=0; ix<tileW; ix += pieceW)
+		{
+			int pixN= MIN(pieceW, tileW-ix), lineS= pixN*nb;
+
+			if(!(flip & 1) && bUniform)
+				memcpy(line, &tileL[ix*nb], lineS);
+			else if(nb == 1)
+			{
+				const u8 *src= &tileL[tileW-1-ix];
+				for(ii=0; ii<pixN; ii++)
+					line[ii]= src[-ii] & mask;
+			}
+			else
+			{
+				for(ii=0; ii<pixN; ii++)
+				{
+					const u8 *src= 
+						&tileL[((flip & 1) ? tileW-1-ix-ii : ix+ii)*nb];
+					u32 bmask= bUniform ? 0xFFFFFFFF : mask;
+					for(ib=0; ib<nb; ib++, bmask >>= 8)
+						line[ii*nb+ib]= src[ib] & bmask;
+				}
+			}
+			memset(&line[lineS], 0, 8);
+
+			for(ii=0; ii<lineS; ii += 8)
+			{
+				memcpy(&word, &line[ii], 8);
+				hash= (hash ^ (word & wordMask)) * 0xFF51AFD7ED558CCDULL;
+				hash ^= hash >> 32;
+			}
+		}
+	}
+
+	hash ^= hash >> 29;
+	hash *= 0xC4CEB9FE1A85EC53ULL;
+	return hash ^ (hash >> 32);
 }
 
+//! Compare \a dibD seen with flip \a flip (1:H, 2:V) to tile \a tileD.
+static bool tile_cmp(const u8 *dibD, int dibP, const u8 *tileD, int tileP, 
+	int tileW, int tileH, int nb, u32 mask, int flip)
+{
+	// Same mask for every byte and no h-flip: whole rows at once. 
+	// A v-flip is just a negative pitch.
+	if(!(flip & 1) && (nb == 1 || mask == 0xFFFFFFFF))
+	{
+		if(flip & 2)
+		{
+			dibD += (tileH-1)*dibP;
+			dibP= -dibP;
+		}
+		return tile_eq(dibD, dibP, tileD, tileP, tileW*nb, tileH, 
+			(u8)(nb == 1 ? mask : 0xFF));
+	}
+
+	int ix, iy, ib;
+	int dx= (flip & 1) ? -nb : nb;
+
+	for(iy=0; iy<tileH; iy++)
+	{
+		const u8 *dibL= &dibD[((flip & 2) ? tileH-1-iy : iy)*dibP];
+		const u8 *tileL= &tileD[iy*tileP];
+		if(flip & 1)
+			dibL += (tileW-1)*nb;
+
+		for(ix=0; ix<tileW; ix++)
+		{
+			u32 bmask= mask;
+			for(ib=0; ib<nb; ib++)
+			{
+				if((dibL[ib] ^ *tileL++) & bmask)
+					return false;
+				bmask >>= 8;
+			}
+			dibL += dx;
+		}
+	}
+
+	return true;
+}
+
+//! Masked compare of two tiles of \a lineS bytes by \a tileH rows.
+/*!	\a LINE_S and \a TILE_H are fixed, so the loops unroll. 
+	The xors of all rows are or-ed together and tested once.
+*/
+template<int LINE_S, int TILE_H>
+static inline bool tile_eq_fixed(const u8 *tileA, int pitchA, 
+	const u8 *tileB, int pitchB, u8 bmask)
+{
+	int ix, iy;
+
+#if defined(__SSE2__) || defined(_M_X64)
+	__m128i acc= _mm_setzero_si128();
+
+	if(LINE_S == 8 && pitchA == 8 && pitchB == 8)
+	{
+		// 8x8@8 in a tile strip: 64 contiguous bytes.
+		for(ix=0; ix<8*TILE_H; ix += 16)
+			acc= _mm_or_si128(acc, _mm_xor_si128(
+				_mm_loadu_si128((const __m128i*)&tileA[ix]), 
+				_mm_loadu_si128((const __m128i*)&tileB[ix])));
+	}
+	else
+	{
+		for(iy=0; iy<TILE_H; iy++)
+		{
+			const u8 *lineA= &tileA[iy*pitchA], *lineB= &tileB[iy*pitchB];
+
+			if(LINE_S == 8)
+			{
+				acc= _mm_or_si128(acc, _mm_xor_si128(
+					_mm_loadl_epi64((const __m128i*)lineA), 
+					_mm_loadl_epi64((const __m128i*)lineB)));
+				continue;
+			}
+#if defined(__AVX2__)
+			if(LINE_S == 32)
+			{
+				__m256i x= _mm256_xor_si256(
+					_mm256_loadu_si256((const __m256i*)lineA), 
+					_mm256_loadu_si256((const __m256i*)lineB));
+				acc= _mm_or_si128(acc, _mm_or_si128(
+					_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1)));
+				continue;
+			}
+#endif
+			for(ix=0; ix<LINE_S; ix += 16)
+				acc= _mm_or_si128(acc, _mm_xor_si128(
+					_mm_loadu_si128((const __m128i*)&lineA[ix]), 
+					_mm_loadu_si128((const __m128i*)&lineB[ix])));
+		}
+	}
+
+	acc= _mm_and_si128(acc, _mm_set1_epi8((char)bmask));
+	return _mm_movemask_epi8(
+		_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+#else
+	uint64_t acc= 0, wordA, wordB;
+
+	for(iy=0; iy<TILE_H; iy++)
+	{
+		const u8 *lineA= &tileA[iy*pitchA], *lineB= &tileB[iy*pitchB];
+		for(ix=0; ix<LINE_S; ix += 8)
+		{
+			memcpy(&wordA, &lineA[ix], 8);
+			memcpy(&wordB, &lineB[ix], 8);
+			acc |= wordA ^ wordB;
+		}
+	}
+
+	return (acc & (bmask * 0x0101010101010101ULL)) == 0;
+#endif
+}
+
+//! Masked compare of two tiles of \a lineS bytes by \a tileH rows.
+/*!	Every byte is compared under \a bmask. The common tile shapes 
+	(8x8 and 16x16 at 8 and 16bpp) have their own kernel.
+*/
+static bool tile_eq(const u8 *tileA, int pitchA, const u8 *tileB, int pitchB, 
+	int lineS, int tileH, u8 bmask)
+{
+	if(tileH == 8)
+	{
+		if(lineS == 8)		// 8x8@8
+			return tile_eq_fixed< 8,  8>(tileA, pitchA, tileB, pitchB, bmask);
+		if(lineS == 16)		// 8x8@16
+			return tile_eq_fixed<16,  8>(tileA, pitchA, tileB, pitchB, bmask);
+	}
+	else if(tileH == 16)
+	{
+		if(lineS == 16)		// 16x16@8
+			return tile_eq_fixed<16, 16>(tileA, pitchA, tileB, pitchB, bmask);
+		if(lineS == 32)		// 16x16@16
+			return tile_eq_fixed<32, 16>(tileA, pitchA, tileB, pitchB, bmask);
+	}
+
+	// Anything else (-tw/-th): row by row.
+	int ix, iy;
+	for(iy=0; iy<tileH; iy++)
+	{
+		const u8 *lineA= &tileA[iy*pitchA], *lineB= &tileB[iy*pitchB];
+		if(bmask == 0xFF)
+		{
+			if(memcmp(lineA, lineB, lineS) != 0)
+				return false;
+			continue;
+		}
+		for(ix=0; ix<lineS; ix++)
+			if((lineA[ix] ^ lineB[ix]) & bmask)
+				return false;
+	}
+
+	return true;
+}
+
+//! Find the first tile in \a tileset equal to \a dib, per orientation.
+/*!	@param dibD		Pixels of the tile to look for, \a dibP bytes per row.
+	@param hashes	Its hashes per flip, or NULL.
+	@param bExact	Compare the pixels of tiles with equal hashes (with 
+	  an index; without one every tile is compared).
+	@param found	Receives, indexed by flip (1:H, 2:V), the lowest 
+	  matching tile, or \a tileN if none. Only the first \a flipN 
+	  orientations of c_flipOrder are searched, and the search may 
+	  stop once a more preferred orientation has been found.
+*/
+static void tile_lookup(const u8 *dibD, int dibP, const uint64_t *hashes, 
+	CLDIB *tileset, int tileH, u32 tileN, u32 mask, int flipN, 
+	const TileIndex *tidx, bool bExact, u32 found[4])
+{
+	int ii, tid;
+	int tileW= dib_get_width(tileset), tileP= dib_get_pitch(tileset);
+	int nb= dib_get_bpp(tileset)/8;
+
+	for(ii=0; ii<4; ii++)
+		found[ii]= tileN;
+
+	// No (usable) index: scan every tile, once per orientation.
+	if(tidx == NULL || tidx->mask != mask || tidx->flipN != flipN)
+	{
+		for(ii=0; ii<flipN; ii++)
+		{
+			int flip= c_flipOrder[ii];
+			for(tid=0; (u32)tid<tileN; tid++)
+			{
+				if(tile_cmp(dibD, dibP, dib_get_img_at(tileset, 0, tid*tileH), 
+					tileP, tileW, tileH, nb, mask, flip))
+				{
+					found[flip]= tid;
+					return;
+				}
+			}
+		}
+		return;
+	}
+
+	// All orientations share one bucket; walk it once.
+	uint64_t ownHashes[4], canon= ~(uint64_t)0;
+	if(hashes == NULL)
+	{
+		for(ii=0; ii<flipN; ii++)
+			ownHashes[ii]= tile_hash(dibD, tileW, tileH, dibP, nb, mask, ii);
+		hashes= ownHashes;
+	}
+	for(ii=0; ii<flipN; ii++)
+		canon= MIN(canon, hashes[ii]);
+
+	for(tid= tidx->heads[(u32)canon & tidx->bucketMask]; 
+		tid >= 0 && (u32)tid < tileN; tid= tidx->next[tid])
+	{
+		for(ii=0; ii<flipN; ii++)
+		{
+			int flip= c_flipOrder[ii];
+			if(found[flip] < tileN || hashes[flip] != tidx->hashes[tid])
+				continue;
+			if(!bExact || tile_cmp(dibD, dibP, tidx->tiles[tid], 
+					tidx->pitches[tid], tileW, tileH, nb, mask, flip))
+				found[flip]= tid;
+		}
+
+		if(found[0] < tileN)	// Nothing beats straight.
+			break;
+	}
+}
+
+//! Number of differing pixel bytes between two tiles.
+static uint tile_dist(const u8 *tileA, const u8 *tileB, 
+	int lineS, int pitch, int height, u32 mask)
+{
+	int ix, iy;
+	uint dist= 0;
+
+	for(iy=0; iy<height; iy++)
+	{
+		for(ix=0; ix<lineS; ix++)
+			dist += ((tileA[ix]^tileB[ix]) & mask) != 0;
+		tileA += pitch;
+		tileB += pitch;
+	}
+
+	return dist;
+}
 
 // EOF
@@ -41,6 +41,7 @@ enum TmapFlags {
 	TMAP_TILE		= ( 1<< 0),		//!< Allows unique tile mapping.
 	TMAP_FLIP		= ( 1<< 1),		//!< Allows flipped tiles.
 	TMAP_PBANK		= ( 1<< 2),		//!< Allows pal swapping (8bpp only)
+	TMAP_ORDER		= ( 1<< 3),		//!< Reorder the new tiles for compression locality. Needs TMAP_TILE.
 	TMAP_COLMAJOR	= ( 1<< 7),		//!< Traverse the image by colums during the mapping procedure.
 	TMAP_DEFAULT	= TMAP_TILE		//!< Simple mapping: uniques without flipping or palswap.
 };
@@ -125,6 +126,7 @@ void tmap_init(Tilemap *tm, int mapWidth, int mapHeight, int tileW, int tileH,
 	ETmapFlags flags);
 bool tmap_init_from_dib(Tilemap *tm, CLDIB *dib, int tileWidth, int tileHeight, 
 	ETmapFlags flags, CLDIB *extTiles);
+bool tmap_reorder(Tilemap *tm, uint tileFixed);
 
 CLDIB *tmap_render(Tilemap *tm, const RECT *rect);
 
@@ -16,10 +16,39 @@
 #include "cprs.h"
 
 
+// --------------------------------------------------------------------
+// PROTOTYPES 
+// --------------------------------------------------------------------
+
+static uint cprs_compress_codec(CprsSink *sink, const RECORD *src, 
+	ECprsTag tag, u32 flags, CprsContext *ctx);
+
+
 // --------------------------------------------------------------------
 // FUNCTIONS 
 // --------------------------------------------------------------------
 
+//! Create a compression context.
+CprsContext *cprs_alloc()
+{
+	CprsContext *ctx= (CprsContext*)malloc(sizeof(CprsContext));
+	if(ctx == NULL)
+		return NULL;
+
+	memset(ctx, 0, sizeof(CprsContext));
+	return ctx;
+}
+
+//! Destroy a compression context and its scratch buffers.
+void cprs_free(CprsContext *ctx)
+{
+	if(ctx == NULL)
+		return;
+
+	lz77_free(ctx->lz77);
+	free(ctx);
+}
+
 //! Create the compression header word (little endian)
 u32	cprs_create_header(uint size, u8 tag)
 {
@@ -32,97 +61,347 @@ u32	cprs_create_header(uint size, u8 tag)
 	return *(u32*)data;
 }
 
+//! Start a growable buffer sink.
+/*!	\param capacity	Initial size of the buffer; 0 to allocate on 
+		first use.
+*/
+void cprs_sink_buffer(CprsSink *sink, uint capacity)
+{
+	memset(sink, 0, sizeof(CprsSink));
+	sink->type= CPRS_SINK_BUFFER;
+	if(capacity > 0)
+	{
+		sink->data= (BYTE*)malloc(capacity);
+		sink->capacity= sink->data ? capacity : 0;
+	}
+}
+
+//! Start a sink on a preallocated region of \a capacity bytes.
+void cprs_sink_region(CprsSink *sink, void *data, uint capacity)
+{
+	memset(sink, 0, sizeof(CprsSink));
+	sink->type= CPRS_SINK_REGION;
+	sink->data= (BYTE*)data;
+	sink->capacity= capacity;
+}
+
+//! Start a sink that writes to \a fp.
+void cprs_sink_file(CprsSink *sink, FILE *fp)
+{
+	memset(sink, 0, sizeof(CprsSink));
+	sink->type= CPRS_SINK_FILE;
+	sink->fp= fp;
+}
+
+//! Release the sink's memory. The file or region stays with the caller.
+/*!	\return	False if any write failed.
+*/
+bool cprs_sink_close(CprsSink *sink)
+{
+	bool bOK= !sink->bError;
+
+	if(sink->type == CPRS_SINK_BUFFER)
+		free(sink->data);
+	free(sink->stage);
+	memset(sink, 0, sizeof(CprsSink));
+
+	return bOK;
+}
+
+//! Move the contents of a buffer sink into \a rec and close the sink.
+/*!	The buffer is shrunk to fit (in place), not copied.
+	\return	Size of the data, or 0 if there were errors.
+*/
+uint cprs_sink_detach(CprsSink *sink, RECORD *rec)
+{
+	uint size= sink->size;
+	if(sink->type != CPRS_SINK_BUFFER || sink->bError || size == 0)
+	{
+		cprs_sink_close(sink);
+		return 0;
+	}
+
+	BYTE *data= (BYTE*)realloc(sink->data, size);
+	rec_attach(rec, data ? data : sink->data, 1, size);
+
+	sink->data= NULL;
+	cprs_sink_close(sink);
+
+	return size;
+}
+
+//! Get room for \a size bytes at the end of the sink.
+/*!	Write into it and follow up with cprs_sink_commit(). The 
+	pointer is only valid until the next call on the sink.
+	\return	Pointer to the room, or NULL on error.
+*/
+BYTE *cprs_sink_reserve(CprsSink *sink, uint size)
+{
+	if(sink->bError)
+		return NULL;
+
+	// Straight into the buffer, growing it if needed
+	if(sink->type == CPRS_SINK_BUFFER && sink->size+size > sink->capacity)
+	{
+		uint capacity= MAX(sink->size+size, 2*sink->capacity);
+		BYTE *data= (BYTE*)realloc(sink->data, capacity);
+		if(data == NULL)
+		{
+			sink->bError= true;
+			return NULL;
+		}
+		sink->data= data;
+		sink->capacity= capacity;
+	}
+
+	sink->bStaged= sink->type == CPRS_SINK_FILE || sink->size+size > sink->capacity;
+	if(!sink->bStaged)
+		return &sink->data[sink->size];
+
+	// Files and full regions go through the stage
+	if(size > sink->stageSize)
+	{
+		BYTE *stage= (BYTE*)realloc(sink->stage, size);
+		if(stage == NULL)
+		{
+			sink->bError= true;
+			return NULL;
+		}
+		sink->stage= stage;
+		sink->stageSize= size;
+	}
+
+	return sink->stage;
+}
+
+//! Add \a size bytes written to the room from cprs_sink_reserve().
+bool cprs_sink_commit(CprsSink *sink, uint size)
+{
+	if(sink->bError)
+		return false;
+
+	if(sink->type != CPRS_SINK_FILE && sink->size+size <= sink->capacity)
+	{
+		// Staged into a region that turns out to be big enough
+		if(sink->bStaged)
+			memcpy(&sink->data[sink->size], sink->stage, size);
+		sink->bStaged= false;
+		sink->size += size;
+		return true;
+	}
+
+	if(sink->type == CPRS_SINK_FILE && fwrite(sink->stage, 1, size, sink->fp) == size)
+	{
+		sink->size += size;
+		return true;
+	}
+
+	sink->bError= true;
+	return false;
+}
+
+//! Add \a size bytes of \a data to the sink.
+/*!	Files get the data directly.
+*/
+bool cprs_sink_write(CprsSink *sink, const void *data, uint size)
+{
+	if(sink->bError)
+		return false;
+	if(size == 0)
+		return true;
+
+	if(sink->type == CPRS_SINK_FILE)
+	{
+		if(fwrite(data, 1, size, sink->fp) != size)
+		{
+			sink->bError= true;
+			return false;
+		}
+		sink->size += size;
+		return true;
+	}
+
+	BYTE *dst= cprs_sink_reserve(sink, size);
+	if(dst == NULL)
+		return false;
+
+	memcpy(dst, data, size);
+	return cprs_sink_commit(sink, size);
+}
+
+//! Add \a size bytes of \a value to the sink (for padding).
+bool cprs_sink_fill(CprsSink *sink, BYTE value, uint size)
+{
+	if(size == 0)
+		return !sink->bError;
+
+	BYTE *dst= cprs_sink_reserve(sink, size);
+	if(dst == NULL)
+		return false;
+
+	memset(dst, value, size);
+	return cprs_sink_commit(sink, size);
+}
+
 //! compression dispatcher.
-bool cprs_compress(RECORD *dst, const RECORD *src, ECprsTag tag)
+/*!	\param flags	Compression flags (ECprsFlags), e.g. the level.
+	\param ctx	Compression context for scratch memory. May be NULL.
+*/
+bool cprs_compress(RECORD *dst, const RECORD *src, ECprsTag tag, 
+	u32 flags, CprsContext *ctx)
 {
 	assert(dst && src);
 	if(dst==NULL || src==NULL)
 		return false;
 
-	bool bOK= false;
+	CprsSink sink;
+	cprs_sink_buffer(&sink);
+	cprs_compress_to(&sink, src, tag, flags, ctx);
+
+	return cprs_sink_detach(&sink, dst) != 0;
+}
+
+//! Compression dispatcher, writing to a sink.
+/*!	\param flags	Compression flags (ECprsFlags), e.g. the level.
+	\param ctx	Compression context for scratch memory. May be NULL.
+	\return	Number of bytes written, or 0 on failure. Bytes written 
+		before a failure stay in the sink.
+*/
+uint cprs_compress_to(CprsSink *sink, const RECORD *src, ECprsTag tag, 
+	u32 flags, CprsContext *ctx)
+{
+	assert(sink && src);
+	if(sink==NULL || src==NULL)
+		return 0;
 
+	// Cached result, if there is one
+	CprsCacheKey key;
+	bool bCache= cprs_cache_key(&key, src, tag, flags);
+	uint size, start= sink->size;
+
+	if(bCache && (size= cprs_cache_load(sink, &key)) != 0)
+		return size;
+
+	size= cprs_compress_codec(sink, src, tag, flags, ctx);
+
+	// Files can't be read back, so they aren't stored
+	if(bCache && size != 0 && sink->type != CPRS_SINK_FILE)
+		cprs_cache_store(&key, &sink->data[start], size);
+
+	return size;
+}
+
+//! Run the codec for \a tag.
+uint cprs_compress_codec(CprsSink *sink, const RECORD *src, ECprsTag tag, 
+	u32 flags, CprsContext *ctx)
+{
 	switch(tag)
 	{
 	case CPRS_FAKE_TAG:
-		bOK= fake_compress(dst, src) != 0;			break;
+		return fake_compress_to(sink, src);
 
 	case CPRS_LZ77_TAG:
-		bOK= lz77gba_compress(dst, src) != 0;		break;
+		return lz77gba_compress_to(sink, src, flags, ctx);
+
+	case CPRS_LZ11_TAG:
+		return lz11nds_compress_to(sink, src, flags, ctx);
+
+	case CPRS_HUFF_TAG:
+		return huffgba_compress_to(sink, src);
+
+	case CPRS_HUFF4_TAG:
+		return huffgba_compress_to(sink, src, 4);
 
-	//CPRS_HUF4_TAG
 	case CPRS_HUFF8_TAG:
-		bOK= huffgba_compress(dst, src) != 0;	break;
+		return huffgba_compress_to(sink, src, 8);
 
 	case CPRS_RLE_TAG:
-		bOK= rle8gba_compress(dst, src) != 0;		break;
+		return rle8gba_compress_to(sink, src, flags);
+
+	case CPRS_DIFF8_TAG:
+		return diffgba_compress_to(sink, src, 1);
 
+	case CPRS_DIFF16_TAG:
+		return diffgba_compress_to(sink, src, 2);
 
-	//CPRS_DIFF8_TAG
-	//CPRS_DIFF16_TAG
 	default:
-		return false;
+		return 0;
 	}
-
-	return bOK;
 }
 
 bool cprs_decompress(RECORD *dst, const RECORD *src)
 {
 	assert(dst && src && src->data);
-	if(dst==NULL || src==NULL || src->data==NULL)
+	if(dst==NULL || src==NULL || src->data==NULL || rec_size(src) < 4)
 		return false;
 
 	u32 header= read32le(src->data);
+	bool bOK= false;
 	
 	switch(header&255)
 	{
 	case CPRS_FAKE_TAG:
-		fake_decompress(dst, src);
-		break;
+		bOK= fake_decompress(dst, src) != 0;		break;
+
 	case CPRS_LZ77_TAG:
-		lz77gba_decompress(dst, src);
-		break;
-	case CPRS_HUFF_TAG:
-		assert(0);
-		return false;
+		bOK= lz77gba_decompress(dst, src) != 0;		break;
+
+	case CPRS_LZ11_TAG:
+		bOK= lz11nds_decompress(dst, src) != 0;		break;
+
+	case CPRS_HUFF4_TAG:
 	case CPRS_HUFF8_TAG:
-		assert(0);
-		return false;
+		bOK= huffgba_decompress(dst, src) != 0;		break;
+
 	case CPRS_RLE_TAG:
-		rle8gba_decompress(dst, src);
-		break;
+		bOK= rle8gba_decompress(dst, src) != 0;		break;
+
+	case CPRS_DIFF8_TAG:
+	case CPRS_DIFF16_TAG:
+		bOK= diffgba_decompress(dst, src) != 0;		break;
+
+	default:
+		return false;
 	} 
 
-	return true;
+	return bOK;
 }
 
 
 //! Don't compress, but still add a compression-like header.
 uint fake_compress(RECORD *dst, const RECORD *src)
 {
-	assert(dst && src && src->data);
-	if(dst==NULL || src==NULL || src->data==NULL)
+	CprsSink sink;
+	cprs_sink_buffer(&sink, src ? ALIGN4(rec_size(src))+4 : 0);
+	fake_compress_to(&sink, src);
+
+	return cprs_sink_detach(&sink, dst);
+}
+
+//! Header and uncompressed data, straight from \a src.
+uint fake_compress_to(CprsSink *sink, const RECORD *src)
+{
+	assert(sink && src && src->data);
+	if(sink==NULL || src==NULL || src->data==NULL)
 		return 0;
 
 	uint srcS= rec_size(src);
 	uint dstS= ALIGN4(srcS)+4;
 
-	u8 *dstD= (u8*)malloc(dstS);
-	if(dstD == NULL)
-		return 0;
+	BYTE header[4];
+	write32le(header, srcS<<8 | CPRS_FAKE_TAG);
 
-	write32le(dstD, srcS<<8 | CPRS_FAKE_TAG);
-	memcpy(dstD+4, src->data, srcS);
-	rec_attach(dst, dstD, 1, dstS);
+	bool bOK= cprs_sink_write(sink, header, 4) && 
+		cprs_sink_write(sink, src->data, srcS) && 
+		cprs_sink_fill(sink, 0, dstS-4-srcS);
 
-	return dstS;
+	return bOK ? dstS : 0;
 }
 
-
 uint fake_decompress(RECORD *dst, const RECORD *src)
 {
 	assert(dst && src && src->data);
-	if(dst==NULL || src==NULL || src->data==NULL)
+	if(dst==NULL || src==NULL || src->data==NULL || rec_size(src) < 4)
 		return 0;
 
 	u32 header= read32le(src->data);
@@ -130,9 +409,12 @@ uint fake_decompress(RECORD *dst, const RECORD *src)
 		return 0;
 
 	uint dstS= header>>8;
+	if(dstS > (uint)rec_size(src)-4)
+		return 0;
+
 	u8 *dstD= (u8*)malloc(dstS);
 
-	memcpy(src->data+4, dstD, dstS);
+	memcpy(dstD, src->data+4, dstS);
 	rec_attach(dst, dstD, 1, dstS);	
 
 	return dstS;
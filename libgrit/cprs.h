@@ -10,11 +10,19 @@
 	separate: RECORD and the GBA types.
   * PONDER: since not all of these things are actually compression, 
 	a namecange may be in order at some point :| 
+  * 20261017: Added CprsSink. The compressors write into a growable 
+	buffer, a caller's region or a FILE; the RECORD versions are 
+	wrappers around a buffer sink.
+  * 20261017: Added an optional on-disk cache of compression results 
+	(cprs_cache_set_dir()), used by cprs_compress_to().
+  * 20261017: Added decode-time estimates (cprs_decode_cycles()).
 */
 
 #ifndef __GRIT_COMPRESSION__
 #define __GRIT_COMPRESSION__
 
+#include <stdio.h>
+
 #include "grit_core.h"
 
 // --------------------------------------------------------------------
@@ -27,39 +35,161 @@ enum ECprsTag
 {
 	CPRS_FAKE_TAG	= 0x00,		//<! No compression.
 	CPRS_LZ77_TAG	= 0x10,		//<! GBA LZ77 compression.
-	CPRS_HUFF_TAG	= 0x20, 
-//	CPRS_HUFF4_TAG	= 0x24,		//<! GBA Huffman, 4bit.
+	CPRS_LZ11_TAG	= 0x11,		//<! NDS LZ11 compression (LZ77 with longer matches).
+	CPRS_HUFF_TAG	= 0x20,		//<! GBA Huffman, smaller of 4 and 8bit.
+	CPRS_HUFF4_TAG	= 0x24,		//<! GBA Huffman, 4bit.
 	CPRS_HUFF8_TAG	= 0x28,		//<! GBA Huffman, 8bit.
 	CPRS_RLE_TAG	= 0x30,		//<! GBA RLE compression.
-//	CPRS_DIFF8_TAG	= 0x81,		//<! GBA Diff-filter, 8bit.
-//	CPRS_DIFF16_TAG	= 0x82,		//<! GBA Diff-filter, 16bit.
+	CPRS_DIFF8_TAG	= 0x81,		//<! GBA Diff-filter, 8bit.
+	CPRS_DIFF16_TAG	= 0x82,		//<! GBA Diff-filter, 16bit.
+};
+
+
+//! Compression flags, passed to cprs_compress().
+enum ECprsFlags
+{
+	CPRS_LEVEL_MASK	= 0x000F,	//!< Compression level. 0 is the classic compressor.
+	CPRS_LEVEL_SHIFT= 0,
+	CPRS_LEVEL_MAX	= 9,		//!< Smallest output, slowest.
+	CPRS_LEVEL_DECODE= 10,		//!< LZ77/LZ11: fastest decode, a little over the smallest size.
+	CPRS_WRAM		= 0x0010,	//!< LZ77/LZ11: allow distance-1 matches. Needs LZ77UnCompWram.
 };
 
 
 typedef bool (*cprs_proc_t)(RECORD *dst, const RECORD *src);
 
 
+// --------------------------------------------------------------------
+// CLASSES
+// --------------------------------------------------------------------
+
+
+struct Lz77State;
+
+//! Compression context.
+/*!	Holds the scratch state of the compressors, so that separate 
+	contexts can compress at the same time. Scratch buffers are 
+	allocated on first use and reused after that. Create with 
+	cprs_alloc(), destroy with cprs_free(). Routines that take a 
+	context will use a temporary one if it's NULL.
+*/
+struct CprsContext
+{
+	Lz77State	*lz77;		//!< LZ77 tree and ring buffer.
+};
+
+//! Output sink types.
+enum ECprsSinkType
+{
+	CPRS_SINK_BUFFER	= 0,	//!< Growable buffer; take it with cprs_sink_detach().
+	CPRS_SINK_REGION	= 1,	//!< Caller's preallocated buffer.
+	CPRS_SINK_FILE		= 2,	//!< Writes straight to a FILE.
+};
+
+//! Compression output sink.
+/*!	The compressors write their output, header included, to a sink 
+	instead of a new record. Data either gets handed over 
+	(cprs_sink_write()) or is written in place: cprs_sink_reserve() 
+	gives room at the end, cprs_sink_commit() says how much of it 
+	was used. For buffers that room is the destination itself, so 
+	nothing is copied afterwards. Files, and regions too small for 
+	a reservation, use a staging buffer instead.
+	Errors stick: after a failed write or a full region, all 
+	writes fail.
+*/
+struct CprsSink
+{
+	u8		type;		//!< Sink type (ECprsSinkType).
+	bool	bError;		//!< A write failed.
+	bool	bStaged;	//!< Last reservation is in stage.
+	BYTE	*data;		//!< Buffer or region.
+	uint	size;		//!< Bytes written.
+	uint	capacity;	//!< Size of data.
+	BYTE	*stage;		//!< Staging buffer for reservations.
+	uint	stageSize;	//!< Size of stage.
+	FILE	*fp;		//!< File for CPRS_SINK_FILE.
+};
+
+
+//! Key of a compression cache entry.
+struct CprsCacheKey
+{
+	u32		hash[4];	//!< 128bit hash of the source data.
+	uint	srcSize;	//!< Source size.
+	u8		tag;		//!< Compression type (ECprsTag).
+	u32		flags;		//!< Compression flags (ECprsFlags).
+};
+
+
 // --------------------------------------------------------------------
 // PROTOTYPES 
 // --------------------------------------------------------------------
 
+CprsContext *cprs_alloc();
+void cprs_free(CprsContext *ctx);
+
 u32	cprs_create_header(uint size, u8 tag); 
 
-bool cprs_compress(RECORD *dst, const RECORD *src, ECprsTag tag);
+void cprs_sink_buffer(CprsSink *sink, uint capacity=0);
+void cprs_sink_region(CprsSink *sink, void *data, uint capacity);
+void cprs_sink_file(CprsSink *sink, FILE *fp);
+bool cprs_sink_close(CprsSink *sink);
+uint cprs_sink_detach(CprsSink *sink, RECORD *rec);
+
+BYTE *cprs_sink_reserve(CprsSink *sink, uint size);
+bool cprs_sink_commit(CprsSink *sink, uint size);
+bool cprs_sink_write(CprsSink *sink, const void *data, uint size);
+bool cprs_sink_fill(CprsSink *sink, BYTE value, uint size);
+
+bool cprs_compress(RECORD *dst, const RECORD *src, ECprsTag tag, 
+	u32 flags=0, CprsContext *ctx=NULL);
+uint cprs_compress_to(CprsSink *sink, const RECORD *src, ECprsTag tag, 
+	u32 flags=0, CprsContext *ctx=NULL);
 bool cprs_decompress(RECORD *dst, const RECORD *src);
 
+uint cprs_decode_cycles(const RECORD *src, u32 flags=0);
+uint cprs_unfilter_cycles(uint size, ECprsTag tag, u32 flags=0);
+uint cprs_copy_cycles(uint size);
+double cprs_lz_token_cycles(uint len, bool bLz11, u32 flags=0);
+
+bool cprs_cache_set_dir(const char *dir);
+void cprs_cache_stats(uint *hits, uint *stores);
+bool cprs_cache_key(CprsCacheKey *key, const RECORD *src, ECprsTag tag, 
+	u32 flags);
+uint cprs_cache_load(CprsSink *sink, const CprsCacheKey *key);
+bool cprs_cache_store(const CprsCacheKey *key, const void *data, uint size);
+
 
 uint fake_compress(RECORD *dst, const RECORD *src);
+uint fake_compress_to(CprsSink *sink, const RECORD *src);
 uint fake_decompress(RECORD *dst, const RECORD *src);
 
-uint lz77gba_compress(RECORD *dst, const RECORD *src);
+Lz77State *lz77_alloc();
+void lz77_free(Lz77State *lz);
+uint lz77gba_compress(RECORD *dst, const RECORD *src, u32 flags=0, 
+	CprsContext *ctx=NULL);
+uint lz77gba_compress_to(CprsSink *sink, const RECORD *src, u32 flags=0, 
+	CprsContext *ctx=NULL);
 uint lz77gba_decompress(RECORD *dst, const RECORD *src);
-
-uint huffgba_compress(RECORD *dst, const RECORD *src);
-
-uint rle8gba_compress(RECORD *dst, const RECORD *src);
+uint lz11nds_compress(RECORD *dst, const RECORD *src, u32 flags=0, 
+	CprsContext *ctx=NULL);
+uint lz11nds_compress_to(CprsSink *sink, const RECORD *src, u32 flags=0, 
+	CprsContext *ctx=NULL);
+uint lz11nds_decompress(RECORD *dst, const RECORD *src);
+
+uint huffgba_compress(RECORD *dst, const RECORD *src, uint bits=0);
+uint huffgba_compress_to(CprsSink *sink, const RECORD *src, uint bits=0);
+uint huffgba_decompress(RECORD *dst, const RECORD *src);
+
+uint rle8gba_compress(RECORD *dst, const RECORD *src, u32 flags=0);
+uint rle8gba_compress_to(CprsSink *sink, const RECORD *src, u32 flags=0);
 uint rle8gba_decompress(RECORD *dst, const RECORD *src);
 
+uint diff8gba_compress(RECORD *dst, const RECORD *src);
+uint diff16gba_compress(RECORD *dst, const RECORD *src);
+uint diffgba_compress_to(CprsSink *sink, const RECORD *src, uint unit);
+uint diffgba_decompress(RECORD *dst, const RECORD *src);
+
 
 
 // --------------------------------------------------------------------
@@ -0,0 +1,265 @@
+//
+//! \file cprs_cache.cpp
+//!   On-disk cache for compression results
+//! \date 20261017 - 20261017
+//
+/* === NOTES ===
+  * Entries are keyed by a 128bit hash of the source data, its size,
+	the tag, the flags and CPRS_CACHE_VERSION; the key is the file
+	name. The file has a small header that is checked on load:
+	magic, version, source size and data size. A bad entry is just
+	a miss.
+  * Entries are written to a temporary file in the cache directory
+	and then renamed, so other grit processes sharing the directory
+	see either the whole entry or nothing. On systems where rename()
+	doesn't replace, a failed rename means another process got there
+	first with the same data.
+  * Only the slow codecs are cached. Diff filters and the fake
+	header take less time than reading a file.
+  * Bump CPRS_CACHE_VERSION when the output of an encoder changes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define cache_mkdir(_path)	_mkdir(_path)
+#define cache_getpid()		_getpid()
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define cache_mkdir(_path)	mkdir(_path, 0777)
+#define cache_getpid()		getpid()
+#endif
+
+#include "cprs.h"
+
+
+// --------------------------------------------------------------------
+// CONSTANTS
+// --------------------------------------------------------------------
+
+
+#define CPRS_CACHE_VERSION		1
+#define CPRS_CACHE_HEADER_SIZE	16
+
+static const char c_cacheMagic[4]= { 'G', 'R', 'C', 'C' };
+
+
+// --------------------------------------------------------------------
+// GLOBALS
+// --------------------------------------------------------------------
+
+
+static std::string sCacheDir;				//!< Empty if the cache is off.
+static std::atomic<uint> sCacheHits(0);
+static std::atomic<uint> sCacheStores(0);
+static std::atomic<uint> sCacheTemps(0);	//!< For unique temp names.
+
+
+// --------------------------------------------------------------------
+// PROTOTYPES
+// --------------------------------------------------------------------
+
+
+static void cache_hash(u32 hash[4], const BYTE *data, uint size);
+static std::string cache_path(const CprsCacheKey *key);
+
+
+// --------------------------------------------------------------------
+// FUNCTIONS
+// --------------------------------------------------------------------
+
+
+//! Set the cache directory, creating it if needed.
+/*!	\param dir	Directory; NULL or empty turns the cache off.
+	\return	False if \a dir can't be created; the cache is off then.
+*/
+bool cprs_cache_set_dir(const char *dir)
+{
+	sCacheDir.clear();
+	if(dir == NULL || dir[0] == '\0')
+		return true;
+
+	std::string path(dir);
+	while(path.size() > 1 && (path.back() == '/' || path.back() == '\\'))
+		path.pop_back();
+
+	// Create it; it's fine if it already exists. The tag marks it 
+	// as a cache for backup tools, and checks that it's writable.
+	cache_mkdir(path.c_str());
+
+	std::string tagPath= path + "/CACHEDIR.TAG";
+	FILE *fp= fopen(tagPath.c_str(), "rb");
+	if(fp == NULL)
+	{
+		if((fp= fopen(tagPath.c_str(), "wb")) == NULL)
+			return false;
+		fputs("Signature: 8a477f597d28d172789f06886806bc55\n"
+			"# grit compression cache.\n", fp);
+	}
+	fclose(fp);
+
+	sCacheDir= path;
+	return true;
+}
+
+//! Number of cache hits and newly stored entries so far.
+void cprs_cache_stats(uint *hits, uint *stores)
+{
+	if(hits)
+		*hits= sCacheHits;
+	if(stores)
+		*stores= sCacheStores;
+}
+
+//! Fill in the cache key for compressing \a src.
+/*!	\return	False if the cache is off or not used for \a tag.
+*/
+bool cprs_cache_key(CprsCacheKey *key, const RECORD *src, ECprsTag tag,
+	u32 flags)
+{
+	if(sCacheDir.empty() || src == NULL || src->data == NULL)
+		return false;
+
+	switch(tag)
+	{
+	case CPRS_LZ77_TAG:		case CPRS_LZ11_TAG:
+	case CPRS_HUFF_TAG:		case CPRS_HUFF4_TAG:	case CPRS_HUFF8_TAG:
+	case CPRS_RLE_TAG:
+		break;
+	default:
+		return false;
+	}
+
+	key->srcSize= rec_size(src);
+	key->tag= tag;
+	key->flags= flags;
+	cache_hash(key->hash, src->data, key->srcSize);
+
+	return true;
+}
+
+//! Write the cached result for \a key to \a sink.
+/*!	\return	Size of the compressed data; 0 if it's not in the cache.
+*/
+uint cprs_cache_load(CprsSink *sink, const CprsCacheKey *key)
+{
+	std::string path= cache_path(key);
+	FILE *fp= fopen(path.c_str(), "rb");
+	if(fp == NULL)
+		return 0;
+
+	BYTE header[CPRS_CACHE_HEADER_SIZE];
+	uint size= 0;
+
+	if(fread(header, 1, CPRS_CACHE_HEADER_SIZE, fp) == CPRS_CACHE_HEADER_SIZE &&
+		memcmp(header, c_cacheMagic, 4) == 0 &&
+		read32le(&header[4]) == CPRS_CACHE_VERSION &&
+		read32le(&header[8]) == key->srcSize)
+	{
+		size= read32le(&header[12]);
+
+		// The size has to match the file exactly
+		BYTE *dst= size ? cprs_sink_reserve(sink, size) : NULL;
+		if(dst == NULL || fread(dst, 1, size, fp) != size || fgetc(fp) != EOF ||
+			!cprs_sink_commit(sink, size))
+			size= 0;
+	}
+
+	fclose(fp);
+
+	if(size != 0)
+		sCacheHits++;
+
+	return size;
+}
+
+//! Store \a size bytes of \a data as the result for \a key.
+/*!	Written to a temporary file first and then renamed into place.
+*/
+bool cprs_cache_store(const CprsCacheKey *key, const void *data, uint size)
+{
+	std::string path= cache_path(key);
+
+	char suffix[32];
+	sprintf(suffix, ".%d.%u.tmp", (int)cache_getpid(), (uint)sCacheTemps++);
+	std::string tmpPath= path + suffix;
+
+	FILE *fp= fopen(tmpPath.c_str(), "wb");
+	if(fp == NULL)
+		return false;
+
+	BYTE header[CPRS_CACHE_HEADER_SIZE];
+	memcpy(header, c_cacheMagic, 4);
+	write32le(&header[4], CPRS_CACHE_VERSION);
+	write32le(&header[8], key->srcSize);
+	write32le(&header[12], size);
+
+	bool bOK= fwrite(header, 1, CPRS_CACHE_HEADER_SIZE, fp) == CPRS_CACHE_HEADER_SIZE &&
+		fwrite(data, 1, size, fp) == size;
+	bOK= (fclose(fp) == 0) && bOK;
+
+	if(bOK && rename(tmpPath.c_str(), path.c_str()) == 0)
+	{
+		sCacheStores++;
+		return true;
+	}
+
+	remove(tmpPath.c_str());
+	return false;
+}
+
+//! Path of the cache entry for \a key.
+std::string cache_path(const CprsCacheKey *key)
+{
+	char name[80];
+	sprintf(name, "/%08x%08x%08x%08x-%02x-%x.cprs",
+		key->hash[0], key->hash[1], key->hash[2], key->hash[3],
+		key->tag, key->flags);
+
+	return sCacheDir + name;
+}
+
+//! 128bit hash of \a data: two 64bit multiply-rotate lanes over
+//!   8-byte words. Fast, not cryptographic.
+void cache_hash(u32 hash[4], const BYTE *data, uint size)
+{
+	const uint64_t k0= 0x9E3779B97F4A7C15ULL, k1= 0xC2B2AE3D27D4EB4FULL;
+	uint64_t h0= k1 ^ size, h1= k0 + ((uint64_t)CPRS_CACHE_VERSION<<32 | size);
+	uint64_t word;
+	uint ii;
+
+	for(ii=0; ii+8<=size; ii += 8)
+	{
+		memcpy(&word, &data[ii], 8);
+		h0= (h0 ^ word) * k0;
+		h0 ^= h0>>29;
+		h1= (h1 + word) * k1;
+		h1= (h1<<31 | h1>>33) ^ word;
+	}
+
+	// Tail, plus finalizer so that every input bit reaches every
+	// output bit
+	word= 0;
+	memcpy(&word, &data[ii], size-ii);
+	h0= (h0 ^ word ^ 0xFF) * k0;
+	h1= (h1 + word + 0xFF) * k1;
+
+	for(int jj=0; jj<2; jj++)
+	{
+		h0 ^= h1>>32;	h0 *= k1;	h0 ^= h0>>29;
+		h1 ^= h0>>32;	h1 *= k0;	h1 ^= h1>>31;
+	}
+
+	hash[0]= h0>>32;	hash[1]= (u32)h0;
+	hash[2]= h1>>32;	hash[3]= (u32)h1;
+}
+
+// EOF
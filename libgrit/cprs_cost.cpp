@@ -0,0 +1,255 @@
+//
+//! \file cprs_cost.cpp
+//!   Decode-time estimates for compressed data
+//! \date 20261017 - 20261017
+//
+/* === NOTES ===
+  * The estimate walks the token stream of the compressed data and
+	adds a cost per token: flag bytes, literals, matches and their
+	bytes for LZ77, stints and their bytes for RLE, code bits and
+	symbols for Huffman. Uncompressed data costs a CpuFastSet copy.
+  * The costs are rough cycle counts for the BIOS routines on a GBA,
+	reading from ROM with the default waitstates. They put the
+	codecs in the right order and ballpark, but don't count on them
+	for exact frame budgets. The Vram versions write halfwords, so
+	they need to buffer bytes and are slower than the Wram ones.
+  * LZ11 uses the LZ77 costs plus a little for the longer tokens;
+	the NDS routines are at least that fast.
+*/
+
+#include "cprs.h"
+
+
+// --------------------------------------------------------------------
+// CONSTANTS
+// --------------------------------------------------------------------
+
+
+//! Cycle costs of the decoders. Index 0 is Vram, 1 is Wram.
+struct CprsCycles
+{
+	uint	call;			//!< SWI and header.
+	uint	lzFlags;		//!< LZ77: flag byte.
+	uint	lzLiteral;		//!< LZ77: literal byte.
+	uint	lzMatch;		//!< LZ77: match token.
+	uint	lzMatchByte;	//!< LZ77: byte copied by a match.
+	uint	lz11Ext;		//!< LZ11: extra per extended length byte.
+	uint	rleStint;		//!< RLE: stint header.
+	uint	rleLiteral;		//!< RLE: literal byte.
+	uint	rleRunByte;		//!< RLE: byte written by a run.
+	uint	huffWord;		//!< Huffman: bitstream word.
+	uint	huffBit;		//!< Huffman: code bit (one tree step).
+	uint	huffSymbol;		//!< Huffman: decoded symbol.
+	uint	huffOutWord;	//!< Huffman: output word.
+	uint	copyWord;		//!< CpuFastSet: word.
+	uint	diffUnit;		//!< Diff unfilter: unit.
+};
+
+static const CprsCycles c_cprsCycles[2]=
+{
+	// Vram
+	{ 60,	14, 18, 28, 12, 4,	20, 14, 9,	10, 8, 10, 6,	6,	10 },
+	// Wram
+	{ 60,	14, 12, 24,  9, 4,	20, 10, 6,	10, 8, 10, 6,	6,	 8 },
+};
+
+
+// --------------------------------------------------------------------
+// PROTOTYPES
+// --------------------------------------------------------------------
+
+
+static uint lz_cycles(const BYTE *srcD, uint srcS, uint dstS, bool bLz11,
+	const CprsCycles *cc);
+static uint rle_cycles(const BYTE *srcD, uint srcS, uint dstS,
+	const CprsCycles *cc);
+
+
+// --------------------------------------------------------------------
+// FUNCTIONS
+// --------------------------------------------------------------------
+
+
+//! Estimate the cycles to decode \a src with the BIOS.
+/*!	\param src	Compressed data, with header. Data without a known
+		header counts as a raw copy.
+	\param flags	CPRS_WRAM for the Wram routines; Vram otherwise.
+	\return	Estimated cycles; 0 if the stream is corrupt.
+*/
+uint cprs_decode_cycles(const RECORD *src, u32 flags)
+{
+	if(src == NULL || src->data == NULL)
+		return 0;
+
+	const CprsCycles *cc= &c_cprsCycles[(flags & CPRS_WRAM) ? 1 : 0];
+	uint srcS= rec_size(src);
+	const BYTE *srcD= src->data;
+
+	if(srcS < 4)
+		return cprs_copy_cycles(srcS);
+
+	uint tag= srcD[0], dstS= read32le(srcD)>>8;
+
+	switch(tag)
+	{
+	case CPRS_LZ77_TAG:
+	case CPRS_LZ11_TAG:
+		return lz_cycles(srcD+4, srcS-4, dstS, tag == CPRS_LZ11_TAG, cc);
+
+	case CPRS_RLE_TAG:
+		return rle_cycles(srcD+4, srcS-4, dstS, cc);
+
+	case CPRS_HUFF4_TAG:
+	case CPRS_HUFF8_TAG:
+	{
+		// Every bit of the stream is a step down the tree
+		uint treeS= (srcD[4]+1)*2;
+		if(4+treeS > srcS)
+			return 0;
+
+		uint words= (srcS-4-treeS)/4;
+		uint symbols= (tag == CPRS_HUFF4_TAG) ? 2*dstS : dstS;
+
+		return cc->call + words*(cc->huffWord + 32*cc->huffBit) +
+			symbols*cc->huffSymbol + (dstS+3)/4*cc->huffOutWord;
+	}
+
+	case CPRS_DIFF8_TAG:
+	case CPRS_DIFF16_TAG:
+		return cprs_unfilter_cycles(dstS, (ECprsTag)tag, flags);
+
+	case CPRS_FAKE_TAG:
+		return cprs_copy_cycles(dstS);
+	}
+
+	return cprs_copy_cycles(srcS);
+}
+
+//! Estimate the cycles to undo a Diff filter on \a size bytes.
+/*!	\param tag	CPRS_DIFF8_TAG or CPRS_DIFF16_TAG.
+*/
+uint cprs_unfilter_cycles(uint size, ECprsTag tag, u32 flags)
+{
+	const CprsCycles *cc= &c_cprsCycles[(flags & CPRS_WRAM) ? 1 : 0];
+	uint units= (tag == CPRS_DIFF16_TAG) ? size/2 : size;
+
+	return cc->call + units*cc->diffUnit;
+}
+
+//! Estimate the cycles to copy \a size bytes with CpuFastSet.
+uint cprs_copy_cycles(uint size)
+{
+	return c_cprsCycles[0].call + (size+3)/4*c_cprsCycles[0].copyWord;
+}
+
+//! Estimate the cycles for one LZ77/LZ11 token.
+/*!	Includes its share of a flag byte, so it's not a whole number.
+	\param len	Match length, or 1 for a literal.
+	\param flags	CPRS_WRAM for LZ77UnCompWram.
+*/
+double cprs_lz_token_cycles(uint len, bool bLz11, u32 flags)
+{
+	const CprsCycles *cc= &c_cprsCycles[(flags & CPRS_WRAM) ? 1 : 0];
+	double cycles= cc->lzFlags/8.0;
+
+	if(len < 3)
+		return cycles + len*cc->lzLiteral;
+
+	uint ext= (!bLz11 || len <= 0x10) ? 0 : len <= 0x110 ? 1 : 2;
+	return cycles + cc->lzMatch + len*cc->lzMatchByte + ext*cc->lz11Ext;
+}
+
+//! LZ77/LZ11 token costs.
+uint lz_cycles(const BYTE *srcD, uint srcS, uint dstS, bool bLz11,
+	const CprsCycles *cc)
+{
+	uint ii= 0, pos= 0, flags= 0;
+	uint cycles= cc->call;
+	int jj= -1;
+
+	while(pos < dstS)
+	{
+		if(jj < 0)
+		{
+			if(ii >= srcS)
+				return 0;
+			flags= srcD[ii++];
+			jj= 7;
+			cycles += cc->lzFlags;
+		}
+
+		if(flags>>jj & 1)
+		{
+			if(ii+1 >= srcS)
+				return 0;
+
+			uint len, ext= 0;
+			if(!bLz11)
+				len= (srcD[ii]>>4) + 3;
+			else if(srcD[ii]>>4 == 0)
+			{
+				if(ii+2 >= srcS)
+					return 0;
+				len= ((srcD[ii]&15)<<4 | srcD[ii+1]>>4) + 0x11;
+				ext= 1;
+			}
+			else if(srcD[ii]>>4 == 1)
+			{
+				if(ii+3 >= srcS)
+					return 0;
+				len= ((srcD[ii]&15)<<12 | srcD[ii+1]<<4 | srcD[ii+2]>>4) + 0x111;
+				ext= 2;
+			}
+			else
+				len= (srcD[ii]>>4) + 1;
+
+			ii += 2+ext;
+			pos += len;
+			cycles += cc->lzMatch + len*cc->lzMatchByte + ext*cc->lz11Ext;
+		}
+		else
+		{
+			if(ii >= srcS)
+				return 0;
+			ii++;
+			pos++;
+			cycles += cc->lzLiteral;
+		}
+		jj--;
+	}
+
+	return cycles;
+}
+
+//! RLE stint costs.
+uint rle_cycles(const BYTE *srcD, uint srcS, uint dstS,
+	const CprsCycles *cc)
+{
+	uint ii= 0, pos= 0, len;
+	uint cycles= cc->call;
+
+	while(pos < dstS)
+	{
+		if(ii >= srcS)
+			return 0;
+
+		BYTE header= srcD[ii++];
+		if(header & 0x80)
+		{
+			len= (header&0x7F) + 3;
+			ii++;
+			cycles += cc->rleStint + len*cc->rleRunByte;
+		}
+		else
+		{
+			len= header + 1;
+			ii += len;
+			cycles += cc->rleStint + len*cc->rleLiteral;
+		}
+		pos += len;
+	}
+
+	return ii <= srcS ? cycles : 0;
+}
+
+// EOF
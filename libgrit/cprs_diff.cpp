@@ -0,0 +1,140 @@
+//
+//! \file cprs_diff.cpp
+//!   GBA Diff filters
+//! \date 20261017 - 20261017
+//
+/* === NOTES ===
+  * The filters are compatible with the BIOS Diff8bitUnFilter and
+	Diff16bitUnFilter routines. They don't compress anything
+	themselves, but make gradients and similar data easier to
+	compress. A filtered record is a normal record with its own
+	header, so it can be fed to any of the compressors.
+*/
+
+#include <stdlib.h>
+#include <memory.h>
+#include <assert.h>
+
+#include "cprs.h"
+
+
+// --------------------------------------------------------------------
+// FUNCTIONS
+// --------------------------------------------------------------------
+
+
+//! Diff filter on 8bit units (Diff8bitUnFilter compatible).
+uint diff8gba_compress(RECORD *dst, const RECORD *src)
+{
+	CprsSink sink;
+	cprs_sink_buffer(&sink);
+	diffgba_compress_to(&sink, src, 1);
+
+	return cprs_sink_detach(&sink, dst);
+}
+
+//! Diff filter on 16bit units (Diff16bitUnFilter compatible).
+/*!	\note The size of \a src must be a multiple of 2.
+*/
+uint diff16gba_compress(RECORD *dst, const RECORD *src)
+{
+	CprsSink sink;
+	cprs_sink_buffer(&sink);
+	diffgba_compress_to(&sink, src, 2);
+
+	return cprs_sink_detach(&sink, dst);
+}
+
+//! Store the difference of each unit with the previous one.
+/*!	\param unit	Unit size in bytes: 1 or 2.
+*/
+uint diffgba_compress_to(CprsSink *sink, const RECORD *src, uint unit)
+{
+	if(src==NULL || sink==NULL || src->data == NULL)
+		return 0;
+
+	uint ii, srcS= rec_size(src);
+	if(srcS % unit != 0)
+		return 0;
+
+	uint dstS= ALIGN4(srcS)+4;
+	BYTE *srcD= src->data, *dstD= cprs_sink_reserve(sink, dstS);
+	if(dstD == NULL)
+		return 0;
+
+	write32le(dstD, srcS<<8 | (unit == 2 ? CPRS_DIFF16_TAG : CPRS_DIFF8_TAG));
+
+	BYTE *dstL= dstD+4;
+	if(unit == 1)
+	{
+		BYTE prev= 0;
+		for(ii=0; ii<srcS; ii++)
+		{
+			dstL[ii]= srcD[ii]-prev;
+			prev= srcD[ii];
+		}
+	}
+	else
+	{
+		u16 curr, prev= 0;
+		for(ii=0; ii<srcS; ii += 2)
+		{
+			curr= srcD[ii] | srcD[ii+1]<<8;
+			dstL[ii  ]= (curr-prev)    & 255;
+			dstL[ii+1]= (curr-prev)>>8 & 255;
+			prev= curr;
+		}
+	}
+	memset(dstL+srcS, 0, dstS-4-srcS);
+
+	return cprs_sink_commit(sink, dstS) ? dstS : 0;
+}
+
+//! Undo a Diff filter (8 or 16bit).
+/*!	\return	Unfiltered size, or 0 if the data is corrupt.
+*/
+uint diffgba_decompress(RECORD *dst, const RECORD *src)
+{
+	assert(dst && src && src->data);
+	if(dst==NULL || src==NULL || src->data==NULL || rec_size(src) < 4)
+		return 0;
+
+	// Get and check header word
+	u32 header= read32le(src->data);
+	uint unit;
+	switch(header&255)
+	{
+	case CPRS_DIFF8_TAG:	unit= 1;	break;
+	case CPRS_DIFF16_TAG:	unit= 2;	break;
+	default:
+		return 0;
+	}
+
+	uint ii, dstS= header>>8;
+	if(dstS % unit != 0 || dstS > (uint)rec_size(src)-4)
+		return 0;
+
+	BYTE *srcL= src->data+4, *dstD= (BYTE*)malloc(dstS);
+
+	if(unit == 1)
+	{
+		BYTE prev= 0;
+		for(ii=0; ii<dstS; ii++)
+			dstD[ii]= prev= prev+srcL[ii];
+	}
+	else
+	{
+		u16 prev= 0;
+		for(ii=0; ii<dstS; ii += 2)
+		{
+			prev += srcL[ii] | srcL[ii+1]<<8;
+			dstD[ii  ]= prev    & 255;
+			dstD[ii+1]= prev>>8 & 255;
+		}
+	}
+
+	rec_attach(dst, dstD, 1, dstS);
+	return dstS;
+}
+
+// EOF
@@ -5,37 +5,22 @@
 #include <cstdlib>
 #include <cstring>
 #include <deque>
-#include <memory>
 #include <tuple>
 #include <vector>
 
 namespace
 {
+/** @brief Longest Huffman code (bits) */
+constexpr unsigned HUFF_LEN_MAX = 24;
+
+/** @brief Largest number of Huffman tree nodes (8-bit encoding) */
+constexpr unsigned HUFF_NODES_MAX = 2 * 256 - 1;
+
 /** @brief Huffman node */
 class Node
 {
 public:
-	/** @brief Parameterized constructor
-	 *  @param val   Node value
-	 *  @count count Node count
-	 */
-	Node (uint8_t val, size_t count) : count (count), val (val)
-	{
-	}
-
-	/** @brief Parameterized constructor
-	 *  @param left  Left child
-	 *  @count right Right child
-	 */
-	Node (std::unique_ptr<Node> left, std::unique_ptr<Node> right)
-	    : child{std::move (left), std::move (right)}, count (child[0]->count + child[1]->count)
-	{
-		// set children's parent to self
-		child[0]->parent = this;
-		child[1]->parent = this;
-	}
-
-	Node () = delete;
+	Node () = default;
 
 	Node (const Node &other) = delete;
 
@@ -45,38 +30,12 @@ public:
 
 	Node &operator= (Node &&other) = delete;
 
-	/** @brief Comparison operator
-	 *  @param other Object to compare
-	 */
-	bool operator< (const Node &other) const
-	{
-		// major key is count
-		if (count != other.count)
-			return count < other.count;
-
-		// minor key is value
-		return val < other.val;
-	}
-
 	/** @brief Whether this node is a parent */
 	bool isParent () const
 	{
-		return static_cast<bool> (child[0]);
+		return child[0] != nullptr;
 	}
 
-	/** @brief Build Huffman codes
-	 *  @param[in] node    Huffman node
-	 *  @param[in] code    Huffman code
-	 *  @param[in] codeLen Huffman code length (bits)
-	 */
-	static void buildCodes (std::unique_ptr<Node> &node, uint32_t code, size_t codeLen);
-
-	/** @brief Build lookup table
-	 *  @param[in] nodes Table to fill
-	 *  @param[in] n     Huffman node
-	 */
-	static void buildLookup (std::vector<Node *> &nodes, const std::unique_ptr<Node> &node);
-
 	/** @brief Serialize Huffman tree
 	 *  @param[out] tree Serialized tree
 	 *  @param[in]  node Root of subtree
@@ -130,67 +89,37 @@ public:
 		return leaves;
 	}
 
-	/** @brief Get code */
-	uint32_t getCode () const
-	{
-		assert (!isParent ());
-		return code;
-	}
-
-	/** @brief Get code length */
-	uint8_t getCodeLen () const
-	{
-		assert (!isParent ());
-		return codeLen;
-	}
-
-private:
-	Node *parent;                   ///< Parent node
-	std::unique_ptr<Node> child[2]; ///< Children nodes
-	size_t count    = 0;            ///< Node weight
-	uint32_t code   = 0;            ///< Huffman encoding
-	unsigned leaves = 0;            ///< Number of leaves
-	uint8_t val     = 0;            ///< Huffman tree value
-	uint8_t codeLen = 0;            ///< Huffman code length (bits)
+	Node *child[2]  = {nullptr, nullptr}; ///< Children nodes
+	unsigned leaves = 0;                  ///< Number of leaves
+	uint8_t val     = 0;                  ///< Huffman tree value
 #ifndef NDEBUG
 	uint16_t pos = 0; ///< Huffman tree position
 #endif
 };
 
-void Node::buildCodes (std::unique_ptr<Node> &node, uint32_t code, size_t codeLen)
+/** @brief Huffman nodes, allocated together */
+class NodeArena
 {
-	// don't exceed 32-bit codes
-	assert (codeLen < 32);
-
-	if (node->isParent ())
-	{
-		// build codes for each subtree
-		assert (node->child[0] && node->child[1]);
-		buildCodes (node->child[0], (code << 1) | 0, codeLen + 1);
-		buildCodes (node->child[1], (code << 1) | 1, codeLen + 1);
-	}
-	else
+public:
+	NodeArena () : nodes (HUFF_NODES_MAX)
 	{
-		// set code for data node
-		assert (!node->child[0] && !node->child[1]);
-		node->code    = code;
-		node->codeLen = codeLen;
 	}
-}
 
-void Node::buildLookup (std::vector<Node *> &nodes, const std::unique_ptr<Node> &node)
-{
-	if (!node->isParent ())
+	/** @brief Allocate a node
+	 *  @param[in] val Huffman tree value
+	 */
+	Node *alloc (uint8_t val = 0)
 	{
-		// set lookup entry
-		nodes[node->val] = node.get ();
-		return;
+		assert (used < nodes.size ());
+		Node *node = &nodes[used++];
+		node->val  = val;
+		return node;
 	}
 
-	// build subtree lookups
-	buildLookup (nodes, node->child[0]);
-	buildLookup (nodes, node->child[1]);
-}
+private:
+	std::vector<Node> nodes; ///< Node storage
+	size_t used = 0;         ///< Number of nodes handed out
+};
 
 void Node::serializeTree (std::vector<Node *> &tree, Node *node, unsigned next)
 {
@@ -199,8 +128,8 @@ void Node::serializeTree (std::vector<Node *> &tree, Node *node, unsigned next)
 	if (node->numLeaves () > 0x40)
 	{
 		// this subtree will overflow the offset field if inserted naively
-		tree[next + 0] = node->child[0].get ();
-		tree[next + 1] = node->child[1].get ();
+		tree[next + 0] = node->child[0];
+		tree[next + 1] = node->child[1];
 
 		unsigned a = 0;
 		unsigned b = 1;
@@ -211,13 +140,13 @@ void Node::serializeTree (std::vector<Node *> &tree, Node *node, unsigned next)
 		if (node->child[a]->isParent ())
 		{
 			node->child[a]->val = 0;
-			serializeTree (tree, node->child[a].get (), next + 2);
+			serializeTree (tree, node->child[a], next + 2);
 		}
 
 		if (node->child[b]->isParent ())
 		{
 			node->child[b]->val = node->child[a]->numLeaves () - 1;
-			serializeTree (tree, node->child[b].get (), next + 2 * node->child[a]->numLeaves ());
+			serializeTree (tree, node->child[b], next + 2 * node->child[a]->numLeaves ());
 		}
 
 		return;
@@ -225,8 +154,8 @@ void Node::serializeTree (std::vector<Node *> &tree, Node *node, unsigned next)
 
 	std::deque<Node *> queue;
 
-	queue.emplace_back (node->child[0].get ());
-	queue.emplace_back (node->child[1].get ());
+	queue.emplace_back (node->child[0]);
+	queue.emplace_back (node->child[1]);
 
 	while (!queue.empty ())
 	{
@@ -240,8 +169,8 @@ void Node::serializeTree (std::vector<Node *> &tree, Node *node, unsigned next)
 
 		node->val = queue.size () / 2;
 
-		queue.emplace_back (node->child[0].get ());
-		queue.emplace_back (node->child[1].get ());
+		queue.emplace_back (node->child[0]);
+		queue.emplace_back (node->child[1]);
 	}
 }
 
@@ -345,354 +274,619 @@ void Node::encodeTree (std::vector<uint8_t> &tree, Node *node)
 	}
 }
 
-/** @brief Build Huffman tree
- *  @param[in] src Source data
- *  @param[in] len Source data length
- *  @param[in] fourBit_ Whether to use 4-bit encoding
- *  @returns Root node
+/** @brief Build byte histogram
+ *  @param[out] histogram Byte counts (256 entries)
+ *  @param[in]  src       Source data
+ *  @param[in]  len       Source data length
  */
-std::unique_ptr<Node> buildTree (const uint8_t *src, size_t len, bool fourBit_)
+void buildHistogram (size_t *histogram, const uint8_t *src, size_t len)
 {
-	// fill in histogram
-	std::vector<size_t> histogram (fourBit_ ? 16 : 256);
+	// four tables, so runs of equal bytes don't wait on one counter
+	std::vector<uint32_t> counts (4 * 256);
+	size_t i = 0;
 
-	if (fourBit_)
+	for (; i + 4 <= len; i += 4)
 	{
-		for (size_t i = 0; i < len; ++i)
-		{
-			++histogram[(src[i] >> 0) & 0xF];
-			++histogram[(src[i] >> 4) & 0xF];
-		}
+		++counts[0 * 256 + src[i + 0]];
+		++counts[1 * 256 + src[i + 1]];
+		++counts[2 * 256 + src[i + 2]];
+		++counts[3 * 256 + src[i + 3]];
 	}
-	else
+
+	for (; i < len; ++i)
+		++counts[src[i]];
+
+	for (unsigned val = 0; val < 256; ++val)
+		histogram[val] = counts[val] + counts[256 + val] + counts[512 + val] + counts[768 + val];
+}
+
+/** @brief Build length-limited Huffman code lengths (package-merge)
+ *  @param[out] codeLens  Code length per value (bits); 0 if unused
+ *  @param[in]  histogram Value counts
+ *  @param[in]  numVals   Number of values (16 or 256)
+ */
+void buildCodeLens (uint8_t *codeLens, const size_t *histogram, unsigned numVals)
+{
+	std::vector<unsigned> vals;
+
+	for (unsigned val = 0; val < numVals; ++val)
 	{
-		for (size_t i = 0; i < len; ++i)
-			++histogram[src[i]];
+		codeLens[val] = 0;
+		if (histogram[val] > 0)
+			vals.emplace_back (val);
 	}
 
-	std::vector<std::unique_ptr<Node>> nodes;
+	// root must have children; pair a lone value with an unused one
+	if (vals.size () < 2)
 	{
-		uint8_t val = 0;
-		for (const auto &count : histogram)
+		unsigned val = vals.empty () ? 0 : vals[0];
+
+		codeLens[val]             = 1;
+		codeLens[val == 0 ? 1 : 0] = 1;
+		return;
+	}
+
+	// sort by count, then by value
+	std::sort (std::begin (vals), std::end (vals), [histogram] (unsigned lhs, unsigned rhs) -> bool {
+		if (histogram[lhs] != histogram[rhs])
+			return histogram[lhs] < histogram[rhs];
+		return lhs < rhs;
+	});
+
+	/** @brief Package-merge list item */
+	struct Item
+	{
+		size_t weight; ///< Item weight
+		bool package;  ///< Whether this is a package of two items of the level below
+	};
+
+	// levels[0] is the deepest level and only has leaves
+	size_t n = vals.size ();
+	std::vector<std::vector<Item>> levels (HUFF_LEN_MAX);
+
+	for (unsigned level = 0; level < HUFF_LEN_MAX; ++level)
+	{
+		std::vector<Item> &list = levels[level];
+		size_t numPackages      = level > 0 ? levels[level - 1].size () / 2 : 0;
+		size_t leaf             = 0;
+		size_t package          = 0;
+
+		list.reserve (n + numPackages);
+		while (leaf < n || package < numPackages)
 		{
-			if (count > 0)
-				nodes.emplace_back (std::make_unique<Node> (val, count));
+			size_t weight = 0;
+			if (package < numPackages)
+			{
+				weight = levels[level - 1][2 * package + 0].weight +
+				         levels[level - 1][2 * package + 1].weight;
+			}
 
-			++val;
+			if (package == numPackages || (leaf < n && histogram[vals[leaf]] <= weight))
+				list.emplace_back (Item{histogram[vals[leaf++]], false});
+			else
+			{
+				list.emplace_back (Item{weight, true});
+				++package;
+			}
 		}
 	}
 
-	// done with histogram
-	histogram.clear ();
-
-	// combine nodes
-	while (nodes.size () > 1)
+	// take the 2n-2 lightest items of the top level; every leaf that
+	// is used adds a bit to its value's code
+	size_t count = 2 * n - 2;
+	for (unsigned level = HUFF_LEN_MAX; level-- > 0 && count > 0;)
 	{
-		// sort nodes by count; we will combine the two smallest nodes
-		std::sort (std::begin (nodes),
-		    std::end (nodes),
-		    [] (const std::unique_ptr<Node> &lhs, const std::unique_ptr<Node> &rhs) -> bool {
-			    return *lhs < *rhs;
-		    });
+		const std::vector<Item> &list = levels[level];
+		size_t packages = 0;
+
+		assert (count <= list.size ());
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (list[i].package)
+				++packages;
+		}
+
+		// leaves come out of each level in sorted order
+		for (size_t i = 0; i < count - packages; ++i)
+			++codeLens[vals[i]];
+
+		count = 2 * packages;
+	}
+}
+
+/** @brief Build canonical Huffman codes from code lengths
+ *  @param[out] codes    Huffman code per value
+ *  @param[in]  codeLens Code length per value (bits)
+ *  @param[in]  numVals  Number of values
+ */
+void buildCodes (uint32_t *codes, const uint8_t *codeLens, unsigned numVals)
+{
+	unsigned lenCount[HUFF_LEN_MAX + 1] = {0};
+	uint32_t nextCode[HUFF_LEN_MAX + 1] = {0};
 
-		// allocate a parent node
-		std::unique_ptr<Node> node =
-		    std::make_unique<Node> (std::move (nodes[0]), std::move (nodes[1]));
+	for (unsigned val = 0; val < numVals; ++val)
+		++lenCount[codeLens[val]];
 
-		// replace first node with self
-		nodes[0] = std::move (node);
+	lenCount[0]  = 0;
+	uint32_t code = 0;
+	for (unsigned len = 1; len <= HUFF_LEN_MAX; ++len)
+	{
+		code          = (code + lenCount[len - 1]) << 1;
+		nextCode[len] = code;
+	}
 
-		// replace second node with last node
-		nodes[1] = std::move (nodes.back ());
-		nodes.pop_back ();
+	for (unsigned val = 0; val < numVals; ++val)
+	{
+		if (codeLens[val] > 0)
+			codes[val] = nextCode[codeLens[val]]++;
 	}
+}
 
-	// root is the last node left
-	std::unique_ptr<Node> root = std::move (nodes[0]);
+/** @brief Build Huffman tree from codes
+ *  @param[in] arena    Node storage
+ *  @param[in] codes    Huffman code per value
+ *  @param[in] codeLens Code length per value (bits)
+ *  @param[in] numVals  Number of values
+ *  @returns Root node
+ */
+Node *buildTree (NodeArena &arena, const uint32_t *codes, const uint8_t *codeLens, unsigned numVals)
+{
+	Node *root = arena.alloc ();
+
+	for (unsigned val = 0; val < numVals; ++val)
+	{
+		if (codeLens[val] == 0)
+			continue;
+
+		// walk down the code, adding parents as needed
+		Node *node = root;
+		for (unsigned bit = codeLens[val] - 1; bit > 0; --bit)
+		{
+			Node *&child = node->child[(codes[val] >> bit) & 1];
+			if (!child)
+				child = arena.alloc ();
 
-	// root must have children
-	if (!root->isParent ())
-		root = std::make_unique<Node> (std::move (root), std::make_unique<Node> (0x00, 0));
+			node = child;
+		}
 
-	// build Huffman codes
-	Node::buildCodes (root, 0, 0);
+		node->child[codes[val] & 1] = arena.alloc (val);
+	}
 
-	// return root node
 	return root;
 }
 
-/** @brief Bitstream */
+/** @brief Bitstream writer; 32-bit little-endian blocks, filled from bit 31 down */
 class Bitstream
 {
 public:
-	Bitstream (std::vector<uint8_t> &buffer) : buffer (buffer)
+	Bitstream (uint8_t *buffer) : out (buffer)
 	{
 	}
 
 	/** @brief Flush bitstream block, padded to 32 bits */
 	void flush ()
 	{
-		if (pos >= 32)
+		if (count == 0)
 			return;
 
-		// append bitstream block to output buffer
-		buffer.reserve (buffer.size () + 4);
-		buffer.emplace_back (code >> 0);
-		buffer.emplace_back (code >> 8);
-		buffer.emplace_back (code >> 16);
-		buffer.emplace_back (code >> 24);
-
-		// reset bitstream block
-		pos  = 32;
-		code = 0;
+		write (bits << (32 - count));
+		count = 0;
 	}
 
 	/** @brief Push Huffman code onto bitstream
 	 *  @param[in] code Huffman code
-	 *  @param[in] len  Huffman code length (bits)
+	 *  @param[in] len  Huffman code length (bits); at most HUFF_LEN_MAX
 	 */
-	void push (uint32_t code, size_t len)
+	void push (uint32_t code, unsigned len)
 	{
-		for (size_t i = 1; i <= len; ++i)
-		{
-			// get next bit position
-			--pos;
+		// bits above count are stale, but never read
+		bits = (bits << len) | code;
+		count += len;
 
-			// set/reset bit
-			if (code & (1U << (len - i)))
-				this->code |= (1U << pos);
-			else
-				this->code &= ~(1U << pos);
-
-			// flush bitstream block
-			if (pos == 0)
-				flush ();
+		if (count >= 32)
+		{
+			count -= 32;
+			write (bits >> count);
 		}
 	}
 
 private:
-	std::vector<uint8_t> &buffer; ///< Output buffer
-	size_t pos    = 32;           ///< Bit position
-	uint32_t code = 0;            ///< Bitstream block
+	/** @brief Write bitstream block */
+	void write (uint32_t word)
+	{
+		out[0] = word >> 0;
+		out[1] = word >> 8;
+		out[2] = word >> 16;
+		out[3] = word >> 24;
+		out += 4;
+	}
+
+	uint8_t *out;       ///< Output buffer
+	uint64_t bits  = 0; ///< Pending bits
+	unsigned count = 0; ///< Number of pending bits
+};
+
+/** @brief Huffman encoding plan: everything but the bitstream */
+struct HuffPlan
+{
+	bool fourBit_;             ///< Whether 4-bit encoding is used
+	uint8_t codeLens[256];     ///< Code length per value (bits)
+	uint32_t codes[256];       ///< Huffman code per value
+	std::vector<uint8_t> tree; ///< Huffman encoded tree, padded to 32 bits
+	size_t headerSize;         ///< Compression header size
+	size_t size;               ///< Total output size
 };
 
-std::vector<uint8_t> huffEncode (const void *source, size_t len, bool fourBit_)
+/** @brief Plan Huffman encoding; gives the exact output size
+ *  @param[out] plan          Encoding plan
+ *  @param[in]  byteHistogram Byte counts of the source data
+ *  @param[in]  len           Source data length
+ *  @param[in]  fourBit_      Whether to use 4-bit encoding
+ */
+void huffPlan (HuffPlan &plan, const size_t *byteHistogram, size_t len, bool fourBit_)
 {
-	const uint8_t *src = (const uint8_t *)source;
-	size_t count;
+	unsigned numVals = fourBit_ ? 16 : 256;
+	size_t histogram[256];
 
-	// build Huffman tree
-	std::unique_ptr<Node> root = buildTree (src, len, fourBit_);
+	if (fourBit_)
+	{
+		// fold byte counts into nibble counts
+		std::fill (std::begin (histogram), std::end (histogram), 0);
+		for (unsigned val = 0; val < 256; ++val)
+		{
+			histogram[val & 0xF] += byteHistogram[val];
+			histogram[val >> 4] += byteHistogram[val];
+		}
+	}
+	else
+		std::copy (byteHistogram, byteHistogram + 256, histogram);
 
-	// build lookup table
-	std::vector<Node *> lookup (256);
-	Node::buildLookup (lookup, root);
+	// build Huffman codes and tree
+	plan.fourBit_ = fourBit_;
+	buildCodeLens (plan.codeLens, histogram, numVals);
+	buildCodes (plan.codes, plan.codeLens, numVals);
 
-	// get number of nodes
-	count = root->numNodes ();
+	NodeArena arena;
+	Node *root = buildTree (arena, plan.codes, plan.codeLens, numVals);
 
-	// allocate Huffman encoded tree
-	std::vector<uint8_t> tree ((count + 2) & ~1);
+	// encode Huffman tree; the first slot encodes tree size, padded
+	// so the bitstream stays 32-bit aligned
+	plan.tree.assign ((root->numNodes () + 2) & ~1, 0);
+	Node::encodeTree (plan.tree, root);
 
-	// first slot encodes tree size
-	tree[0] = count / 2;
+	plan.tree.resize ((plan.tree.size () + 3) & ~3);
+	plan.tree[0] = plan.tree.size () / 2 - 1;
 
-	// encode Huffman tree
-	Node::encodeTree (tree, root.get ());
+	// size of the bitstream, in whole blocks
+	size_t bits = 0;
+	for (unsigned val = 0; val < numVals; ++val)
+		bits += histogram[val] * plan.codeLens[val];
 
-	// create output buffer
-	std::vector<uint8_t> result;
-	result.reserve (len); // hopefully our output will be smaller
+	plan.headerSize = len >= 0x1000000 ? 8 : 4;
+	plan.size       = plan.headerSize + plan.tree.size () + (bits + 31) / 32 * 4;
+}
+
+/** @brief Encode data according to a plan
+ *  @param[out] dst    Output buffer; plan.size bytes
+ *  @param[in]  plan   Encoding plan
+ *  @param[in]  source Source data
+ *  @param[in]  len    Source data length
+ */
+void huffEmit (uint8_t *dst, const HuffPlan &plan, const void *source, size_t len)
+{
+	const uint8_t *src      = (const uint8_t *)source;
+	const uint8_t *codeLens = plan.codeLens;
+	const uint32_t *codes   = plan.codes;
 
-	// append compression header
-	result.emplace_back (fourBit_ ? 0x24 : 0x28); // huff type
-	result.emplace_back (len >> 0);
-	result.emplace_back (len >> 8);
-	result.emplace_back (len >> 16);
+	// compression header
+	dst[0] = plan.fourBit_ ? 0x24 : 0x28; // huff type
+	dst[1] = len >> 0;
+	dst[2] = len >> 8;
+	dst[3] = len >> 16;
 
 	if (len >= 0x1000000) // size extension, not compatible with BIOS routines!
 	{
-		result[0] |= 0x80;
-		result.emplace_back (len >> 24);
-		result.emplace_back (0);
-		result.emplace_back (0);
-		result.emplace_back (0);
+		dst[0] |= 0x80;
+		dst[4] = len >> 24;
+		dst[5] = dst[6] = dst[7] = 0;
 	}
 
-	// append Huffman encoded tree
-	tree[0] = 0xFF;
-	result.insert (std::end (result), std::begin (tree), std::end (tree));
-	for (std::size_t i = tree.size (); i < 512; ++i)
-		result.emplace_back (0x00);
-
-	// we're done with the Huffman encoded tree
-	tree.clear ();
-
-	// create bitstream
-	Bitstream bitstream (result);
+	// Huffman encoded tree
+	std::copy (std::begin (plan.tree), std::end (plan.tree), dst + plan.headerSize);
 
 	// encode each input byte
-	if (fourBit_)
+	Bitstream bitstream (dst + plan.headerSize + plan.tree.size ());
+
+	if (plan.fourBit_)
 	{
 		for (size_t i = 0; i < len; ++i)
 		{
-			// lookup the lower nibble's node
-			Node *node = lookup[(src[i] >> 0) & 0xF];
-
-			// add Huffman code to bitstream
-			bitstream.push (node->getCode (), node->getCodeLen ());
-
-			// lookup the upper nibble's node
-			node = lookup[(src[i] >> 4) & 0xF];
-
-			// add Huffman code to bitstream
-			bitstream.push (node->getCode (), node->getCodeLen ());
+			// lower nibble first
+			bitstream.push (codes[src[i] & 0xF], codeLens[src[i] & 0xF]);
+			bitstream.push (codes[src[i] >> 4], codeLens[src[i] >> 4]);
 		}
 	}
 	else
 	{
 		for (size_t i = 0; i < len; ++i)
-		{
-			// lookup the byte value's node
-			Node *node = lookup[src[i]];
-
-			// add Huffman code to bitstream
-			bitstream.push (node->getCode (), node->getCodeLen ());
-		}
+			bitstream.push (codes[src[i]], codeLens[src[i]]);
 	}
 
-	// we're done with the Huffman tree and lookup table
-	root.reset ();
-	lookup.clear ();
-
 	// flush the bitstream
 	bitstream.flush ();
+}
+
+/** @brief Number of bits in Huffman decoding table index */
+constexpr unsigned HUFF_LUT_BITS = 10;
+
+/** @brief Huffman decoding table entry */
+struct HuffEntry
+{
+	uint16_t node; ///< Tree node to continue from, if codeLen is 0
+	uint8_t val;   ///< Huffman tree value
+	uint8_t codeLen; ///< Huffman code length (bits); 0 if longer than the table index
+};
 
-	// pad the output buffer to 4 bytes
-	if (result.size () & 0x3)
-		result.resize ((result.size () + 3) & ~0x3);
+/** @brief Build Huffman decoding table
+ *  @param[out] lut      Table to fill (1 << HUFF_LUT_BITS entries)
+ *  @param[in]  tree     Huffman encoded tree; tree[0] holds its size
+ *  @param[in]  treeSize Huffman encoded tree size
+ *  @param[in]  node     Current node
+ *  @param[in]  code     Huffman code of current node
+ *  @param[in]  codeLen  Huffman code length of current node (bits)
+ *  @returns Whether the tree is valid
+ */
+bool buildDecodeTable (HuffEntry *lut,
+    const uint8_t *tree,
+    size_t treeSize,
+    size_t node,
+    uint32_t code,
+    unsigned codeLen)
+{
+	for (unsigned bit = 0; bit < 2; ++bit)
+	{
+		size_t child       = (node & ~1) + (tree[node] & 0x3F) * 2 + 2 + bit;
+		uint32_t childCode = (code << 1) | bit;
+		unsigned childLen  = codeLen + 1;
 
-	// return the output data
-	return result;
+		if (child >= treeSize)
+			return false;
+
+		if (tree[node] & (0x80 >> bit))
+		{
+			// data node; fill every entry that starts with its code
+			unsigned shift = HUFF_LUT_BITS - childLen;
+			for (uint32_t i = childCode << shift; i < (childCode + 1) << shift; ++i)
+				lut[i] = HuffEntry{0, tree[child], static_cast<uint8_t> (childLen)};
+		}
+		else if (childLen == HUFF_LUT_BITS)
+		{
+			// code is too long for the table; finish it bit by bit
+			lut[childCode] = HuffEntry{static_cast<uint16_t> (child), 0, 0};
+		}
+		else if (!buildDecodeTable (lut, tree, treeSize, child, childCode, childLen))
+			return false;
+	}
+
+	return true;
 }
 
-#ifndef NDEBUG
-void huffDecode (const void *src, void *dst, size_t size, bool fourBit_)
+/** @brief Decode Huffman data
+ *  @param[in]  src      Huffman encoded tree and bitstream (no header)
+ *  @param[in]  srcLen   Source data length
+ *  @param[out] dst      Output buffer
+ *  @param[in]  size     Output size
+ *  @param[in]  fourBit_ Whether 4-bit encoding was used
+ *  @returns Whether the data was decoded without error
+ */
+bool huffDecode (const void *src, size_t srcLen, void *dst, size_t size, bool fourBit_)
 {
 	const uint8_t *in   = (const uint8_t *)src;
+	const uint8_t *end  = in + srcLen;
 	uint8_t *out        = (uint8_t *)dst;
-	uint32_t treeSize   = ((*in) + 1) * 2; // size of the huffman header
-	uint32_t word       = 0;               // 32-bits of input bitstream
-	uint32_t mask       = 0;               // which bit we are reading
-	const uint8_t *tree = in;              // huffman tree
-	size_t node;                           // node in the huffman tree
-	size_t child;                          // child of a node
-	uint32_t offset;                       // offset from node to child
+	const uint8_t *tree = in; // huffman tree
+	size_t treeSize;          // size of the huffman header
+	uint64_t bits    = 0;     // input bitstream, read from bit 63 down
+	unsigned avail   = 0;     // number of valid bits
+	uint8_t byte     = 0;
+	bool nibble      = false;
 
-	// point to the root of the huffman tree
-	node = 1;
+	if (srcLen == 0)
+		return false;
+
+	treeSize = (in[0] + 1) * 2;
+	if (treeSize > srcLen)
+		return false;
+
+	// table for the first HUFF_LUT_BITS of each code
+	std::vector<HuffEntry> lut (1 << HUFF_LUT_BITS);
+	if (!buildDecodeTable (lut.data (), tree, treeSize, 1, 0, 0))
+		return false;
 
 	// move input pointer to beginning of bitstream
 	in += treeSize;
 
-	uint8_t byte = 0;
-	bool nibble = 0;
+	auto refill = [&]
+	{
+		// bitstream is in 32-bit little-endian blocks, read from bit 31 down
+		while (avail <= 32 && end - in >= 4)
+		{
+			uint32_t word = (in[0] << 0) | (in[1] << 8) | (in[2] << 16) | (in[3] << 24);
+			bits |= static_cast<uint64_t> (word) << (32 - avail);
+			avail += 32;
+			in += 4;
+		}
+	};
 
-	auto pushData = [&]
+	while (size > 0)
 	{
-		// copy the child node into the output buffer
+		refill ();
+
+		const HuffEntry &entry = lut[bits >> (64 - HUFF_LUT_BITS)];
+		uint8_t val;
+
+		if (entry.codeLen)
+		{
+			// whole code in the table
+			if (entry.codeLen > avail)
+				return false;
+
+			val = entry.val;
+			bits <<= entry.codeLen;
+			avail -= entry.codeLen;
+		}
+		else
+		{
+			// long code; walk the rest of the tree
+			if (avail < HUFF_LUT_BITS)
+				return false;
+
+			bits <<= HUFF_LUT_BITS;
+			avail -= HUFF_LUT_BITS;
+
+			size_t node = entry.node;
+			for (;;)
+			{
+				if (avail == 0)
+				{
+					refill ();
+					if (avail == 0)
+						return false;
+				}
+
+				unsigned bit = bits >> 63;
+				bits <<= 1;
+				--avail;
+
+				size_t child = (node & ~1) + (tree[node] & 0x3F) * 2 + 2 + bit;
+				if (child >= treeSize)
+					return false;
+
+				if (tree[node] & (0x80 >> bit))
+				{
+					val = tree[child];
+					break;
+				}
+
+				// children always come after their parent, so this ends
+				node = child;
+			}
+		}
+
+		// copy the value into the output buffer
 		if (fourBit_)
 		{
 			if (nibble)
 			{
-				*out++ = byte | (tree[child] << 4);
+				*out++ = byte | ((val & 0xF) << 4);
 				--size;
 			}
 			else
-				byte = tree[child];
+				byte = val & 0xF;
 
 			nibble = !nibble;
 		}
 		else
 		{
-			*out++ = tree[child];
+			*out++ = val;
 			--size;
 		}
+	}
 
-		// start over at the root node
-		node = 1;
-	};
-
-	while (size > 0)
-	{
-		if (mask == 0) // we exhausted 32 bits
-		{
-			// reset the mask
-			mask = 0x80000000;
+	return true;
+}
+}
 
-			// read the next 32 bits
-			word = (in[0] << 0) | (in[1] << 8) | (in[2] << 16) | (in[3] << 24);
-			in += 4;
-		}
+//! GBA Huffman compression.
+/*!	\param bits	Symbol width: 4, 8, or 0 for both, keeping the 
+		smaller.
+*/
+uint huffgba_compress(RECORD *dst, const RECORD *src, uint bits)
+{
+	CprsSink sink;
+	cprs_sink_buffer(&sink);
+	huffgba_compress_to(&sink, src, bits);
 
-		// read the current node's offset value
-		offset = tree[node] & 0x3F;
+	return cprs_sink_detach(&sink, dst);
+}
 
-		child = (node & ~1) + offset * 2 + 2;
+//! GBA Huffman compression, writing to a sink.
+/*!	The output size follows from the histogram, so the widths are 
+	compared before encoding and only the smaller one is encoded, 
+	straight into the sink.
+	\param bits	Symbol width: 4, 8, or 0 for both, keeping the 
+		smaller.
+*/
+uint huffgba_compress_to(CprsSink *sink, const RECORD *src, uint bits)
+{
+	if(!sink || !src || !src->data || (bits != 0 && bits != 4 && bits != 8))
+		return 0;
 
-		if (word & mask) // we read a 1
-		{
-			// point to the "right" child
-			++child;
+	size_t len = rec_size (src);
+	size_t histogram[256];
+	buildHistogram (histogram, src->data, len);
 
-			if (tree[node] & 0x40) // "right" child is a data node
-				pushData ();
-			else // traverse to the "right" child
-				node = child;
-		}
-		else // we read a 0
-		{
-			// pointed to the "left" child
+	HuffPlan plans[2]; // 4-bit, 8-bit
+	const HuffPlan *plan;
 
-			if (tree[node] & 0x80) // "left" child is a data node
-				pushData ();
-			else // traverse to the "left" child
-				node = child;
-		}
+	if(bits == 0)
+	{
+		huffPlan (plans[0], histogram, len, true);
+		huffPlan (plans[1], histogram, len, false);
 
-		// shift to read next bit (read bit 31 to bit 0)
-		mask >>= 1;
+		plan = plans[0].size < plans[1].size ? &plans[0] : &plans[1];
+	}
+	else
+	{
+		huffPlan (plans[0], histogram, len, bits == 4);
+		plan = &plans[0];
 	}
-}
-#endif
-}
 
-uint huffgba_compress(RECORD *dst, const RECORD *src)
-{
-	if(!dst || !src || !src->data)
+	BYTE *dstD = cprs_sink_reserve (sink, plan->size);
+	if(!dstD)
 		return 0;
 
-	auto const huff4 = huffEncode (src->data, rec_size (src), true);
-	auto const huff8 = huffEncode (src->data, rec_size (src), false);
-
-	auto const &huff = huff4.size () < huff8.size () ? huff4 : huff8;
-
-	dst->width  = 1;
-	dst->height = huff.size ();
-	dst->data   = (BYTE*)malloc (huff.size ());
-	memcpy (dst->data, huff.data (), huff.size ());
+	huffEmit (dstD, *plan, src->data, len);
 
 #ifndef NDEBUG
-	std::vector<uint8_t> test (rec_size (src));
+	std::vector<uint8_t> test (len);
 
-	assert (huff[0] == 0x24 || huff[0] == 0x28);
-	huffDecode (&huff[4], test.data (), test.size (), huff[0] == 0x24);
+	assert ((dstD[0] & 0x7F) == 0x24 || (dstD[0] & 0x7F) == 0x28);
+	bool decoded = huffDecode (dstD + plan->headerSize, plan->size - plan->headerSize, 
+		test.data (), test.size (), plan->fourBit_);
+	assert (decoded);
 
-	assert (huff[1] == ((rec_size (src) >> 0) & 0xFF));
-	assert (huff[2] == ((rec_size (src) >> 8) & 0xFF));
-	assert (huff[3] == ((rec_size (src) >> 16) & 0xFF));
+	assert (dstD[1] == ((len >> 0) & 0xFF));
+	assert (dstD[2] == ((len >> 8) & 0xFF));
+	assert (dstD[3] == ((len >> 16) & 0xFF));
 	assert (memcmp (src->data, test.data (), test.size ()) == 0);
 #endif
 
-	return huff.size ();
+	return cprs_sink_commit (sink, plan->size) ? plan->size : 0;
+}
+
+uint huffgba_decompress(RECORD *dst, const RECORD *src)
+{
+	if(!dst || !src || !src->data || rec_size (src) < 4)
+		return 0;
+
+	// Get and check header word
+	u32 header = read32le (src->data);
+	if((header & 0xF0) != CPRS_HUFF_TAG)
+		return 0;
+
+	bool fourBit_ = (header & 0x0F) == 4;
+	if(!fourBit_ && (header & 0x0F) != 8)
+		return 0;
+
+	uint dstS = header >> 8;
+	BYTE *dstD = (BYTE*)malloc (dstS);
+	if(!huffDecode (src->data + 4, rec_size (src) - 4, dstD, dstS, fourBit_))
+	{
+		free (dstD);
+		return 0;
+	}
+
+	rec_attach (dst, dstD, 1, dstS);
+	return dstS;
 }
@@ -1,6 +1,6 @@
 //
 //! \file grit_lz.cpp
-//!   LZSS compression, VRAM safe
+//!   LZSS compression, VRAM safe (or WRAM-only)
 //! \date 20050814 - 20050903
 //! \author cearn
 //
@@ -65,6 +65,47 @@
      match_length=0) and F-long stretches. It's basically a 1 line fix.
      Gawd I hate those. (20050312: ok, so it turned out to be a 2 line fix)
 
+   Oct 2026:
+   * Moved the compressor globals into Lz77State, owned by a 
+     CprsContext, so that compressions no longer share state.
+   * Added an optimal parse for CPRS_LEVEL_MAX. A hash-chain matcher 
+     finds the longest VRAM-safe match at every position and a 
+     backwards DP picks the cheapest literal/match sequence. Because 
+     every prefix of a match is also a match, the longest match per 
+     position covers all candidate lengths.
+   * Added levels 1-8: the same hash chains, but with a bounded 
+     search depth and greedy (1-2) or lazy (3+) matching. Much 
+     faster than the trees; see c_lzLevels for the settings.
+   * Large inputs are searched in parallel. Shards of the input get 
+     their own chains, primed with the window before the shard. 
+     Since a match only depends on the data before it and not on the 
+     parse, the output is the same as the single-threaded one.
+     - Level 9 fills in the longest match at every position, after 
+       which the DP runs over that table.
+     - Levels 1-8 parse each shard speculatively. The greedy/lazy 
+       token at a position only depends on that position, so the 
+       serial pass can reuse a shard's tokens as soon as it lands on 
+       one of its token starts, which happens within a few tokens 
+       of the shard boundary. Searching every position would be 
+       several times more work than these parses do.
+   * Added a WRAM target (CPRS_WRAM). VRAM can't be written per byte, 
+     so LZ77UnCompVram needs every match to be at least 2 back. 
+     LZ77UnCompWram has no such limit, so with CPRS_WRAM all the 
+     matchers may use distance-1 matches, which makes runs a lot 
+     cheaper. The format is the same; only the target differs.
+   * Added NDS LZ11 (tag 0x11) on top of the hash-chain matchers. 
+     LZ11 matches can be up to 65808 bytes long, but the chains only 
+     look for LZ11_SEARCH_MAX bytes; a match that long is extended 
+     afterwards, directly at its distance. That keeps the search 
+     linear on long runs. There's no tree compressor for LZ11, so 
+     level 0 is LZ11_LEVEL_DEFAULT.
+   * Added CPRS_LEVEL_DECODE: the optimal parse, but for decoding 
+     speed instead of size, within LZ_DECODE_OVERHEAD percent of the 
+     smallest output. The cycles come from the decode estimates in 
+     cprs_cost.cpp, which are only a rough model. On the bench 
+     corpus it gives 0.5-2% fewer estimated cycles for 0-0.6% more 
+     bytes.
+
 
    Use, distribute, and modify this code freely.
 
@@ -80,6 +121,7 @@
 #include <assert.h>
 
 #include "cprs.h"
+#include "cldib_par.h"
 
 /// === TYPES =========================================================
 
@@ -99,30 +141,93 @@
 #define TEXT_BUF_CLEAR     0   // byte to initialize the area before text_buf with
 #define NMASK           (RING_MAX-1)  // for wrapping
 
+#define LZ_HASH_BITS      15   // hash-chain head table size (log2)
+#define LZ_HASH_SIZE    (1<<LZ_HASH_BITS)
+#define LZ_DIST_VRAM       2   // VRAM safe: no distance-1 matches
+#define LZ_DIST_WRAM       1   // WRAM: any distance
+#define LZ_SHARD_MIN  0x10000  // minimum shard size for parallel search
 
-// --------------------------------------------------------------------
-// GLOBALS
-// --------------------------------------------------------------------
+#define LZ11_FRAME_MAX  0x10110  // upper limit for LZ11 match_length (65808)
+#define LZ11_SEARCH_MAX     273  // longest LZ11 match the chains look for
+#define LZ11_LEVEL_DEFAULT    6  // level used for LZ11 level 0
 
-/* Compressor global variables.  If you actually want to USE this
-   code in a non-trivial app, put these global variables in a struct,
-   as the Allegro library did.
-*/
-static unsigned long int codesize = 0;  // code size counter
+#define LZ_DECODE_OVERHEAD    3  // % the decode-speed parse may add to the smallest
+#define LZ_DECODE_STEPS      12  // search steps for its bit weight
+#define LZ_DECODE_WEIGHT_MAX 65536.0  // give up on bit weights above this
 
-// Ring buffer of size RING_MAX with extra FRAME_MAX-1 bytes to 
-// facilitate string comparison
-static BYTE text_buf[RING_MAX + FRAME_MAX - 1];
-static int match_position;  // global string match position
-static int match_length;  // global string match length
 
+// --------------------------------------------------------------------
+// CLASSES
+// --------------------------------------------------------------------
 
-// left & right children & parents -- These constitute binary search trees.
-static int lson[RING_MAX+1], rson[RING_MAX+256+1], dad[RING_MAX+1];  
+//! Matcher settings per compression level.
+struct LzLevel
+{
+	int	maxChain;	//!< Max number of chain entries to try.
+	bool lazy;		//!< Check if the next position has a longer match.
+};
 
+//! Levels 1 to CPRS_LEVEL_MAX-1. Level 0 is the tree, MAX the optimal parse.
+static const LzLevel c_lzLevels[CPRS_LEVEL_MAX-1]= 
+{
+	{    4, false },	{   16, false },	{   16, true },	{   32, true }, 
+	{   64, true  },	{  128, true  },	{  256, true },	{ RING_MAX, true }
+};
 
-static BYTE *InBuf, *OutBuf;
-static int InSize, OutSize, InOffset;
+//! Hash chains for the non-tree matchers.
+struct LzHash
+{
+	const BYTE *src;			//!< Data to search.
+	int	size;					//!< Size of src.
+	int	distMin;				//!< Closest allowed match (LZ_DIST_VRAM or LZ_DIST_WRAM).
+	int	lenMax;					//!< Longest match to search for.
+	int	extMax;					//!< Longest match after extending a lenMax one.
+	int	head[LZ_HASH_SIZE];		//!< Most recent position for each 3-byte hash.
+	int	prev[RING_MAX];			//!< Position before pos in its chain, at [pos&NMASK].
+};
+
+/* Compressor state. These used to be file globals, which meant only 
+   one compression could run at a time. They now live in a struct 
+   (as the Allegro library did), owned by a CprsContext.
+*/
+struct Lz77State
+{
+	// Ring buffer of size RING_MAX with extra FRAME_MAX-1 bytes to 
+	// facilitate string comparison
+	BYTE text_buf[RING_MAX + FRAME_MAX - 1];
+	int match_position;		// string match position
+	int match_length;		// string match length
+
+	// left & right children & parents -- These constitute binary search trees.
+	int lson[RING_MAX+1], rson[RING_MAX+256+1], dad[RING_MAX+1];  
+
+	const BYTE *InBuf;
+	BYTE *OutBuf;
+	int InSize, OutSize, InOffset;
+	bool bVramSafe;			// no distance-1 matches
+	BYTE tag;				// CPRS_LZ77_TAG or CPRS_LZ11_TAG
+
+	LzHash hash;
+};
+
+//! Serial walk over a set of chains, for the greedy/lazy parsers.
+struct LzCursor
+{
+	LzHash	*lh;		//!< Chains to search.
+	int	ins;			//!< Next position to add to the chains.
+	int	cachePos;		//!< Position of the last search (the lazy look-ahead).
+	int	cacheLen, cacheDist;
+};
+
+//! Token writer for the non-tree parsers.
+struct LzWriter
+{
+	BYTE *dst;		//!< Output buffer.
+	int	size;		//!< Bytes written so far.
+	int	flagPos;	//!< Position of current flag byte.
+	BYTE mask;		//!< Flag bit of the next token (GBA: big-endian).
+	bool bLz11;		//!< Write LZ11 matches instead of LZ77 ones.
+};
 
 
 // --------------------------------------------------------------------
@@ -131,13 +236,50 @@ static int InSize, OutSize, InOffset;
 
 
 /* Binary search tree functions */
-static void InitTree(void);
-static void InsertNode(int r);
-static void DeleteNode(int p);
+static void InitTree(Lz77State *lz);
+static void InsertNode(Lz77State *lz, int r);
+static void DeleteNode(Lz77State *lz, int p);
+
+/* Hash-chain functions */
+static void lz_hash_init(LzHash *lh, const BYTE *src, int size);
+static void lz_hash_params(LzHash *lh, const LzHash *proto);
+static void lz_hash_insert(LzHash *lh, int pos);
+static void lz_hash_fill(LzHash *lh, int *pins, int end);
+static int lz_hash_match(const LzHash *lh, int pos, int maxChain, 
+	int *pdist);
+static int lz_shard_count(int size);
+static int lz_extend(const LzHash *lh, int pos, int dist, int len);
+static void lz_find_range(LzHash *lh, int begin, int end, int maxChain, 
+	int *lens, u16 *dists);
+static bool lz_find_matches(LzHash *lh, int maxChain, 
+	int *lens, u16 *dists);
+
+/* Greedy/lazy parse functions */
+static void lz_cursor_init(LzCursor *cur, LzHash *lh);
+static int lz_cursor_match(LzCursor *cur, int pos, int maxChain, int *pdist);
+static int lz_token_at(LzCursor *cur, int pos, const LzLevel *lvl, int *pdist);
+static bool lz_parse_shards(LzHash *lh, const LzLevel *lvl, 
+	int *tokLens, u16 *tokDists);
+
+/* Token writer */
+static void lzw_init(LzWriter *lzw, BYTE *dst, bool bLz11);
+static void lzw_literal(LzWriter *lzw, BYTE c);
+static void lzw_match(LzWriter *lzw, int dist, int len);
 
 /* Misc Functions */
-static void CompressLZ77(void);
-static int InChar(void);
+static uint lz_compress(CprsSink *sink, const RECORD *src, u32 flags, 
+	CprsContext *ctx, BYTE tag);
+static void CompressLZ77(Lz77State *lz);
+static void CompressLZ77Hash(Lz77State *lz, const LzLevel *lvl);
+static void lz_ext_lens(const LzHash *lh, const int *lens, 
+	const u16 *dists, int *exts);
+static u32 lz_parse_size(const LzWriter *lzw, const int *lens, 
+	const int *exts, int size, int *toks, u32 *cost);
+static u32 lz_parse_decode(const LzWriter *lzw, const int *lens, 
+	const int *exts, int size, u32 flags, double lambda, int *toks, 
+	u32 *bits, double *cost);
+static bool CompressLZ77Optimal(Lz77State *lz, bool bDecode);
+static int InChar(Lz77State *lz);
 
 
 // --------------------------------------------------------------------
@@ -145,38 +287,142 @@ static int InChar(void);
 // --------------------------------------------------------------------
 
 
-// Initializes InBuf, InSize; allocates OutBuf.
-// the rest is done in CompressLZ77.
-uint lz77gba_compress(RECORD *dst, const RECORD *src)
+//! Allocate LZ77 compressor state.
+Lz77State *lz77_alloc()
+{
+	return (Lz77State*)malloc(sizeof(Lz77State));
+}
+
+//! Free LZ77 compressor state.
+void lz77_free(Lz77State *lz)
+{
+	free(lz);
+}
+
+//! GBA LZ77 compression (LZ77UnCompVram compatible).
+/*!	\param flags	Level and CPRS_WRAM; see lz_compress().
+	\param ctx	Compression context; may be NULL.
+*/
+uint lz77gba_compress(RECORD *dst, const RECORD *src, u32 flags, 
+	CprsContext *ctx)
+{
+	CprsSink sink;
+	cprs_sink_buffer(&sink);
+	lz_compress(&sink, src, flags, ctx, CPRS_LZ77_TAG);
+
+	return cprs_sink_detach(&sink, dst);
+}
+
+//! GBA LZ77 compression, writing to a sink.
+uint lz77gba_compress_to(CprsSink *sink, const RECORD *src, u32 flags, 
+	CprsContext *ctx)
+{
+	return lz_compress(sink, src, flags, ctx, CPRS_LZ77_TAG);
+}
+
+//! NDS LZ11 compression: LZ77 with matches of up to 65808 bytes.
+/*!	\param flags	Level and CPRS_WRAM; see lz_compress().
+	\param ctx	Compression context; may be NULL.
+*/
+uint lz11nds_compress(RECORD *dst, const RECORD *src, u32 flags, 
+	CprsContext *ctx)
+{
+	CprsSink sink;
+	cprs_sink_buffer(&sink);
+	lz_compress(&sink, src, flags, ctx, CPRS_LZ11_TAG);
+
+	return cprs_sink_detach(&sink, dst);
+}
+
+//! NDS LZ11 compression, writing to a sink.
+uint lz11nds_compress_to(CprsSink *sink, const RECORD *src, u32 flags, 
+	CprsContext *ctx)
+{
+	return lz_compress(sink, src, flags, ctx, CPRS_LZ11_TAG);
+}
+
+// Initializes InBuf, InSize; reserves OutBuf in the sink.
+// the rest is done in CompressLZ77, CompressLZ77Hash or 
+// CompressLZ77Optimal, depending on the level in \a flags.
+// The output is VRAM safe unless \a flags has CPRS_WRAM.
+// If ctx is NULL, a temporary state is used.
+uint lz_compress(CprsSink *sink, const RECORD *src, u32 flags, 
+	CprsContext *ctx, BYTE tag)
 {
 	// Fail on the obvious
-	if(src==NULL || src->data==NULL || dst==NULL)
+	if(src==NULL || src->data==NULL || sink==NULL)
 		return 0;
-	
-	InSize= rec_size(src);
-	OutSize = InSize + InSize/8 + 16;
-	OutBuf = (BYTE*)malloc(OutSize);
-	if(OutBuf == NULL)
+
+	Lz77State *lz;
+	if(ctx != NULL)
+	{
+		if(ctx->lz77 == NULL)
+			ctx->lz77= lz77_alloc();
+		lz= ctx->lz77;
+	}
+	else
+		lz= lz77_alloc();
+
+	if(lz == NULL)
 		return 0;
-	InBuf= (BYTE*)src->data;
 
-	CompressLZ77();
-	OutSize= ALIGN4(OutSize);
+	lz->InSize= rec_size(src);
+	lz->OutSize = ALIGN4(lz->InSize + lz->InSize/8 + 16);
+	lz->OutBuf = cprs_sink_reserve(sink, lz->OutSize);
+	lz->InBuf= src->data;
+	lz->bVramSafe= (flags & CPRS_WRAM) == 0;
+	lz->tag= tag;
+	lz->hash.distMin= lz->bVramSafe ? LZ_DIST_VRAM : LZ_DIST_WRAM;
+	if(tag == CPRS_LZ11_TAG)
+	{
+		lz->hash.lenMax= LZ11_SEARCH_MAX;
+		lz->hash.extMax= LZ11_FRAME_MAX;
+	}
+	else
+		lz->hash.lenMax= lz->hash.extMax= FRAME_MAX;
+
+	uint level= BFN_GET(flags, CPRS_LEVEL);
+	if(tag == CPRS_LZ11_TAG && level == 0)
+		level= LZ11_LEVEL_DEFAULT;
 
-	u8 *dstD= (u8*)malloc(OutSize);
-	memcpy(dstD, OutBuf, OutSize);
-	rec_attach(dst, dstD, 1, OutSize);
+	uint dstS= 0;
+	bool bOK= lz->OutBuf != NULL;
+	if(bOK)
+	{
+		if(level >= CPRS_LEVEL_MAX)
+			bOK= CompressLZ77Optimal(lz, level == CPRS_LEVEL_DECODE);
+		else if(level > 0)
+			CompressLZ77Hash(lz, &c_lzLevels[level-1]);
+		else
+			CompressLZ77(lz);
+	}
 
-	free(OutBuf);
+	if(bOK)
+	{
+		dstS= ALIGN4(lz->OutSize);
 
-	return OutSize;
+		memset(&lz->OutBuf[lz->OutSize], 0, dstS-lz->OutSize);
+		if(!cprs_sink_commit(sink, dstS))
+			dstS= 0;
+	}
+
+	lz->OutBuf= NULL;
+
+	if(ctx == NULL)
+		lz77_free(lz);
+
+	return dstS;
 }
 
 //! Decompress GBA LZ77 data.
+/*!	\return	Decompressed size, or 0 if the data is corrupt: it reads 
+		past the end of \a src, refers to data before the start or 
+		writes past the size in the header.
+*/
 uint lz77gba_decompress(RECORD *dst, const RECORD *src)
 {
 	assert(dst && src && src->data);
-	if(dst==NULL || src==NULL || src->data==NULL)
+	if(dst==NULL || src==NULL || src->data==NULL || rec_size(src) < 4)
 		return 0;
 
 	// Get and check header word
@@ -186,21 +432,112 @@ uint lz77gba_decompress(RECORD *dst, const RECORD *src)
 
 	u32 flags;
 	int ii, jj, dstS= header>>8;
-	u8 *srcL= src->data+4, *dstD= (BYTE*)malloc(dstS);
+	u8 *srcL= src->data+4, *srcEnd= src->data+rec_size(src);
+	u8 *dstD= (BYTE*)malloc(dstS);
 
 	for(ii=0, jj=-1; ii<dstS; jj--)
 	{
 		if(jj<0)				// Get block flags
 		{
+			if(srcL >= srcEnd)
+				break;
 			flags= *srcL++;
 			jj= 7;
 		}
 		
 		if(flags>>jj & 1)		// Compressed stint
 		{
+			if(srcEnd-srcL < 2)
+				break;
+
 			int count= (srcL[0]>>4)+THRESHOLD+1;
 			int ofs=  ((srcL[0]&15)<<8 | srcL[1])+1;
 			srcL += 2;
+			if(ofs > ii || count > dstS-ii)
+				break;
+
+			while(count--)
+			{
+				dstD[ii]= dstD[ii-ofs];
+				ii++;
+			}
+		}
+		else					// Single byte from source
+		{
+			if(srcL >= srcEnd)
+				break;
+			dstD[ii++]= *srcL++;
+		}
+	}
+
+	if(ii < dstS)
+	{
+		free(dstD);
+		return 0;
+	}
+
+	rec_attach(dst, dstD, 1, dstS);
+	return dstS;
+}
+
+//! Decompress NDS LZ11 data.
+/*!	\return	Decompressed size, or 0 if the data is corrupt; see 
+		lz77gba_decompress().
+	\note	Matches come in three sizes, picked by the top nybble 
+		of the first byte:
+		- 0: 3 bytes, length 17-272.
+		- 1: 4 bytes, length 273-65808.
+		- 2-15: 2 bytes, length 3-16 (nybble+1).
+		The last 12 bits are always the distance-1.
+*/
+uint lz11nds_decompress(RECORD *dst, const RECORD *src)
+{
+	assert(dst && src && src->data);
+	if(dst==NULL || src==NULL || src->data==NULL || rec_size(src) < 4)
+		return 0;
+
+	// Get and check header word
+	u32 header= read32le(src->data);
+	if((header&255) != CPRS_LZ11_TAG)
+		return 0;
+
+	u32 flags;
+	int ii, jj, dstS= header>>8;
+	u8 *srcL= src->data+4, *srcEnd= src->data+rec_size(src);
+	u8 *dstD= (BYTE*)malloc(dstS);
+
+	for(ii=0, jj=-1; ii<dstS; jj--)
+	{
+		if(jj<0)				// Get block flags
+		{
+			if(srcL >= srcEnd)
+				break;
+			flags= *srcL++;
+			jj= 7;
+		}
+		
+		if(flags>>jj & 1)		// Compressed stint
+		{
+			if(srcL >= srcEnd)
+				break;
+
+			int count, ind= srcL[0]>>4;
+			int size= ind == 0 ? 3 : ind == 1 ? 4 : 2;
+			if(srcEnd-srcL < size)
+				break;
+
+			if(ind == 0)
+				count= ((srcL[0]&15)<<4 | srcL[1]>>4) + 0x11;
+			else if(ind == 1)
+				count= ((srcL[0]&15)<<12 | srcL[1]<<4 | srcL[2]>>4) + 0x111;
+			else
+				count= ind+1;
+
+			srcL += size;
+			int ofs= ((srcL[-2]&15)<<8 | srcL[-1])+1;
+			if(ofs > ii || count > dstS-ii)
+				break;
+
 			while(count--)
 			{
 				dstD[ii]= dstD[ii-ofs];
@@ -208,7 +545,17 @@ uint lz77gba_decompress(RECORD *dst, const RECORD *src)
 			}
 		}
 		else					// Single byte from source
+		{
+			if(srcL >= srcEnd)
+				break;
 			dstD[ii++]= *srcL++;
+		}
+	}
+
+	if(ii < dstS)
+	{
+		free(dstD);
+		return 0;
 	}
 
 	rec_attach(dst, dstD, 1, dstS);
@@ -227,8 +574,9 @@ uint lz77gba_decompress(RECORD *dst, const RECORD *src)
    for strings that begin with character i.  These are
    initialized to NIL.  Note there are 256 trees.
 */
-void InitTree(void)
+void InitTree(Lz77State *lz)
 {
+	int *rson= lz->rson, *dad= lz->dad;
 	int  i;
 	for(i= RING_MAX+1; i <= RING_MAX+256; i++)
 		rson[i]= NIL;
@@ -244,8 +592,11 @@ void InitTree(void)
    one, because the old one will be deleted sooner.
    Note r plays double role, as tree node and position in buffer.
 */
-void InsertNode(int r)
+void InsertNode(Lz77State *lz, int r)
 {
+	BYTE *text_buf= lz->text_buf;
+	int *lson= lz->lson, *rson= lz->rson, *dad= lz->dad;
+	int &match_length= lz->match_length, &match_position= lz->match_position;
 	int  i, p, cmp, prev_length;
 	BYTE *key;
 
@@ -288,7 +639,7 @@ void InsertNode(int r)
 			// isn't the previous one (r-1)
 			// for normal case, remove the if.
 			// That's _IT_?!? Yup, that's it.
-			if(p != ((r-1)&NMASK) )
+			if(!lz->bVramSafe || p != ((r-1)&NMASK) )
 			{
 				match_length= i;
 				match_position= p;
@@ -315,8 +666,9 @@ void InsertNode(int r)
 /* DeleteNode() ************************
    Deletes node p from the tree.
 */
-void DeleteNode(int p)  
+void DeleteNode(Lz77State *lz, int p)  
 {
+	int *lson= lz->lson, *rson= lz->rson, *dad= lz->dad;
 	int  q;
 
 	if(dad[p] == NIL)
@@ -358,8 +710,11 @@ void DeleteNode(int p)
    Compress InBuffer to OutBuffer.
 */
 
-void CompressLZ77(void)
+void CompressLZ77(Lz77State *lz)
 {
+	BYTE *text_buf= lz->text_buf, *OutBuf= lz->OutBuf;
+	int &match_length= lz->match_length, &match_position= lz->match_position;
+	int &OutSize= lz->OutSize;
 	int  i, c, len, r, s, last_match_length, code_buf_ptr;
 	unsigned char  code_buf[17];
 	unsigned short mask;
@@ -368,10 +723,10 @@ void CompressLZ77(void)
 	unsigned int savematch;
 
 	OutSize=4;  // skip the compression type and file size
-	InOffset=0;
+	lz->InOffset=0;
 	match_position= curmatch= RING_MAX-FRAME_MAX;
 
-	InitTree();  // initialize trees
+	InitTree(lz);  // initialize trees
 	code_buf[0] = 0;  /* code_buf[1..16] saves eight units of code, and
 	code_buf[0] works as eight flags, "0" representing that the unit
 	is an unencoded letter (1 byte), "1" a position-and-length pair
@@ -383,7 +738,7 @@ void CompressLZ77(void)
 	for(i = s; i < r; i++)
 		text_buf[i] = TEXT_BUF_CLEAR;
 	// Read FRAME_MAX bytes into the last FRAME_MAX bytes of the buffer
-	for(len = 0; len < FRAME_MAX && (c = InChar()) != -1; len++)
+	for(len = 0; len < FRAME_MAX && (c = InChar(lz)) != -1; len++)
 		text_buf[r + len] = c;  
 	if(len == 0)
 		return;
@@ -399,7 +754,7 @@ void CompressLZ77(void)
 	//	InsertNode(r - i);
 
 	// Create the first node, sets match_length to 0
-	InsertNode(r);
+	InsertNode(lz, r);
 
 	// GBA LZSS masks are big-endian
 	mask = 0x80;
@@ -435,7 +790,6 @@ void CompressLZ77(void)
 			for(i=0; i < code_buf_ptr; i++)
 				OutBuf[OutSize++]= code_buf[i];
 
-			codesize += code_buf_ptr;
 			code_buf[0] = 0;  
 			code_buf_ptr = 1;
 			mask = 0x80;
@@ -444,9 +798,9 @@ void CompressLZ77(void)
 		// Inserts nodes for this match. The last_match_length is 
 		// required because InsertNode changes match_length.
 		last_match_length = match_length;
-		for(i=0; i < last_match_length && (c = InChar()) != -1; i++) 
+		for(i=0; i < last_match_length && (c = InChar(lz)) != -1; i++) 
 		{
-			DeleteNode(s);      // Delete string beforelook-ahead
+			DeleteNode(lz, s);      // Delete string beforelook-ahead
 			text_buf[s] = c;    // place new bytes
 			// text_buf[N..RING_MAX+FRAME_MAX> is a double for text_buf[0..FRAME_MAX>
 			// for easier string comparison
@@ -458,17 +812,17 @@ void CompressLZ77(void)
 			r = (r + 1) & NMASK;
 
 			// Register the string in text_buf[r..r+FRAME_MAX-1]
-			InsertNode(r);
+			InsertNode(lz, r);
 		}
 
 		while(i++ < last_match_length) 
 		{    
 			// After the end of text
-			DeleteNode(s);            // no need to read, but
+			DeleteNode(lz, s);            // no need to read, but
 			s = (s + 1) & NMASK;
 			r = (r + 1) & NMASK;
 			if(--len)
-				InsertNode(r);        // buffer may not be empty
+				InsertNode(lz, r);        // buffer may not be empty
 		}
 	} while(len > 0);    // until length of string to be processed is zero
 
@@ -477,23 +831,664 @@ void CompressLZ77(void)
 		// Send remaining code.
 		for(i=0; i < code_buf_ptr; i++) 
 			OutBuf[OutSize++]=code_buf[i]; 
-
-		codesize += code_buf_ptr;
 	}
 
 	FileSize= (BYTE*)OutBuf;
 	FileSize[0]= CPRS_LZ77_TAG;
-	FileSize[1]= ((InSize>>0)&0xFF);
-	FileSize[2]= ((InSize>>8)&0xFF);
-	FileSize[3]= ((InSize>>16)&0xFF);
+	FileSize[1]= ((lz->InSize>>0)&0xFF);
+	FileSize[2]= ((lz->InSize>>8)&0xFF);
+	FileSize[3]= ((lz->InSize>>16)&0xFF);
+}
+
+/* lz_hash_init() **********************
+   Empty the hash chains and set the data to search. 
+   distMin is left alone.
+*/
+void lz_hash_init(LzHash *lh, const BYTE *src, int size)
+{
+	int ii;
+	lh->src= src;
+	lh->size= size;
+	for(ii=0; ii<LZ_HASH_SIZE; ii++)
+		lh->head[ii]= -1;
+}
+
+/* lz_hash_params() ********************
+   Copy the match limits (distMin, lenMax, extMax) of proto to lh.
+*/
+void lz_hash_params(LzHash *lh, const LzHash *proto)
+{
+	lh->distMin= proto->distMin;
+	lh->lenMax= proto->lenMax;
+	lh->extMax= proto->extMax;
+}
+
+//! Hash of the 3 bytes at \a src (the minimum match length).
+static inline uint lz_hash(const BYTE *src)
+{
+	uint key= src[0]<<16 | src[1]<<8 | src[2];
+	return (key*2654435761u) >> (32-LZ_HASH_BITS);
+}
+
+/* lz_hash_insert() ********************
+   Add position pos to the chains. The caller must make sure that 
+   positions are added in order and that pos+2 is inside src.
+*/
+void lz_hash_insert(LzHash *lh, int pos)
+{
+	uint hash= lz_hash(&lh->src[pos]);
+	lh->prev[pos&NMASK]= lh->head[hash];
+	lh->head[hash]= pos;
+}
+
+/* lz_hash_fill() **********************
+   Add positions *pins up to end to the chains and update *pins.
+   Positions too close to the end to start a match are skipped.
+*/
+void lz_hash_fill(LzHash *lh, int *pins, int end)
+{
+	int pos, last= MIN(end, lh->size-THRESHOLD);
+	for(pos= *pins; pos<last; pos++)
+		lz_hash_insert(lh, pos);
+	*pins= MAX(*pins, end);
+}
+
+/* lz_hash_match() *********************
+   Find the longest match for the string at pos among the positions 
+   already in the chains. At most maxChain entries are tried; 
+   the search ends early at a lh->lenMax-long match. For equal lengths 
+   the closest match wins. Returns the length (0 for none) and the 
+   distance via pdist.
+   NOTE: the result only depends on the data in the window before 
+   pos, which is what makes the parallel search possible.
+*/
+int lz_hash_match(const LzHash *lh, int pos, int maxChain, int *pdist)
+{
+	const BYTE *src= lh->src;
+	int ii, cand, lenMax= MIN(lh->lenMax, lh->size-pos);
+	int bestLen= 0, bestDist= 0;
+
+	*pdist= 0;
+	if(lenMax <= THRESHOLD)
+		return 0;
+
+	for(cand= lh->head[lz_hash(&src[pos])]; cand >= 0 && maxChain-- > 0; 
+		cand= lh->prev[cand&NMASK])
+	{
+		int dist= pos-cand;
+		if(dist > RING_MAX)
+			break;
+		if(dist < lh->distMin)
+			continue;
+
+		// Cheap reject: must at least beat the current best
+		if(src[cand+bestLen] != src[pos+bestLen])
+			continue;
+
+		for(ii=0; ii<lenMax; ii++)
+			if(src[cand+ii] != src[pos+ii])
+				break;
+
+		if(ii > bestLen)
+		{
+			bestLen= ii;
+			bestDist= dist;
+			if(bestLen >= lenMax)
+				break;
+		}
+	}
+
+	*pdist= bestDist;
+	return bestLen;
+}
+
+/* lz_extend() *************************
+   Length of the match at pos and dist, given that its first len 
+   bytes match. Only lh->lenMax-long matches are extended, up to 
+   lh->extMax.
+*/
+int lz_extend(const LzHash *lh, int pos, int dist, int len)
+{
+	if(len < lh->lenMax)
+		return len;
+
+	const BYTE *src= lh->src;
+	int lenMax= MIN(lh->extMax, lh->size-pos);
+	while(len < lenMax && src[pos+len] == src[pos+len-dist])
+		len++;
+
+	return len;
+}
+
+/* lz_shard_count() ********************
+   Number of shards for the parallel search; 1 means search serially.
+*/
+int lz_shard_count(int size)
+{
+	return MAX(1, MIN(par_get_threads(), size/LZ_SHARD_MIN));
+}
+
+/* lz_find_range() *********************
+   Fill lens[] and dists[] with the longest match at positions 
+   [begin, end>. The chains are primed with the window before begin.
+*/
+void lz_find_range(LzHash *lh, int begin, int end, int maxChain, 
+	int *lens, u16 *dists)
+{
+	int pos, dist, ins= MAX(0, begin-RING_MAX);
+
+	for(pos=begin; pos<end; pos++)
+	{
+		lz_hash_fill(lh, &ins, pos);
+		lens[pos]= lz_hash_match(lh, pos, maxChain, &dist);
+		dists[pos]= dist;
+	}
+}
+
+/* lz_find_matches() *******************
+   Fill lens[] and dists[] with the longest match at every position 
+   of lh->src, using lz_shard_count() shards. lh itself is used for 
+   a single shard; the others get temporary chains.
+   Returns false if those can't be allocated.
+*/
+bool lz_find_matches(LzHash *lh, int maxChain, int *lens, u16 *dists)
+{
+	int size= lh->size, shardN= lz_shard_count(size);
+
+	if(shardN <= 1)
+	{
+		lz_find_range(lh, 0, size, maxChain, lens, dists);
+		return true;
+	}
+
+	LzHash *shards= (LzHash*)malloc(shardN*sizeof(LzHash));
+	if(shards == NULL)
+		return false;
+
+	int shardS= size/shardN;
+	par_for(shardN, [&](int ii)
+	{
+		int begin= ii*shardS, end= (ii == shardN-1) ? size : begin+shardS;
+		lz_hash_init(&shards[ii], lh->src, size);
+		lz_hash_params(&shards[ii], lh);
+		lz_find_range(&shards[ii], begin, end, maxChain, lens, dists);
+	});
+
+	free(shards);
+
+	return true;
+}
+
+/* lzw_init() **************************
+   Start a token stream at dst. Does not write the header.
+*/
+void lzw_init(LzWriter *lzw, BYTE *dst, bool bLz11)
+{
+	lzw->dst= dst;
+	lzw->size= 0;
+	lzw->flagPos= 0;
+	lzw->mask= 0;
+	lzw->bLz11= bLz11;
+}
+
+//! Reserve a new flag byte if the current one is full.
+static inline void lzw_flag(LzWriter *lzw, bool isMatch)
+{
+	if(lzw->mask == 0)
+	{
+		lzw->flagPos= lzw->size++;
+		lzw->dst[lzw->flagPos]= 0;
+		lzw->mask= 0x80;
+	}
+	if(isMatch)
+		lzw->dst[lzw->flagPos] |= lzw->mask;
+	lzw->mask >>= 1;
+}
+
+/* lzw_literal() ***********************
+   Add an unencoded byte.
+*/
+void lzw_literal(LzWriter *lzw, BYTE c)
+{
+	lzw_flag(lzw, false);
+	lzw->dst[lzw->size++]= c;
+}
+
+/* lzw_match() *************************
+   Add a position and length pair. 
+   len in [THRESHOLD+1, FRAME_MAX] (LZ11: LZ11_FRAME_MAX); 
+   dist in [1, RING_MAX].
+*/
+void lzw_match(LzWriter *lzw, int dist, int len)
+{
+	BYTE *dst= lzw->dst;
+
+	lzw_flag(lzw, true);
+	dist--;
+	if(!lzw->bLz11)
+		dst[lzw->size++]= ((len-(THRESHOLD+1))<<4) | ((dist>>8)&0x0F);
+	else if(len <= 0x10)
+		dst[lzw->size++]= ((len-1)<<4) | ((dist>>8)&0x0F);
+	else if(len <= 0x110)
+	{
+		len -= 0x11;
+		dst[lzw->size++]= len>>4;
+		dst[lzw->size++]= ((len&0x0F)<<4) | ((dist>>8)&0x0F);
+	}
+	else
+	{
+		len -= 0x111;
+		dst[lzw->size++]= 0x10 | len>>12;
+		dst[lzw->size++]= len>>4 & 0xFF;
+		dst[lzw->size++]= ((len&0x0F)<<4) | ((dist>>8)&0x0F);
+	}
+	dst[lzw->size++]= dist&0xFF;
+}
+
+//! Bits taken by a match of length len, flag bit included.
+static inline u32 lzw_match_cost(const LzWriter *lzw, int len)
+{
+	if(!lzw->bLz11 || len <= 0x10)
+		return 17;
+	return len <= 0x110 ? 25 : 33;
+}
+
+
+/* lz_cursor_init() ********************
+   Start a serial search on lh. The chains are (re)initialized as 
+   needed by lz_cursor_match().
+*/
+void lz_cursor_init(LzCursor *cur, LzHash *lh)
+{
+	cur->lh= lh;
+	cur->ins= 0;
+	cur->cachePos= -1;
+	lz_hash_init(lh, lh->src, lh->size);
+}
+
+/* lz_cursor_match() *******************
+   lz_hash_match() for a cursor: brings the chains up to pos first. 
+   Positions must be non-decreasing. If pos is more than a window 
+   past the chains, they're restarted one window before pos.
+*/
+int lz_cursor_match(LzCursor *cur, int pos, int maxChain, int *pdist)
+{
+	if(pos == cur->cachePos)
+	{
+		*pdist= cur->cacheDist;
+		return cur->cacheLen;
+	}
+
+	if(cur->ins < pos-RING_MAX)
+	{
+		lz_hash_init(cur->lh, cur->lh->src, cur->lh->size);
+		cur->ins= pos-RING_MAX;
+	}
+
+	lz_hash_fill(cur->lh, &cur->ins, pos);
+
+	cur->cachePos= pos;
+	cur->cacheLen= lz_hash_match(cur->lh, pos, maxChain, &cur->cacheDist);
+	*pdist= cur->cacheDist;
+	return cur->cacheLen;
+}
+
+/* lz_token_at() ***********************
+   The token the greedy/lazy parse of lvl emits at pos: returns 
+   1 for a literal, or the match length (with pdist). With lazy 
+   matching, a match is put off by a literal if the next position 
+   has a longer one. Matches of lh->lenMax are extended.
+   NOTE: this only depends on pos, not on the tokens before it.
+*/
+int lz_token_at(LzCursor *cur, int pos, const LzLevel *lvl, int *pdist)
+{
+	int len, dist, dist2;
+
+	*pdist= 0;
+	len= lz_cursor_match(cur, pos, lvl->maxChain, &dist);
+	if(len <= THRESHOLD)
+		return 1;
+
+	if(lvl->lazy && len < cur->lh->lenMax && pos+1 < cur->lh->size)
+	{
+		if(lz_cursor_match(cur, pos+1, lvl->maxChain, &dist2) > len)
+			return 1;
+	}
+
+	*pdist= dist;
+	return lz_extend(cur->lh, pos, dist, len);
+}
+
+/* lz_parse_shards() *******************
+   Parse lz_shard_count() shards of lh->src in parallel, each from 
+   its own start. Every token goes into tokLens[] and tokDists[] at 
+   its position; tokLens[] is 0 for positions that don't start one. 
+   Returns false if the chains can't be allocated.
+*/
+bool lz_parse_shards(LzHash *lh, const LzLevel *lvl, 
+	int *tokLens, u16 *tokDists)
+{
+	int size= lh->size, shardN= lz_shard_count(size);
+
+	LzHash *shards= (LzHash*)malloc(shardN*sizeof(LzHash));
+	if(shards == NULL)
+		return false;
+
+	memset(tokLens, 0, size*sizeof(int));
+
+	int shardS= size/shardN;
+	par_for(shardN, [&](int ii)
+	{
+		int pos, len, dist, end= (ii == shardN-1) ? size : (ii+1)*shardS;
+		LzCursor cur;
+
+		shards[ii].src= lh->src;
+		shards[ii].size= size;
+		lz_hash_params(&shards[ii], lh);
+		lz_cursor_init(&cur, &shards[ii]);
+
+		for(pos= ii*shardS; pos<end; pos += len)
+		{
+			len= lz_token_at(&cur, pos, lvl, &dist);
+			tokLens[pos]= len;
+			tokDists[pos]= dist;
+		}
+	});
+
+	free(shards);
+
+	return true;
+}
+
+/* CompressLZ77Hash() ******************
+   Compress InBuffer to OutBuffer using hash chains with the search 
+   depth and lazy matching of lvl. Large inputs are parsed in shards 
+   first (see lz_parse_shards()); the serial pass below takes the 
+   shard tokens where it can and searches for itself where it can't.
+*/
+void CompressLZ77Hash(Lz77State *lz, const LzLevel *lvl)
+{
+	int pos, len, dist, size= lz->InSize;
+	LzCursor cur;
+
+	lz->hash.src= lz->InBuf;
+	lz->hash.size= size;
+	lz_cursor_init(&cur, &lz->hash);
+
+	int *tokLens= NULL;
+	u16 *tokDists= NULL;
+	if(lz_shard_count(size) > 1)
+	{
+		tokLens= (int*)malloc(size*sizeof(int));
+		tokDists= (u16*)malloc(size*sizeof(u16));
+		if(tokLens==NULL || tokDists==NULL || 
+			!lz_parse_shards(&lz->hash, lvl, tokLens, tokDists))
+		{
+			free(tokLens);		tokLens= NULL;
+			free(tokDists);		tokDists= NULL;
+		}
+	}
+
+	LzWriter lzw;
+	lzw_init(&lzw, &lz->OutBuf[4], lz->tag == CPRS_LZ11_TAG);
+
+	for(pos=0; pos<size; pos += len)
+	{
+		if(tokLens != NULL && tokLens[pos] != 0)
+		{
+			len= tokLens[pos];
+			dist= tokDists[pos];
+		}
+		else
+			len= lz_token_at(&cur, pos, lvl, &dist);
+
+		if(len > THRESHOLD)
+			lzw_match(&lzw, dist, len);
+		else
+			lzw_literal(&lzw, lz->InBuf[pos]);
+	}
+
+	write32le(lz->OutBuf, size<<8 | lz->tag);
+	lz->OutSize= 4 + lzw.size;
+
+	free(tokLens);
+	free(tokDists);
+}
+
+/* lz_ext_lens() ***********************
+   Fill exts[] with the length a match at every position can have 
+   after extending it: lens[ii] itself, unless that's lenMax and 
+   extMax is longer. The extension at ii follows from the one at 
+   ii+1 when that has the same distance.
+*/
+void lz_ext_lens(const LzHash *lh, const int *lens, const u16 *dists, 
+	int *exts)
+{
+	int ii, extLen, extNext= 0, distNext= 0;
+
+	for(ii=lh->size-1; ii>=0; ii--)
+	{
+		extLen= lens[ii];
+		if(extLen == lh->lenMax && lh->extMax > lh->lenMax)
+		{
+			if(extNext != 0 && distNext == dists[ii])
+				extLen= MIN(extNext+1, lh->extMax);
+			else
+				extLen= lz_extend(lh, ii, dists[ii], extLen);
+		}
+		exts[ii]= extLen;
+		extNext= lens[ii] == lh->lenMax ? extLen : 0;
+		distNext= dists[ii];
+	}
+}
+
+/* lz_parse_size() *********************
+   Smallest parse. A literal costs 9 bits, a match 17 (flag bit 
+   included), so cost[i]= min(9 + cost[i+1], 17 + cost[i+len]) for 
+   every len in [THRESHOLD+1, longest match at i]. Ties go to the 
+   longer match, which means fewer tokens to decode.
+   LZ11 matches cost 17, 25 or 33 bits, depending on the length. 
+   Puts the chosen token length (1 for a literal) at every position 
+   in toks[]; returns the size of the stream in bits.
+*/
+u32 lz_parse_size(const LzWriter *lzw, const int *lens, const int *exts, 
+	int size, int *toks, u32 *cost)
+{
+	int ii, len;
+
+	cost[size]= 0;
+	for(ii=size-1; ii>=0; ii--)
+	{
+		u32 best= cost[ii+1] + 9, tmp;
+		int bestLen= 1;
+		if(exts[ii] > lens[ii] && 
+			(tmp= cost[ii+exts[ii]] + lzw_match_cost(lzw, exts[ii])) < best)
+		{
+			best= tmp;
+			bestLen= exts[ii];
+		}
+		for(len=lens[ii]; len > THRESHOLD; len--)
+		{
+			if((tmp= cost[ii+len] + lzw_match_cost(lzw, len)) < best)
+			{
+				best= tmp;
+				bestLen= len;
+			}
+		}
+		cost[ii]= best;
+		toks[ii]= bestLen;
+	}
+
+	return cost[0];
+}
+
+/* lz_parse_decode() *******************
+   Parse for decoding speed: minimizes cycles + lambda*bits, with 
+   the cycles from cprs_lz_token_cycles(). At lambda 0 that's the 
+   fastest parse regardless of size; the larger lambda, the closer 
+   it gets to lz_parse_size(). Ties go to the longer match.
+   Same output as lz_parse_size(); bits[] and cost[] are scratch.
+*/
+u32 lz_parse_decode(const LzWriter *lzw, const int *lens, const int *exts, 
+	int size, u32 flags, double lambda, int *toks, u32 *bits, double *cost)
+{
+	int ii, len;
+	double cycles[LZ11_SEARCH_MAX+1];
+
+	for(len=1; len<=LZ11_SEARCH_MAX; len++)
+		cycles[len]= cprs_lz_token_cycles(len, lzw->bLz11, flags);
+
+	cost[size]= 0;
+	bits[size]= 0;
+	for(ii=size-1; ii>=0; ii--)
+	{
+		double best= cost[ii+1] + cycles[1] + lambda*9, tmp;
+		int bestLen= 1;
+		len= exts[ii];
+		if(len > lens[ii] && (tmp= cost[ii+len] + lambda*lzw_match_cost(lzw, len) + 
+			cprs_lz_token_cycles(len, lzw->bLz11, flags)) < best)
+		{
+			best= tmp;
+			bestLen= len;
+		}
+		for(len=lens[ii]; len > THRESHOLD; len--)
+		{
+			if((tmp= cost[ii+len] + lambda*lzw_match_cost(lzw, len) + 
+				cycles[len]) < best)
+			{
+				best= tmp;
+				bestLen= len;
+			}
+		}
+		cost[ii]= best;
+		toks[ii]= bestLen;
+		bits[ii]= bits[ii+bestLen] + (bestLen > THRESHOLD ? 
+			lzw_match_cost(lzw, bestLen) : 9);
+	}
+
+	return bits[0];
+}
+
+/* CompressLZ77Optimal() ***************
+   Compress InBuffer to OutBuffer with the smallest possible output 
+   (see lz_parse_size()).
+   With bDecode, it's the parse that decodes fastest while staying 
+   within LZ_DECODE_OVERHEAD percent of the smallest. Short matches 
+   decode slower than the literals they replace, so that parse has 
+   fewer and longer tokens. lz_parse_decode() is a trade-off between 
+   cycles and bits; the weight of the bits is searched for, the 
+   lowest one that fits wins.
+   Returns false if the work buffers can't be allocated.
+*/
+bool CompressLZ77Optimal(Lz77State *lz, bool bDecode)
+{
+	LzHash *lh= &lz->hash;
+	int ii, size= lz->InSize;
+
+	int *lens= (int*)malloc((size+1)*sizeof(int));
+	int *exts= (int*)malloc((size+1)*sizeof(int));
+	int *toks= (int*)malloc((size+1)*sizeof(int));
+	u16 *dists= (u16*)malloc((size+1)*sizeof(u16));
+	u32 *cost= (u32*)malloc((size+1)*sizeof(u32));
+	int *tryToks= NULL, *tmpToks;
+	double *tryCost= NULL;
+
+	bool bOK= lens && exts && toks && dists && cost;
+	if(bOK && bDecode)
+	{
+		tryToks= (int*)malloc((size+1)*sizeof(int));
+		tryCost= (double*)malloc((size+1)*sizeof(double));
+		bOK= tryToks && tryCost;
+	}
+
+	// Longest match at every position
+	if(bOK)
+	{
+		lz_hash_init(lh, lz->InBuf, size);
+		bOK= lz_find_matches(lh, RING_MAX, lens, dists);
+	}
+
+	if(!bOK)
+	{
+		free(lens);		free(exts);		free(toks);
+		free(dists);	free(cost);
+		free(tryToks);	free(tryCost);
+		return false;
+	}
+
+	LzWriter lzw;
+	lzw_init(&lzw, &lz->OutBuf[4], lz->tag == CPRS_LZ11_TAG);
+	lz_ext_lens(lh, lens, dists, exts);
+
+	u32 bits= lz_parse_size(&lzw, lens, exts, size, toks, cost);
+
+	if(bDecode)
+	{
+		u32 flags= lz->bVramSafe ? 0 : CPRS_WRAM;
+		u32 cap= bits + (u32)(bits*(LZ_DECODE_OVERHEAD/100.0));
+		double lo= 0, hi= 1;
+
+		// toks[] keeps the best parse that fits. First see if the 
+		// fastest one does, then find a weight that does, then 
+		// close in on the lowest.
+		if(lz_parse_decode(&lzw, lens, exts, size, flags, 0, 
+			tryToks, cost, tryCost) <= cap)
+		{
+			SWAP3(toks, tryToks, tmpToks);
+			hi= 0;
+		}
+		else
+		{
+			while(hi < LZ_DECODE_WEIGHT_MAX && lz_parse_decode(&lzw, lens, 
+				exts, size, flags, hi, tryToks, cost, tryCost) > cap)
+			{
+				lo= hi;
+				hi *= 4;
+			}
+
+			if(hi < LZ_DECODE_WEIGHT_MAX)
+				SWAP3(toks, tryToks, tmpToks);
+		}
+
+		for(ii=0; ii<LZ_DECODE_STEPS && hi > 0 && hi < LZ_DECODE_WEIGHT_MAX; ii++)
+		{
+			double mid= (lo+hi)/2;
+			if(lz_parse_decode(&lzw, lens, exts, size, flags, mid, 
+				tryToks, cost, tryCost) <= cap)
+			{
+				SWAP3(toks, tryToks, tmpToks);
+				hi= mid;
+			}
+			else
+				lo= mid;
+		}
+	}
+
+	// Write out tokens
+	for(ii=0; ii<size; ii += toks[ii])
+	{
+		if(toks[ii] > THRESHOLD)
+			lzw_match(&lzw, dists[ii], toks[ii]);
+		else
+			lzw_literal(&lzw, lz->InBuf[ii]);
+	}
+
+	write32le(lz->OutBuf, size<<8 | lz->tag);
+	lz->OutSize= 4 + lzw.size;
+
+	free(lens);		free(exts);		free(toks);
+	free(dists);	free(cost);
+	free(tryToks);	free(tryCost);
+
+	return true;
 }
 
 /* InChar() ****************************
    Get the next character from the input stream, or -1 for end of file.
 */
-int InChar()
+int InChar(Lz77State *lz)
 {
-	return (InOffset < InSize) ? InBuf[InOffset++] : -1;
+	return (lz->InOffset < lz->InSize) ? lz->InBuf[lz->InOffset++] : -1;
 }
 
 // EOF
@@ -5,113 +5,358 @@
 //! \author cearn
 //
 // === NOTES === 
+/*
+  * 20261017: Rewrote the compressor around runs instead of bytes, 
+	with the run searches done 16 or 32 bytes at a time (SSE2 / 
+	AVX2, scalar otherwise). The data is written straight into the 
+	output, which has room for the worst-case size; only the exact 
+	size is kept.
+	The output is the same as the old byte-by-byte version. That 
+	one had a few quirks that are kept:
+	- A stretch of literals is flushed once it has 0x80 bytes, 
+	  even if the bytes after it would start a run with the last 
+	  ones. Runs never start more than 0x7F bytes after the start 
+	  of the stretch.
+	- A run of 0x82 bytes ends; the next byte starts from scratch.
+  * 20261017: Added an optimal parse for CPRS_LEVEL_MAX. Greedy 
+	stints waste header bytes, e.g. by cutting a literal stretch 
+	for a 3-byte run that costs as much as the bytes themselves. 
+	The decoder is the same.
+*/
 
 #include <stdlib.h>
 #include <memory.h>
 #include <assert.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 #include "cprs.h"
 
 
+// --------------------------------------------------------------------
+// CONSTANTS
+// --------------------------------------------------------------------
+
+
+#define RLE_RUN_MIN		   3	// shortest run
+#define RLE_RUN_MAX		0x82	// longest run
+#define RLE_NON_MAX		0x80	// longest literal stretch
+
+
+// --------------------------------------------------------------------
+// PROTOTYPES
+// --------------------------------------------------------------------
+
+
+static uint rle_find_triple(const BYTE *srcD, uint begin, uint end);
+static uint rle_find_run_end(const BYTE *srcD, uint begin, uint end);
+static uint rle8_encode(BYTE *dstD, const BYTE *srcD, uint srcS);
+static bool rle8_encode_optimal(BYTE *dstD, const BYTE *srcD, uint srcS, 
+	uint *pdstS);
+
+
 // --------------------------------------------------------------------
 // FUNCTIONS
 // --------------------------------------------------------------------
 
 
-//! Compression routine for GBA RLE
-/*!
+//! Index of the lowest set bit; \a mask may not be 0.
+static inline uint rle_ctz(u32 mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+//! Find the first triple of equal bytes.
+/*!	\return	The first ii in [begin, end> for which srcD[ii-2], 
+		srcD[ii-1] and srcD[ii] are equal, or \a end if there's 
+		none. \a begin must be at least 2.
 */
-uint rle8gba_compress(RECORD *dst, const RECORD *src)
+uint rle_find_triple(const BYTE *srcD, uint begin, uint end)
 {
-	if(src==NULL || dst==NULL || src->data == NULL)
-		return 0;
+	uint ii= begin;
 
-	uint ii, rle, non;
-	BYTE curr, prev;
+#if defined(__AVX2__)
+	for( ; ii+32 <= end; ii += 32)
+	{
+		__m256i a= _mm256_loadu_si256((const __m256i*)&srcD[ii]);
+		__m256i b= _mm256_loadu_si256((const __m256i*)&srcD[ii-1]);
+		__m256i c= _mm256_loadu_si256((const __m256i*)&srcD[ii-2]);
+		u32 mask= _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(a, b), _mm256_cmpeq_epi8(b, c)));
+		if(mask)
+			return ii + rle_ctz(mask);
+	}
+#elif defined(__SSE2__) || defined(_M_X64)
+	for( ; ii+16 <= end; ii += 16)
+	{
+		__m128i a= _mm_loadu_si128((const __m128i*)&srcD[ii]);
+		__m128i b= _mm_loadu_si128((const __m128i*)&srcD[ii-1]);
+		__m128i c= _mm_loadu_si128((const __m128i*)&srcD[ii-2]);
+		u32 mask= _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(a, b), _mm_cmpeq_epi8(b, c)));
+		if(mask)
+			return ii + rle_ctz(mask);
+	}
+#endif
 
-	uint srcS= src->width*src->height;
-	BYTE *srcD= src->data;
+	for( ; ii<end; ii++)
+		if(srcD[ii] == srcD[ii-1] && srcD[ii-1] == srcD[ii-2])
+			break;
 
-	// Annoyingly enough, rle _can_ end up being larger than
-	// the original. A checker-board will do it for example.
-	// if srcS is the size of the alternating pattern, then
-	// the endresult will be 4 + srcS + (srcS+0x80-1)/0x80.
-	uint dstS= 8+2*(srcS);
-	BYTE *dstD = (BYTE*)malloc(dstS), *dstL= dstD;
-	if(dstD == NULL)
-		return 0;
+	return ii;
+}
 
-	prev= srcD[0];
-	rle= non= 1;
+//! Find the end of the run of srcD[begin-1].
+/*!	\return	The first ii in [begin, end> with a different byte, 
+		or \a end if there's none. \a begin must be at least 1.
+*/
+uint rle_find_run_end(const BYTE *srcD, uint begin, uint end)
+{
+	uint ii= begin;
+	BYTE curr= srcD[begin-1];
 
-	// NOTE! non will always be 1 more than the actual non-stretch
-	// PONDER: why [1,srcS] ?? (to finish up the stretch)
-	for(ii=1; ii<=srcS; ii++)
+#if defined(__AVX2__)
+	__m256i c= _mm256_set1_epi8((char)curr);
+	for( ; ii+32 <= end; ii += 32)
 	{
-		if(ii != srcS)
-			curr= srcD[ii];
+		__m256i a= _mm256_loadu_si256((const __m256i*)&srcD[ii]);
+		u32 mask= ~(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, c));
+		if(mask)
+			return ii + rle_ctz(mask);
+	}
+#elif defined(__SSE2__) || defined(_M_X64)
+	__m128i c= _mm_set1_epi8((char)curr);
+	for( ; ii+16 <= end; ii += 16)
+	{
+		__m128i a= _mm_loadu_si128((const __m128i*)&srcD[ii]);
+		u32 mask= _mm_movemask_epi8(_mm_cmpeq_epi8(a, c)) ^ 0xFFFF;
+		if(mask)
+			return ii + rle_ctz(mask);
+	}
+#endif
 
-		if(rle==0x82 || ii==srcS)	// stop rle
-			prev= ~curr;
+	for( ; ii<end; ii++)
+		if(srcD[ii] != curr)
+			break;
 
-		if(rle<3 && (non+rle > 0x80 || ii==srcS))	// ** mini non
+	return ii;
+}
+
+//! RLE-encode \a srcD, without header.
+/*!	\param dstD	Destination buffer; see rle8gba_compress() for the 
+		size it needs.
+	\return	Size of the encoded data.
+	\note	A stretch of literals starts at \a start. It ends at the 
+		first run of RLE_RUN_MIN bytes, or after RLE_NON_MAX bytes 
+		if there is none in time. 
+*/
+uint rle8_encode(BYTE *dstD, const BYTE *srcD, uint srcS)
+{
+	uint start, ii, end, dstS= 0;
+
+	for(start=0; start<srcS; )
+	{
+		// Look for a run that starts in this stretch. The last byte 
+		// of the triple must come before RLE_NON_MAX.
+		end= MIN(start+RLE_NON_MAX, srcS);
+		ii= (end-start > 2) ? rle_find_triple(srcD, start+2, end) : end;
+		if(ii == end)
 		{
-			non += rle;
-			dstL[0]= non-2;	
-			memcpy(&dstL[1], &srcD[ii-non+1], non-1);
-			dstL += non;
-			non= rle= 1;
+			// No run: write the whole stretch as literals
+			dstD[dstS]= end-start-1;
+			memcpy(&dstD[dstS+1], &srcD[start], end-start);
+			dstS += 1+end-start;
+			start= end;
+			continue;
 		}
-		else if(curr == prev)		// ** start rle / non on hold
+
+		// Literals before the run
+		ii -= RLE_RUN_MIN-1;
+		if(ii > start)
 		{
-			rle++;
-			if( rle==3 && non>1 )	// write non-1 bytes
-			{
-				dstL[0]= non-2;
-				memcpy(&dstL[1], &srcD[ii-non-1], non-1);
-				dstL += non;
-				non= 1;
-			}
+			dstD[dstS]= ii-start-1;
+			memcpy(&dstD[dstS+1], &srcD[start], ii-start);
+			dstS += 1+ii-start;
 		}
-		else						// ** rle end / non start
+
+		// The run itself
+		end= rle_find_run_end(srcD, ii+RLE_RUN_MIN, MIN(ii+RLE_RUN_MAX, srcS));
+		dstD[dstS  ]= 0x80 | (end-ii-RLE_RUN_MIN);
+		dstD[dstS+1]= srcD[ii];
+		dstS += 2;
+		start= end;
+	}
+
+	return dstS;
+}
+
+//! Smallest possible RLE encoding of \a srcD, without header.
+/*!	With cost[ii] the size of the best encoding of srcD[ii..srcS>:
+	- literals: cost[ii]= 1+kk+cost[ii+kk], kk in [1, RLE_NON_MAX].
+	- run: cost[ii]= 2+cost[ii+kk], kk in [RLE_RUN_MIN, RLE_RUN_MAX] 
+	  and inside the run at ii.
+	The literal minimum is the minimum of cost[jj]+jj over a window 
+	of RLE_NON_MAX, which is kept in a deque. For equal sizes the 
+	longer stint wins.
+	\param dstD	Destination buffer; same size as for rle8_encode().
+	\param pdstS	Receives the size of the encoded data.
+	\return	False if the work buffers can't be allocated.
+*/
+bool rle8_encode_optimal(BYTE *dstD, const BYTE *srcD, uint srcS, 
+	uint *pdstS)
+{
+	u32 *cost= (u32*)malloc((srcS+1)*sizeof(u32));
+	uint *deque= (uint*)malloc((srcS+2)*sizeof(uint));
+	short *stints= (short*)malloc((srcS+1)*sizeof(short));
+	if(cost==NULL || deque==NULL || stints==NULL)
+	{
+		free(cost);		free(deque);	free(stints);
+		return false;
+	}
+
+	// Cheapest encoding from the back. stints[ii] is the stint that 
+	// starts at ii: the literal count, or minus the run length.
+	// The deque holds positions in reach, newest at the front; 
+	// cost[jj]+jj goes up towards the front, so the back is the 
+	// best literal stint.
+	uint ii, jj, kk, kMax, front= srcS+1, back= srcS+1, runLen= 0;
+
+	cost[srcS]= 0;
+	for(ii=srcS; ii-- > 0; )
+	{
+		u32 best= ~0u;
+		int stint= 0;
+
+		// Runs, if any
+		runLen= (ii+1 < srcS && srcD[ii] == srcD[ii+1]) ? runLen+1 : 1;
+		kMax= MIN(runLen, RLE_RUN_MAX);
+		for(kk=kMax; kk >= RLE_RUN_MIN; kk--)
 		{
-			if(rle>=3)	// write rle
+			if(2+cost[ii+kk] < best)
 			{
-				dstL[0]= 0x80 | (rle-3);
-				dstL[1]= srcD[ii-1];
-				dstL += 2;
-				non= 0;
-				rle= 1;
+				best= 2+cost[ii+kk];
+				stint= -(int)kk;
 			}
-			non += rle;
-			rle= 1;
 		}
-		prev= curr;
+
+		// Literals: add ii+1 and drop what's out of reach
+		jj= ii+1;
+		while(front < back && cost[deque[front]]+deque[front] > cost[jj]+jj)
+			front++;
+		deque[--front]= jj;
+		while(deque[back-1] > ii+RLE_NON_MAX)
+			back--;
+
+		jj= deque[back-1];
+		if(1+(jj-ii)+cost[jj] < best)
+		{
+			best= 1+(jj-ii)+cost[jj];
+			stint= jj-ii;
+		}
+
+		cost[ii]= best;
+		stints[ii]= stint;
 	}
-	
-	dstS= ALIGN4(dstL-dstD)+4;
 
-	dstL= (BYTE*)malloc(dstS);
-	if(dstL == NULL)
+	// Write out stints
+	uint dstS= 0;
+	for(ii=0; ii<srcS; ii += kk)
 	{
-		free(dstD);
-		return 0;
+		if(stints[ii] > 0)
+		{
+			kk= stints[ii];
+			dstD[dstS]= kk-1;
+			memcpy(&dstD[dstS+1], &srcD[ii], kk);
+			dstS += 1+kk;
+		}
+		else
+		{
+			kk= -stints[ii];
+			dstD[dstS  ]= 0x80 | (kk-RLE_RUN_MIN);
+			dstD[dstS+1]= srcD[ii];
+			dstS += 2;
+		}
 	}
 
-	*(u32*)dstL= cprs_create_header(srcS, CPRS_RLE_TAG);
-	memcpy(dstL+4, dstD, dstS-4);
-	rec_attach(dst, dstL, 1, dstS);
+	free(cost);
+	free(deque);
+	free(stints);
 
-	free(dstD);
+	*pdstS= dstS;
+	return true;
+}
 
-	return dstS;
+//! Compression routine for GBA RLE
+/*!	\param flags	Compression flags. CPRS_LEVEL_MAX gives the smallest 
+		output (rle8_encode_optimal()); other levels are the same.
+*/
+uint rle8gba_compress(RECORD *dst, const RECORD *src, u32 flags)
+{
+	CprsSink sink;
+	cprs_sink_buffer(&sink);
+	rle8gba_compress_to(&sink, src, flags);
+
+	return cprs_sink_detach(&sink, dst);
 }
 
+//! Compression routine for GBA RLE, writing to a sink.
+/*!	The data is encoded once, straight into the sink. Room for the 
+	worst-case size is reserved, but only the actual size committed.
+	\param flags	Compression flags. CPRS_LEVEL_MAX gives the smallest 
+		output (rle8_encode_optimal()); other levels are the same.
+*/
+uint rle8gba_compress_to(CprsSink *sink, const RECORD *src, u32 flags)
+{
+	if(src==NULL || sink==NULL || src->data == NULL)
+		return 0;
+
+	uint srcS= rec_size(src);
+	BYTE *srcD= src->data;
+
+	// Annoyingly enough, rle _can_ end up being larger than
+	// the original. A checker-board will do it for example.
+	// if srcS is the size of the alternating pattern, then
+	// the endresult will be 4 + srcS + (srcS+0x80-1)/0x80.
+	uint dstS= ALIGN4(srcS + (srcS+RLE_NON_MAX-1)/RLE_NON_MAX)+4;
+
+	BYTE *dstD= cprs_sink_reserve(sink, dstS);
+	if(dstD == NULL)
+		return 0;
 
+	write32le(dstD, srcS<<8 | CPRS_RLE_TAG);
+	uint rleS;
+	if(BFN_GET(flags, CPRS_LEVEL) < CPRS_LEVEL_MAX || 
+		!rle8_encode_optimal(dstD+4, srcD, srcS, &rleS))
+		rleS= rle8_encode(dstD+4, srcD, srcS);
+	assert(4+rleS <= dstS);
+
+	dstS= ALIGN4(rleS)+4;
+	memset(dstD+4+rleS, 0, dstS-4-rleS);
+
+	return cprs_sink_commit(sink, dstS) ? dstS : 0;
+}
+
+
+//! Decompress GBA RLE data.
+/*!	\return	Decompressed size, or 0 if the data is corrupt.
+*/
 uint rle8gba_decompress(RECORD *dst, const RECORD *src)
 {
 	assert(dst && src && src->data);
-	if(dst==NULL || src==NULL || src->data==NULL)
+	if(dst==NULL || src==NULL || src->data==NULL || rec_size(src) < 4)
 		return 0;
 
 	// Get and check header word
@@ -120,26 +365,40 @@ uint rle8gba_decompress(RECORD *dst, const RECORD *src)
 		return 0;
 
 	uint ii, dstS= header>>8, size=0;
-	u8 *srcL= src->data+4, *dstD= (BYTE*)malloc(dstS);
+	u8 *srcL= src->data+4, *srcEnd= src->data+rec_size(src);
+	u8 *dstD= (BYTE*)malloc(dstS);
 
 	for(ii=0; ii<dstS; ii += size)
 	{
+		if(srcL >= srcEnd)
+			break;
+
 		// Get header byte
 		header= *srcL++;
 
 		if(header&0x80)		// compressed stint
 		{
+			if(srcL >= srcEnd)
+				break;
 			size= MIN( (header&~0x80)+3, dstS-ii);
 			memset(&dstD[ii], *srcL++, size);
 		}
 		else				// noncompressed stint
 		{
 			size= MIN(header+1, dstS-ii);
+			if((uint)(srcEnd-srcL) < size)
+				break;
 			memcpy(&dstD[ii], srcL, size);
 			srcL += size;
 		}
 	}
 
+	if(ii < dstS)
+	{
+		free(dstD);
+		return 0;
+	}
+
 	rec_attach(dst, dstD, 1, dstS);
 	return dstS;
 }
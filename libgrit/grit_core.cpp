@@ -36,14 +36,15 @@ static const char __grit_app_string[]=
 
 
 const char *c_fileTypes[GRIT_FTYPE_MAX]= {"c", "s", "bin", "gbfs", "grf" /*, "o"*/};
-const char *c_cprsNames[GRIT_CPRS_MAX]= { "not", "lz77", "huf", "rle", "fake" };
+const char *c_cprsNames[GRIT_CPRS_MAX]= { "not", "lz77", "huf", "rle", "fake", "auto", 
+	"huf4", "huf8", "lz11" };
 const char *c_identTypes[3]= { "u8", "u16", "u32" };
 const char *c_identAffix[E_AFX_MAX]= 
 {
 	"Tiles", "Bitmap", 
 	"Map", "Pal", 
 	"MetaTiles", "MetaMap",
-	"Grf"
+	"Grf", "Segs"
 };
 
 const MapselFormat c_mapselGbaText= 
@@ -132,6 +133,8 @@ void grit_init(GritRec *gr)
 	gr->bHeader= true;
 	gr->bAppend= false;
 	gr->bExport= true;
+	gr->bCprsVerify= false;
+	gr->cprsTimeWeight= 0;
 	gr->bRiff= false;
 
 	// Area options (tl inclusive, rb exclusive).
@@ -144,6 +147,7 @@ void grit_init(GritRec *gr)
 	gr->gfxProcMode= GRIT_EXPORT;
 	gr->gfxDataType= GRIT_U32;
 	gr->gfxCompression= GRIT_CPRS_OFF;
+	gr->gfxCprsLevel= GRIT_CPRS_LEVEL_DEFAULT;
 	gr->gfxMode= GRIT_GFX_TILE;
 	gr->gfxHasAlpha= false;
 	gr->gfxAlphaColor= clr2rgb(RGB(255, 0, 255));
@@ -151,11 +155,13 @@ void grit_init(GritRec *gr)
 	gr->gfxOffset= 0;
 	gr->gfxIsOffsetOnZero= false;
 	gr->gfxIsShared= false;
+	gr->gfxSegSize= 0;
 
 	// Map options.
 	gr->mapProcMode= GRIT_EXCLUDE;
 	gr->mapDataType= GRIT_U16;
 	gr->mapCompression= GRIT_CPRS_OFF;
+	gr->mapCprsLevel= GRIT_CPRS_LEVEL_DEFAULT;
 	gr->mapRedux= GRIT_RDX_REG8;
 	gr->mapLayout= GRIT_MAP_FLAT;
 	gr->msFormat= c_mapselGbaText;
@@ -171,6 +177,7 @@ void grit_init(GritRec *gr)
 	gr->palProcMode= GRIT_EXPORT;
 	gr->palDataType= GRIT_U16;
 	gr->palCompression= GRIT_CPRS_OFF;
+	gr->palCprsLevel= GRIT_CPRS_LEVEL_DEFAULT;
 	gr->palHasAlpha= false;
 	gr->palAlphaId= 0;
 	gr->palStart= 0;
@@ -198,6 +205,7 @@ void grit_clear(GritRec *gr)
 	free(gr->_gfxRec.data);
 	free(gr->_mapRec.data);
 	free(gr->_metaRec.data);
+	free(gr->_gfxSegRec.data);
 
 	GritShared *grs= gr->shared;
 	memset(gr, 0, sizeof(GritRec));
@@ -215,6 +223,8 @@ void grit_copy_options(GritRec *dst, const GritRec *src)
 	dst->bHeader= src->bHeader;
 	dst->bAppend= src->bAppend;
 	dst->bExport= src->bExport;
+	dst->bCprsVerify= src->bCprsVerify;
+	dst->cprsTimeWeight= src->cprsTimeWeight;
 	dst->bRiff= src->bRiff;
 
 	// Area options (tl inclusive, rb exclusive).	
@@ -227,6 +237,7 @@ void grit_copy_options(GritRec *dst, const GritRec *src)
 	dst->gfxProcMode= src->gfxProcMode;
 	dst->gfxDataType= src->gfxDataType;
 	dst->gfxCompression= src->gfxCompression;
+	dst->gfxCprsLevel= src->gfxCprsLevel;
 	dst->gfxMode= src->gfxMode;
 	dst->gfxHasAlpha= src->gfxHasAlpha;
 	dst->gfxAlphaColor= src->gfxAlphaColor;
@@ -234,11 +245,13 @@ void grit_copy_options(GritRec *dst, const GritRec *src)
 	dst->gfxOffset= src->gfxOffset;
 	dst->gfxIsOffsetOnZero= src->gfxIsOffsetOnZero;
 	dst->gfxIsShared= src->gfxIsShared;
+	dst->gfxSegSize= src->gfxSegSize;
 
 	// Map options.	
 	dst->mapProcMode= src->mapProcMode;
 	dst->mapDataType= src->mapDataType;
 	dst->mapCompression= src->mapCompression;
+	dst->mapCprsLevel= src->mapCprsLevel;
 	dst->mapRedux= src->mapRedux;
 	dst->mapLayout= src->mapLayout;
 	dst->msFormat= src->msFormat;
@@ -254,6 +267,7 @@ void grit_copy_options(GritRec *dst, const GritRec *src)
 	dst->palProcMode= src->palProcMode;
 	dst->palDataType= src->palDataType;
 	dst->palCompression= src->palCompression;
+	dst->palCprsLevel= src->palCprsLevel;
 	dst->palHasAlpha= src->palHasAlpha;
 	dst->palAlphaId= src->palAlphaId;
 	dst->palStart= src->palStart;
@@ -394,7 +408,7 @@ void grit_dump_short(GritRec *gr, FILE *fp, const char *pre)
 		fputs(pre, fp);
 		fprintf(fp, "%s%s : %s cprs, %s, [%d,%d>\n", 
 			gr->symName, c_identAffix[E_AFX_PAL],
-			c_cprsNames[gr->palCompression], c_identTypes[gr->palDataType], 
+			c_cprsNames[gr->palCompression & GRIT_CPRS_MASK], c_identTypes[gr->palDataType], 
 			gr->palStart, gr->palEnd);
 	}
 
@@ -403,7 +417,7 @@ void grit_dump_short(GritRec *gr, FILE *fp, const char *pre)
 		fputs(pre, fp);
 		fprintf(fp, "%s%s : %s cprs, %s, %dbpp, +%d\n", 
 			gr->symName, c_identAffix[gr->isTiled() ? E_AFX_TILE : E_AFX_BMP],
-			c_cprsNames[gr->gfxCompression], c_identTypes[gr->gfxDataType], 
+			c_cprsNames[gr->gfxCompression & GRIT_CPRS_MASK], c_identTypes[gr->gfxDataType], 
 			gr->gfxBpp, gr->gfxOffset);
 	}
 
@@ -413,7 +427,7 @@ void grit_dump_short(GritRec *gr, FILE *fp, const char *pre)
 		fprintf(fp, "%s%s : %s cprs, %s, ", 
 			gr->symName, 
 			c_identAffix[gr->isMetaTiled() ? E_AFX_MTILE :  E_AFX_MAP],
-			c_cprsNames[gr->mapCompression], c_identTypes[gr->mapDataType]);
+			c_cprsNames[gr->mapCompression & GRIT_CPRS_MASK], c_identTypes[gr->mapDataType]);
 		if(gr->mapRedux)
 		{
 			fputs("-t", fp);
@@ -421,6 +435,8 @@ void grit_dump_short(GritRec *gr, FILE *fp, const char *pre)
 				fputs("f", fp);
 			if(gr->mapRedux & GRIT_RDX_PBANK)
 				fputs("p", fp);
+			if(gr->mapRedux & GRIT_RDX_ORDER)
+				fputs("o", fp);
 			fputs(", ", fp);
 		}
 		const char *layouts[]={ "reg flat", "reg sbb", "affine" };
@@ -43,6 +43,7 @@ enum EGritItem
 	GRIT_ITEM_MAP		= 1,		//!< Tilemap stuff
 	GRIT_ITEM_METAMAP	= 2,		//!< Metamap stuff
 	GRIT_ITEM_PAL		= 3,		//!< Palette stuff
+	GRIT_ITEM_GFXSEGS	= 4,		//!< Offsets of compressed gfx segments
 	GRIT_ITEM_MAX	
 };
 
@@ -67,12 +68,32 @@ enum EGritDataType
 enum EGritCompression
 {
 	GRIT_CPRS_OFF	= 0,	//!< No compression. `-{t}z!'
-	GRIT_CPRS_LZ77	= 1,	//!< LZ77 compression (LZ77UnCompVram compatible). `-{t}zl'
-	GRIT_CPRS_HUFF	= 2,	//!< 8bit Huffman compression (might be buggy). `-{t}zh'
-	GRIT_CPRS_RLE	= 3,	//!< 8bit RLE compression. `-{t}zr'	
+	GRIT_CPRS_LZ77	= 1,	//!< LZ77 compression (LZ77UnCompVram compatible). `-{t}zl'. `-{t}zl9' for smallest output.
+	GRIT_CPRS_HUFF	= 2,	//!< Huffman compression, smaller of 4 and 8bit. `-{t}zh'
+	GRIT_CPRS_RLE	= 3,	//!< 8bit RLE compression. `-{t}zr'. `-{t}zr9' for smallest output.
 	GRIT_CPRS_HEADER= 4,	//!< Header word for symmetry `-{t}z0'
-	GRIT_CPRS_MAX
-//	GRIT_CPRS_DIFF	= 8,
+	GRIT_CPRS_AUTO	= 5,	//!< Smallest of lz77, huff, rle and header-only `-{t}za'
+	GRIT_CPRS_HUFF4	= 6,	//!< 4bit Huffman compression. `-{t}zh4'
+	GRIT_CPRS_HUFF8	= 7,	//!< 8bit Huffman compression. `-{t}zh8'
+	GRIT_CPRS_LZ11	= 8,	//!< NDS LZ11 compression (long matches). `-{t}zx'. `-{t}zx9' for smallest output.
+	GRIT_CPRS_MAX,
+	GRIT_CPRS_MASK	= 0x0F,	//!< Compression type part of the mode.
+	GRIT_CPRS_DIFF	= 0x10,	//!< Diff filter before compression. `-{t}zd{type}'
+	GRIT_CPRS_DIFF_AUTO= 0x20,	//!< Diff filter if it helps. `-{t}zD{type}'
+	GRIT_CPRS_DIFF16= 0x40,	//!< Diff filter on 16bit units; set from the data type.
+	GRIT_CPRS_WRAM	= 0x80,	//!< LZ77/LZ11 for WRAM (LZ77UnCompWram): allows distance-1 matches. `-{t}zlw'
+};
+
+//! Compression levels, for codecs that have them (LZ77, LZ11, RLE).
+/*!	Goes after the compression type: `-{t}zl{n}'. The ones in 
+	between trade speed for size.
+*/
+enum EGritCprsLevel
+{
+	GRIT_CPRS_LEVEL_DEFAULT	= 0,	//!< Classic compressor `-{t}zl'
+	GRIT_CPRS_LEVEL_FAST	= 1,	//!< Fastest `-{t}zl1'
+	GRIT_CPRS_LEVEL_MAX		= 9,	//!< Smallest output `-{t}zl9'
+	GRIT_CPRS_LEVEL_DECODE	= 10,	//!< Fastest decode, within a few % of the smallest `-{t}zls'
 };
 
 //! Image mode flags
@@ -102,6 +123,7 @@ enum EGritMapRedux
 //	GRIT_RDX_BLANK	= 0x02,	//!< Reduce for blank tiles only `-mRb'
 	GRIT_RDX_FLIP	= 0x04,	//!< Reduce for flipped tiles `-mRf'
 	GRIT_RDX_PBANK	= 0x08,	//!< Reduce for palette-swapped tiles `-mRp'
+	GRIT_RDX_ORDER	= 0x20,	//!< Reorder tileset for compression `-mRo'
 	GRIT_RDX_AFF	= 0x01,	//!< Recommended rdx flags for affine bgs  `-mRa' (= -mRt)
 	GRIT_RDX_REG4	= 0x0D,	//!< Recommended rdx flags for 4bpp reg bgs `-mR4' (= -mRtfp)
 	GRIT_RDX_REG8	= 0x05,	//!< Recommended rdx flags for 8bpp reg bgs `-mR8' (= -mRtf)
@@ -181,6 +203,7 @@ enum eAffix
 	E_AFX_MTILE	,		//!< Meta-tiles
 	E_AFX_MMAP	,		//!< Metamap
 	E_AFX_GRF	,		//!< GRIF format
+	E_AFX_SEGS	,		//!< Segment offsets
 	E_AFX_MAX
 };
 
@@ -254,6 +277,8 @@ struct GritRec
 	bool	 bAppend;		//!< Append to existing file (-fa).
 	bool	 bExport;		//!< Global export toggle (?).
 	bool	 bRiff;			//!< RIFFed data.
+	bool	 bCprsVerify;	//!< Check compressed data by decompressing it (-Zv).
+	uint	 cprsTimeWeight;	//!< Decode time weight for auto compression (-Zt{n}).
 
 // Area ( [l,r>, [t,r> )
 	int		 areaLeft;		//!< Export rect, left (-al {number} ).
@@ -265,6 +290,7 @@ struct GritRec
 	echar	 gfxProcMode;	//!< Graphics process mode.
 	echar	 gfxDataType;	//!< Graphics data type (-gu{num} ).
 	echar	 gfxCompression;	//!< Graphics compression type
+	u8		 gfxCprsLevel;	//!< Graphics compression level (-gz{char}{num} ).
 	echar	 gfxMode;		//!< Graphics mode (tile, bmp, bmpA).
 	bool	 texModeEnabled; //!< texture operations enabled
 	u8		 gfxBpp;		//!< Output bitdepth (-gB{num} ).
@@ -274,11 +300,13 @@ struct GritRec
 	u32		 gfxOffset;		//!< Pixel value offset (-ga {num}).
 	bool	 gfxIsOffsetOnZero;	//!< Pixel value offset for zero pixel as well. (-gA {num}).
 	bool	 gfxIsShared;	//!< Graphics are shared (-gS).
+	uint	 gfxSegSize;	//!< (Meta)tiles or pixel rows per compressed segment; 0 for one stream (-gzS{num} ).
 		
 // Map:
 	echar	 mapProcMode;	//!< Map process mode (-m).
 	echar	 mapDataType;	//!< Map data type (-mu {num} ).
 	echar	 mapCompression;	//!< Map compression type (-mz{char} ).
+	u8		 mapCprsLevel;	//!< Map compression level (-mz{char}{num} ).
 	echar	 mapRedux;		//!< Map tile-reduction mode (-mR[tpf,48a] ).
 	echar	 mapLayout;		//!< Map layout mode (-mL{char} ).
 	//u32		 mapOffset;		//!< Map-entry tile-value offset (-ma {num}).
@@ -295,6 +323,7 @@ struct GritRec
 	echar	 palProcMode;	//!< Palette process mode (-p).
 	echar	 palDataType;	//!< Palette data type.
 	echar	 palCompression;	//!< Palette compression type.
+	u8		 palCprsLevel;	//!< Palette compression level (-pz{char}{num} ).
 	bool	 palHasAlpha;	//!< Has special transparency index.
 	u32		 palAlphaId;	//!< Transparent palette entry
 	int		 palStart;		//!< First palette entry to export.
@@ -312,6 +341,10 @@ struct GritRec
 	RECORD	 _mapRec;	//!< Output tilemap data
 	RECORD	 _metaRec;	//!< Output metatile data
 	RECORD	 _palRec;	//!< Output palette data
+	RECORD	 _gfxSegRec;	//!< Segment offsets into _gfxRec, if segmented
+	u8		 _gfxCprs;	//!< Compression used for _gfxRec (auto resolved)
+	u8		 _mapCprs;	//!< Compression used for _mapRec (auto resolved)
+	u8		 _palCprs;	//!< Compression used for _palRec (auto resolved)
 };
 
 
@@ -347,7 +380,13 @@ bool grit_validate(GritRec *gr);	// validate input
 bool grit_prep(GritRec *gr);		// prepare data (conv, cprs, etc)
 bool grit_export(GritRec *gr);		// export data
 
-bool grit_compress(RECORD *dst, const RECORD *src, u32 flags);
+bool grit_compress(RECORD *dst, const RECORD *src, uint mode, uint level=0, 
+	bool verify=false, uint *pmode=NULL, uint timeWeight=0);
+bool grit_compress_segs(RECORD *dst, RECORD *offsets, const RECORD *src, 
+	uint segSize, uint mode, uint level=0, bool verify=false, 
+	uint *pmode=NULL, uint timeWeight=0);
+uint grit_cprs_from_tag(uint tag);
+uint grit_decode_cycles(const RECORD *rec, uint used);
 
 
 // void grit_dump(GritRec *gr, FILE *fp);
@@ -5,17 +5,34 @@
 //! \author  cearn
 //
 /* === NOTES === 
+  * 20261017: Added GRIT_CPRS_AUTO, diff filters, WRAM-target LZ77 
+    and compression checks.
+  * 20261017: Added decode-time estimates, and time-weighted 
+    GRIT_CPRS_AUTO.
+  * 20261017: Added segmented compression (grit_compress_segs()).
   * 20080111, JV. Name changes, part 1
 */
 
 #include "grit.h"
 
 #include "cprs.h"
+#include "cldib_par.h"
 
 // --------------------------------------------------------------------
 // PROTOTYPES
 // --------------------------------------------------------------------
 
+static bool grit_compress_codec(RECORD *dst, const RECORD *src, uint codec, 
+	u32 flags, uint timeWeight, uint *pmode);
+static bool grit_compress_diff(RECORD *dst, const RECORD *src, uint mode, 
+	u32 flags, uint timeWeight, uint *pmode);
+static bool grit_compress_auto(RECORD *dst, const RECORD *src, u32 flags, 
+	uint timeWeight);
+static double grit_cprs_cost(const RECORD *rec, uint used, 
+	uint timeWeight);
+static bool grit_compress_verify(const RECORD *cprs, const RECORD *src, 
+	uint mode);
+
 // --------------------------------------------------------------------
 // FUNCTIONS
 // --------------------------------------------------------------------
@@ -25,44 +42,445 @@
 /*!
 	\param dst. Record to compress too
 	\param src. Record to compress
-	\param mode. Compression type
+	\param mode. Compression type (EGritCompression). Can be combined 
+		with GRIT_CPRS_DIFF or GRIT_CPRS_DIFF_AUTO, GRIT_CPRS_DIFF16 
+		and GRIT_CPRS_WRAM.
+	\param level. Compression level (EGritCprsLevel); 0 for default, 
+		1 for fastest up to 9 for smallest output. 
+		GRIT_CPRS_LEVEL_DECODE trades a little size for decoding 
+		speed. Ignored by codecs without levels.
+	\param verify. Decompress the result and compare it to \a src. 
+		If they differ, \a dst is left alone and false is returned.
+	\param pmode. If not NULL, receives the mode that was used: 
+		the type picked by GRIT_CPRS_AUTO, plus GRIT_CPRS_DIFF (and 
+		GRIT_CPRS_DIFF16) if the data was diff filtered and 
+		GRIT_CPRS_WRAM if the LZ77/LZ11 data needs a WRAM target.
+	\param timeWeight. For GRIT_CPRS_AUTO and GRIT_CPRS_DIFF_AUTO: 
+		bytes that 1000 decode cycles are worth. 0 picks the 
+		smallest output.
 	\note Aliasing \a dst and \a src is safe.
+	\note A diff filtered record is compressed whole, including its 
+		own header. Loaders decompress first, then unfilter.
 */
-bool grit_compress(RECORD *dst, const RECORD *src, uint mode)
+bool grit_compress(RECORD *dst, const RECORD *src, uint mode, uint level, 
+	bool verify, uint *pmode, uint timeWeight)
 {
 	if(dst==NULL || src==NULL)
 		return false;
 
+	// Uncompressed in place: nothing to copy. Only pad the 
+	// allocation like the copy below would.
+	if(dst == src && (mode & (GRIT_CPRS_MASK|GRIT_CPRS_DIFF|GRIT_CPRS_DIFF_AUTO)) == GRIT_CPRS_OFF)
+	{
+		uint size= rec_size(src), size4= ALIGN4(size);
+		if(size4 != size && src->data != NULL)
+		{
+			BYTE *data= (BYTE*)realloc(dst->data, size4);
+			if(data == NULL)
+				return false;
+			memset(&data[size], 0, size4-size);
+			dst->data= data;
+		}
+
+		if(pmode)
+			*pmode= GRIT_CPRS_OFF;
+		return true;
+	}
+
 	RECORD cprsRec= { 0, 0, NULL };
+	if(level != GRIT_CPRS_LEVEL_DECODE)
+		level= MIN(level, (uint)GRIT_CPRS_LEVEL_MAX);
+	u32 flags= BFN_PREP(level, CPRS_LEVEL);
+	if(mode & GRIT_CPRS_WRAM)
+		flags |= CPRS_WRAM;
+	uint used= GRIT_CPRS_OFF;
+	bool bOK;
+
+	if(mode & (GRIT_CPRS_DIFF|GRIT_CPRS_DIFF_AUTO))
+		bOK= grit_compress_diff(&cprsRec, src, mode, flags, timeWeight, &used);
+	else
+		bOK= grit_compress_codec(&cprsRec, src, mode&GRIT_CPRS_MASK, flags, 
+			timeWeight, &used);
+
+	if(!bOK)
+	{
+		lprintf(LOG_WARNING, "  Compression failed\n");
+		return false;
+	}
+
+	if(verify && !grit_compress_verify(&cprsRec, src, used))
+	{
+		lprintf(LOG_ERROR, "  Compression check failed: %02x data does not "
+			"decompress to the original.\n", cprsRec.data[0]);
+		free(cprsRec.data);
+		return false;
+	}
+
+	// Only LZ77 and LZ11 care about the target
+	uint codec= used & GRIT_CPRS_MASK;
+	if((mode & GRIT_CPRS_WRAM) && 
+		(codec == GRIT_CPRS_LZ77 || codec == GRIT_CPRS_LZ11))
+		used |= GRIT_CPRS_WRAM;
 
-	if(mode == GRIT_CPRS_OFF)
+	lprintf(LOG_STATUS, "  Decode estimate: ~%d cycles\n", 
+		grit_decode_cycles(&cprsRec, used));
+
+	if(pmode)
+		*pmode= used;
+
+	rec_alias(dst, &cprsRec);
+	return true;
+}
+
+//! Compress in segments that can be decompressed on their own.
+/*!	Splits \a src into pieces of \a segSize bytes (the last one 
+	may be shorter) and runs grit_compress() on each, in parallel.
+	\param dst	Receives the compressed segments, one after the 
+		other. Each starts word-aligned.
+	\param offsets	Receives the offset table: the byte offset of 
+		each segment in \a dst, plus the total size at the end. 
+		Little-endian u32s, so there's one more than there are 
+		segments.
+	\param pmode	Receives the mode that was used, as for 
+		grit_compress(). If the segments differ (auto modes), it's 
+		GRIT_CPRS_AUTO; each segment has its own header anyway.
+	\note	Aliasing \a dst and \a src is safe.
+*/
+bool grit_compress_segs(RECORD *dst, RECORD *offsets, const RECORD *src, 
+	uint segSize, uint mode, uint level, bool verify, uint *pmode, 
+	uint timeWeight)
+{
+	if(dst==NULL || offsets==NULL || src==NULL || segSize == 0)
+		return false;
+
+	uint ii, srcS= rec_size(src), segN= (srcS+segSize-1)/segSize;
+	if(segN == 0)
+		segN= 1;
+
+	RECORD *recs= (RECORD*)calloc(segN, sizeof(RECORD));
+	uint *modes= (uint*)calloc(segN, sizeof(uint));
+	bool *oks= (bool*)calloc(segN, sizeof(bool));
+	if(recs==NULL || modes==NULL || oks==NULL)
+	{
+		free(recs);		free(modes);	free(oks);
+		return false;
+	}
+
+	par_for(segN, [&](int ii)
 	{
-		cprsRec= *src;
-		cprsRec.data= (u8*)malloc(ALIGN4(rec_size(src)));
-		memcpy(cprsRec.data, src->data, rec_size(src));
+		uint start= ii*segSize;
+		RECORD seg= { 1, (int)MIN(segSize, srcS-start), src->data+start };
+		oks[ii]= grit_compress(&recs[ii], &seg, mode, level, verify, 
+			&modes[ii], timeWeight);
+	});
+
+	// Offsets, and the mode they all have
+	BYTE *offsD= (BYTE*)malloc((segN+1)*4);
+	uint dstS= 0, used= modes[0];
+	bool bOK= offsD != NULL;
 
-		rec_alias(dst, &cprsRec);
+	for(ii=0; ii<segN && bOK; ii++)
+	{
+		bOK= oks[ii];
+		write32le(&offsD[ii*4], dstS);
+		dstS += ALIGN4(rec_size(&recs[ii]));
+		if(modes[ii] != used)
+			used= GRIT_CPRS_AUTO | ((used|modes[ii]) & GRIT_CPRS_WRAM);
+	}
+
+	BYTE *dstD= bOK ? (BYTE*)malloc(dstS) : NULL;
+	if(dstD != NULL)
+	{
+		write32le(&offsD[segN*4], dstS);
+		for(ii=0; ii<segN; ii++)
+		{
+			uint size= rec_size(&recs[ii]), pos= read32le(&offsD[ii*4]);
+			memcpy(&dstD[pos], recs[ii].data, size);
+			memset(&dstD[pos+size], 0, ALIGN4(size)-size);
+		}
+
+		lprintf(LOG_STATUS, "  Compressed in %d segments of %d bytes.\n", 
+			segN, segSize);
+
+		RECORD rec= { 1, (int)dstS, dstD };
+		rec_alias(dst, &rec);
+		rec_attach(offsets, offsD, 4, segN+1);
+		if(pmode)
+			*pmode= used;
+	}
+	else
+		free(offsD);
+
+	for(ii=0; ii<segN; ii++)
+		free(recs[ii].data);
+	free(recs);		free(modes);	free(oks);
+
+	return dstD != NULL;
+}
+
+//! Compress with a single codec (or auto); no filters.
+bool grit_compress_codec(RECORD *dst, const RECORD *src, uint codec, 
+	u32 flags, uint timeWeight, uint *pmode)
+{
+	*pmode= codec;
+
+	if(codec == GRIT_CPRS_OFF)
+	{
+		RECORD rec= *src;
+		rec.data= (u8*)malloc(ALIGN4(rec_size(src)));
+		memcpy(rec.data, src->data, rec_size(src));
+
+		rec_alias(dst, &rec);
 		return true;						
 	}
-	else if(mode < GRIT_CPRS_MAX)
+
+	if(codec == GRIT_CPRS_AUTO)
 	{
-		const ECprsTag tags[5]= { CPRS_FAKE_TAG, 
-			CPRS_LZ77_TAG, CPRS_HUFF8_TAG, CPRS_RLE_TAG, CPRS_FAKE_TAG 
-		};
+		if(!grit_compress_auto(dst, src, flags, timeWeight))
+			return false;
 
-		//# FIXME: Wut?
-		lprintf(LOG_STATUS, "Compressing: %02x\n", mode, tags[mode]);
+		*pmode= grit_cprs_from_tag(dst->data[0]);
+		return true;
+	}
 
-		if(cprs_compress(&cprsRec, src, tags[mode]) != 0)
+	if(codec >= GRIT_CPRS_MAX)
+		return false;
+
+	const ECprsTag tags[GRIT_CPRS_MAX]= { CPRS_FAKE_TAG, 
+		CPRS_LZ77_TAG, CPRS_HUFF_TAG, CPRS_RLE_TAG, CPRS_FAKE_TAG, 
+		CPRS_FAKE_TAG, CPRS_HUFF4_TAG, CPRS_HUFF8_TAG, CPRS_LZ11_TAG
+	};
+
+	lprintf(LOG_STATUS, "Compressing: %02x\n", tags[codec]);
+
+	return cprs_compress(dst, src, tags[codec], flags);
+}
+
+//! Diff filter, then compress.
+/*!	For GRIT_CPRS_DIFF_AUTO, the filtered and unfiltered data are 
+	compressed in parallel and the smaller one is kept (or the 
+	cheaper one, see grit_cprs_cost()); the unfiltered one wins ties. Without a codec, the unfiltered data 
+	gets a header so that loaders can tell the two apart.
+	If GRIT_CPRS_DIFF16 is set but the size is odd, the 8bit 
+	filter is used.
+*/
+bool grit_compress_diff(RECORD *dst, const RECORD *src, uint mode, 
+	u32 flags, uint timeWeight, uint *pmode)
+{
+	uint codec= mode & GRIT_CPRS_MASK;
+	bool b16= (mode & GRIT_CPRS_DIFF16) && (rec_size(src) & 1) == 0;
+	uint diff= GRIT_CPRS_DIFF | (b16 ? GRIT_CPRS_DIFF16 : 0);
+
+	RECORD diffRec= { 0, 0, NULL };
+	if(!cprs_compress(&diffRec, src, b16 ? CPRS_DIFF16_TAG : CPRS_DIFF8_TAG))
+		return false;
+
+	bool bOK;
+
+	if(~mode & GRIT_CPRS_DIFF_AUTO)
+	{
+		bOK= grit_compress_codec(dst, &diffRec, codec, flags, timeWeight, 
+			pmode);
+		*pmode |= diff;
+	}
+	else
+	{
+		RECORD recs[2];
+		uint modes[2];
+		bool oks[2];
+
+		memset(recs, 0, sizeof(recs));
+
+		par_for(2, [&](int ii)
+		{
+			if(ii == 0)
+				oks[0]= grit_compress_codec(&recs[0], src, 
+					codec == GRIT_CPRS_OFF ? GRIT_CPRS_HEADER : codec, 
+					flags, timeWeight, &modes[0]);
+			else
+				oks[1]= grit_compress_codec(&recs[1], &diffRec, codec, 
+					flags, timeWeight, &modes[1]);
+		});
+		modes[1] |= diff;
+
+		const uint wram= (flags & CPRS_WRAM) ? GRIT_CPRS_WRAM : 0;
+		int best= oks[0] ? 0 : -1;
+		if(oks[1] && (best == -1 || 
+				grit_cprs_cost(&recs[1], modes[1]|wram, timeWeight) < 
+				grit_cprs_cost(&recs[0], modes[0]|wram, timeWeight)))
+			best= 1;
+
+		bOK= best != -1;
+		if(bOK)
 		{
-			rec_alias(dst, &cprsRec);
-			return true;
-		}		
+			lprintf(LOG_STATUS, "Compressing: diff filter %s\n", 
+				best == 1 ? "used" : "skipped");
+			rec_alias(dst, &recs[best]);
+			*pmode= modes[best];
+		}
+
+		free(recs[best == 0 ? 1 : 0].data);
+	}
+
+	free(diffRec.data);
+
+	return bOK;
+}
+
+//! Run all compressors and keep the smallest result.
+/*!	The candidates are compressed in parallel. The header-only 
+	version is one of them, so the result is never much bigger 
+	than the source. On equal sizes the one that is quicker to 
+	decode wins. With a \a timeWeight, the decode time counts 
+	too; see grit_cprs_cost().
+*/
+bool grit_compress_auto(RECORD *dst, const RECORD *src, u32 flags, 
+	uint timeWeight)
+{
+	// In order of decoding speed
+	const ECprsTag tags[4]= { CPRS_FAKE_TAG, 
+		CPRS_RLE_TAG, CPRS_LZ77_TAG, CPRS_HUFF_TAG
+	};
+	RECORD recs[4];
+	bool oks[4];
+	uint ii;
+	int best= -1;
+
+	memset(recs, 0, sizeof(recs));
+
+	par_for(countof(tags), [&](int ii)
+	{
+		oks[ii]= cprs_compress(&recs[ii], src, tags[ii], flags);
+	});
+
+	const uint wram= (flags & CPRS_WRAM) ? GRIT_CPRS_WRAM : 0;
+	double cost, bestCost= 0;
+
+	for(ii=0; ii<countof(tags); ii++)
+	{
+		if(!oks[ii])
+			continue;
+
+		cost= grit_cprs_cost(&recs[ii], 
+			grit_cprs_from_tag(tags[ii]) | wram, timeWeight);
+		if(best == -1 || cost < bestCost)
+		{
+			best= (int)ii;
+			bestCost= cost;
+		}
+	}
+
+	if(best != -1)
+	{
+		lprintf(LOG_STATUS, "Compressing: auto, picked %02x (%d bytes)\n", 
+			recs[best].data[0], rec_size(&recs[best]));
+		rec_alias(dst, &recs[best]);
+	}
+
+	for(ii=0; ii<countof(tags); ii++)
+		if((int)ii != best)
+			free(recs[ii].data);
+
+	return best != -1;
+}
+
+//! Check that compressed data decompresses to the source.
+/*!	\param mode	Mode that was used, as given by grit_compress().
+*/
+bool grit_compress_verify(const RECORD *cprs, const RECORD *src, uint mode)
+{
+	RECORD recs[2];
+	const RECORD *rec= cprs;
+	int nn= 0;
+	bool bOK= true;
+
+	memset(recs, 0, sizeof(recs));
+
+	// Undo the codec, then the filter
+	if((mode & GRIT_CPRS_MASK) != GRIT_CPRS_OFF)
+	{
+		bOK= cprs_decompress(&recs[nn], rec);
+		rec= &recs[nn++];
+	}
+
+	if(bOK && (mode & GRIT_CPRS_DIFF))
+	{
+		bOK= cprs_decompress(&recs[nn], rec);
+		rec= &recs[nn++];
 	}
 
-	lprintf(LOG_WARNING, "  Compression failed\n");
+	bOK= bOK && rec_size(rec) == rec_size(src) &&
+		memcmp(rec->data, src->data, rec_size(src)) == 0;
+
+	free(recs[0].data);
+	free(recs[1].data);
+
+	return bOK;
+}
+
+//! Estimate the cycles to unpack data from grit_compress().
+/*!	\param rec	Compressed data.
+	\param used	Mode that was used, as given by grit_compress().
+	\note The numbers are for the GBA BIOS routines; see cprs_cost.cpp.
+*/
+uint grit_decode_cycles(const RECORD *rec, uint used)
+{
+	if(rec == NULL || rec->data == NULL)
+		return 0;
+
+	uint codec= used & GRIT_CPRS_MASK;
+	u32 flags= (used & GRIT_CPRS_WRAM) ? CPRS_WRAM : 0;
+
+	// Raw data has no header.
+	if(codec == GRIT_CPRS_OFF && (~used & GRIT_CPRS_DIFF))
+		return cprs_copy_cycles(rec_size(rec));
+
+	uint cycles= cprs_decode_cycles(rec, flags);
+
+	// Compressed diff data: unfilter after unpacking.
+	if(codec != GRIT_CPRS_OFF && (used & GRIT_CPRS_DIFF))
+	{
+		uint size= read32le(rec->data)>>8;
+		cycles += cprs_unfilter_cycles(size >= 4 ? size-4 : 0, 
+			(used & GRIT_CPRS_DIFF16) ? CPRS_DIFF16_TAG : CPRS_DIFF8_TAG, 
+			flags);
+	}
+
+	return cycles;
+}
+
+//! Cost of compressed data for the auto modes.
+/*!	The size, plus \a timeWeight bytes for every 1000 decode cycles.
+*/
+double grit_cprs_cost(const RECORD *rec, uint used, uint timeWeight)
+{
+	double cost= rec_size(rec);
+	if(timeWeight != 0)
+		cost += timeWeight * grit_decode_cycles(rec, used) / 1000.0;
+
+	return cost;
+}
+
+//! Get the compression mode (EGritCompression) from a header tag.
+/*!	\param tag	First byte of compressed data (ECprsTag).
+	\return	GRIT_CPRS_foo mode. Untagged or unknown data gives 
+		GRIT_CPRS_OFF.
+*/
+uint grit_cprs_from_tag(uint tag)
+{
+	if(tag == CPRS_LZ11_TAG)
+		return GRIT_CPRS_LZ11;
+
+	switch(tag & 0xF0)
+	{
+	case CPRS_FAKE_TAG:		return GRIT_CPRS_HEADER;
+	case CPRS_LZ77_TAG:		return GRIT_CPRS_LZ77;
+	case CPRS_HUFF_TAG:
+		return (tag&0x0F) == 4 ? GRIT_CPRS_HUFF4 : GRIT_CPRS_HUFF8;
+	case CPRS_RLE_TAG:		return GRIT_CPRS_RLE;
+	}
 
-	return false;
+	return GRIT_CPRS_OFF;
 }
 
 // EOF
@@ -4,6 +4,8 @@
 //! \date 20050814 - 20100131
 //! \author cearn
 /* === NOTES === 
+  * 20261017: grit_prep_gfx can compress in segments (gfxSegSize).
+  * 20261017: grit_prep_map can reorder the tileset (GRIT_RDX_ORDER).
   * 20100131,jv: Replaced mapping core. grit_prep_tiles and older reducing 
 	functions still need cleaning.
   * 20080215,jv: made tile-size variable. Only works for -gb though.
@@ -70,7 +72,10 @@ bool grit_prep(GritRec *gr)
 	if(gr->isTiled())
 	{
 		if(gr->isMapped())		// Convert to tilemap/tileset
-			grit_prep_map(gr);
+		{
+			if(!grit_prep_map(gr))
+				return false;
+		}
 		else					// Just (meta)tile the image.
 			//# TODO: just (meta)tile; no map.
 			grit_prep_tiles(gr);
@@ -460,13 +465,16 @@ bool grit_prep_map(GritRec *gr)
 		flags |= TMAP_FLIP;
 	if(gr->mapRedux & GRIT_RDX_PBANK)
 		flags |= TMAP_PBANK;
+	if((gr->mapRedux & GRIT_RDX_ORDER) && (flags & TMAP_TILE))
+		flags |= TMAP_ORDER;
 	if(gr->bColMajor)
 		flags |= TMAP_COLMAJOR;
 
-	lprintf(LOG_STATUS, "  Performing tile reduction: %s%s%s\n", 
+	lprintf(LOG_STATUS, "  Performing tile reduction: %s%s%s%s\n", 
 		(flags & TMAP_TILE  ? "unique tiles; " : ""), 
 		(flags & TMAP_FLIP  ? "flip; " : ""), 
-		(flags & TMAP_PBANK ? "palswap; " : "")); 
+		(flags & TMAP_PBANK ? "palswap; " : ""), 
+		(flags & TMAP_ORDER ? "reorder; " : "")); 
 
 	map= tmap_alloc();
 	if(extW == tileW)
@@ -491,7 +499,14 @@ bool grit_prep_map(GritRec *gr)
 	if( BYTE_ORDER == BIG_ENDIAN && mf.bitDepth > 8 )
 		data_byte_rev(mapRec.data, mapRec.data, rec_size(&mapRec), mf.bitDepth/8);		
 
-	grit_compress(&mapRec, &mapRec, gr->mapCompression);
+	uint cprsMode= gr->mapCompression;
+	if(mf.bitDepth == 16)
+		cprsMode |= GRIT_CPRS_DIFF16;
+
+	uint cprsUsed= GRIT_CPRS_OFF;
+	bool bCprsOK= grit_compress(&mapRec, &mapRec, cprsMode, 
+		gr->mapCprsLevel, gr->bCprsVerify, &cprsUsed, gr->cprsTimeWeight);
+	gr->_mapCprs= cprsUsed;
 
 	// --- Cleanup ---
 
@@ -517,13 +532,18 @@ bool grit_prep_map(GritRec *gr)
 	tmap_free(map);
 	tmap_free(metaMap);
 
+	if(!bCprsOK)
+		return false;
+
 	lprintf(LOG_STATUS, "Map preparation complete.\n");		
 	return true;
 }
 
 //! Image data preparation.
 /*!	Prepares the work dib for export, i.e. converts to the final 
-	bitdepth, compresses the data and fills in \a gr._gfxRec.
+	bitdepth, compresses the data and fills in \a gr._gfxRec. 
+	With \a gr.gfxSegSize, the data is compressed in segments and 
+	\a gr._gfxSegRec gets their offsets.
 */
 bool grit_prep_gfx(GritRec *gr)
 {
@@ -625,7 +645,35 @@ bool grit_prep_gfx(GritRec *gr)
 		data_byte_rev(rec.data, rec.data, rec_size(&rec), gr->gfxBpp/8);		
 
 	// attach and compress graphics
-	grit_compress(&rec, &rec, gr->gfxCompression);
+	uint cprsMode= gr->gfxCompression, cprsUsed= GRIT_CPRS_OFF;
+	if(gr->gfxBpp == 16)
+		cprsMode |= GRIT_CPRS_DIFF16;
+
+	bool bCprsOK;
+	if(gr->gfxSegSize != 0)
+	{
+		// Segments of whole (meta)tiles or pixel rows
+		uint unitS= gr->isTiled() ? 
+			gr->mtileWidth()*gr->mtileHeight()*dstB_align/8 : 
+			dib_get_width(gr->_dib)*dstB_align/8;
+
+		bCprsOK= grit_compress_segs(&rec, &gr->_gfxSegRec, &rec, 
+			gr->gfxSegSize*unitS, cprsMode, gr->gfxCprsLevel, 
+			gr->bCprsVerify, &cprsUsed, gr->cprsTimeWeight);
+	}
+	else
+	{
+		rec_attach(&gr->_gfxSegRec, NULL, 0, 0);
+		bCprsOK= grit_compress(&rec, &rec, cprsMode, gr->gfxCprsLevel, 
+			gr->bCprsVerify, &cprsUsed, gr->cprsTimeWeight);
+	}
+
+	if(!bCprsOK)
+	{
+		free(rec.data);
+		return false;
+	}
+	gr->_gfxCprs= cprsUsed;
 	rec_alias(&gr->_gfxRec, &rec);
 
 	lprintf(LOG_STATUS, "Graphics preparation complete.\n");		
@@ -661,7 +709,14 @@ bool grit_prep_pal(GritRec *gr)
 		data_byte_rev(rec.data, rec.data, rec_size(&rec), 2);		
 
 	// Attach and compress palette
-	grit_compress(&rec, &rec, gr->palCompression);
+	uint cprsUsed= GRIT_CPRS_OFF;
+	if(!grit_compress(&rec, &rec, gr->palCompression | GRIT_CPRS_DIFF16, 
+		gr->palCprsLevel, gr->bCprsVerify, &cprsUsed, gr->cprsTimeWeight))
+	{
+		free(rec.data);
+		return false;
+	}
+	gr->_palCprs= cprsUsed;
 	rec_alias(&gr->_palRec, &rec);
 
 	lprintf(LOG_STATUS, "Palette preparation complete.\n");		
@@ -702,7 +757,14 @@ bool grit_prep_shared_pal(GritRec *gr)
 		data_byte_rev(rec.data, rec.data, rec_size(&rec), 2);
 
 	// Attach and compress palette
-	grit_compress(&rec, &rec, gr->palCompression);
+	uint cprsUsed= GRIT_CPRS_OFF;
+	if(!grit_compress(&rec, &rec, gr->palCompression | GRIT_CPRS_DIFF16, 
+		gr->palCprsLevel, gr->bCprsVerify, &cprsUsed, gr->cprsTimeWeight))
+	{
+		free(rec.data);
+		return false;
+	}
+	gr->_palCprs= cprsUsed;
 	rec_alias(&gr->_palRec, &rec);
 
 	lprintf(LOG_STATUS, "Palette preparation complete.\n");
@@ -6,6 +6,17 @@
 //
 /* === NOTES ===
 
+  * 20261017: Preface gives a decode estimate for each item.
+  * 20261017: Segmented gfx (-gzS) adds an offset table item: 
+    fooTilesSegs in C/asm, GSEG in GRF, .seg.bin and fooSegs in 
+    GBFS. It has one u32 per segment with the byte offset of that 
+    segment in the gfx data, then the total size.
+  * 20261017: GRF is written chunk by chunk straight from the item 
+    records through a CprsSink, instead of copying everything into 
+    chunks and then into a merged chunk.
+  * 20261017: GRF header has cprsAttrs; preface names the codec 
+    chosen by auto compression and any diff filter. Headers get 
+    fooLzWram for LZ77 and LZ11 items, to pick the BIOS routine.
   * 20100321,dm: static const is not a constant expression in c
     switch back to define.
   * 20091231,jv: use "static const" for size instead of "#define".
@@ -117,13 +128,6 @@ int grit_gbfs_entry_init(GBFS_ENTRY *gben, const RECORD *rec,
 
 // --- GRF components ---
 
-struct chunk_t
-{
-	char	id[4];
-	ule32	size;
-	u8		data[1];
-};
-
 struct GrfHeader
 {
 	union {
@@ -135,15 +139,18 @@ struct GrfHeader
 	u8		tileWidth, tileHeight;
 	u8		metaWidth, metaHeight;
 	ule32	gfxWidth, gfxHeight;
+	union {
+		u8 cprsAttrs[4];	//!< Compression used (EGritCompression, incl. GRIT_CPRS_DIFF).
+		struct {
+			u8	gfxCprs, mapCprs, mmapCprs, palCprs;
+		};
+	};
 };
 
-chunk_t *chunk_create(const char *id, const RECORD *rec);
-chunk_t *chunk_create(const char *id, const void *data, uint size);
-void chunk_free(chunk_t *chunk);
-chunk_t *chunk_merge(const char *id, chunk_t *cklist[], uint count, 
-	const char *groupID);
+bool chunk_write(CprsSink *sink, const char *id, const void *data, uint size);
 
-chunk_t *grit_prep_grf(GritRec *gr);
+uint grit_grf_write(GritRec *gr, CprsSink *sink);
+bool grit_prep_grf(GritRec *gr, RECORD *rec);
 
 
 // --------------------------------------------------------------------
@@ -169,6 +176,8 @@ void grit_xp_decl(FILE *fp, const DataItem *item);
 void grit_xp_decl(FILE *fp, int chunk, const char *name, int affix, int len);
 bool grit_xp_h(GritRec *gr);
 bool grit_preface(GritRec *gr, FILE *fp, const char *cmt);
+static uint grit_preface_cprs(FILE *fp, uint mode, uint used, 
+	const RECORD *rec, const RECORD *segs=NULL);
 
 uint grit_xp_total_size(GritRec *gr);
 
@@ -270,6 +279,9 @@ uint grit_xp_size(GritRec *gr)
 	if(gr->palProcMode == GRIT_EXPORT)
 		size += ALIGN4(rec_size(&gr->_palRec)) + extra;
 
+	if(gr->gfxProcMode == GRIT_EXPORT && gr->_gfxSegRec.data)
+		size += ALIGN4(rec_size(&gr->_gfxSegRec)) + extra;
+
 	return size;
 }
 
@@ -286,7 +298,7 @@ bool grit_prep_item(GritRec *gr, eint id, DataItem *item)
 	case GRIT_ITEM_GFX:		// Graphics item
 		item->procMode= gr->gfxProcMode;
 		item->dataType= gr->gfxDataType;
-		item->compression= gr->gfxCompression;
+		item->compression= gr->_gfxCprs;
 		item->pRec= &gr->_gfxRec;
 
 		strcat(strcpy(str, gr->symName), 
@@ -297,7 +309,7 @@ bool grit_prep_item(GritRec *gr, eint id, DataItem *item)
 	case GRIT_ITEM_MAP:		// Map/metatile item
 		item->procMode= gr->mapProcMode;
 		item->dataType= gr->mapDataType;
-		item->compression= gr->mapCompression;
+		item->compression= gr->_mapCprs;
 		item->pRec= &gr->_mapRec;	
 
 		strcat(strcpy(str, gr->symName), 
@@ -308,17 +320,29 @@ bool grit_prep_item(GritRec *gr, eint id, DataItem *item)
 	case GRIT_ITEM_METAMAP:		// Metamap item
 		item->procMode= gr->isMetaTiled() ? gr->mapProcMode : GRIT_EXCLUDE;
 		item->dataType= gr->mapDataType;
-		item->compression= gr->mapCompression;
+		item->compression= GRIT_CPRS_OFF;
 		item->pRec= &gr->_metaRec;	
 
 		strcat(strcpy(str, gr->symName), c_identAffix[E_AFX_MMAP]);
 		strrepl(&item->name, str);
 		return true;
 
+	case GRIT_ITEM_GFXSEGS:		// Offsets of gfx segments
+		item->procMode= gr->_gfxSegRec.data ? gr->gfxProcMode : GRIT_EXCLUDE;
+		item->dataType= GRIT_U32;
+		item->compression= GRIT_CPRS_OFF;
+		item->pRec= &gr->_gfxSegRec;
+
+		strcat(strcpy(str, gr->symName), 
+			c_identAffix[gr->isTiled() ? E_AFX_TILE : E_AFX_BMP]);
+		strcat(str, c_identAffix[E_AFX_SEGS]);
+		strrepl(&item->name, str);
+		return true;
+
 	case GRIT_ITEM_PAL:
 		item->procMode= gr->palProcMode;
 		item->dataType= gr->palDataType;
-		item->compression= gr->palCompression;
+		item->compression= gr->_palCprs;
 		item->pRec= &gr->_palRec;	
 
 		strcat(strcpy(str, gr->symName), c_identAffix[E_AFX_PAL]);
@@ -380,13 +404,14 @@ bool grit_xp_c(GritRec *gr)
 
 	if(gr->bRiff)	// Single GRF item
 	{
-		chunk_t *chunk= grit_prep_grf(gr);
+		RECORD rec= { 0, 0, NULL };
+		grit_prep_grf(gr, &rec);
 		strcat(strcpy(str, gr->symName), "Grf");
 
-		xp_array_c(fout, str, chunk, chunk->size+8, 
+		xp_array_c(fout, str, rec.data, rec_size(&rec), 
 			grit_type_size(gr->gfxDataType));
 
-		chunk_free(chunk);
+		free(rec.data);
 	}
 	else			// Separate items
 	{
@@ -490,13 +515,14 @@ bool grit_xp_gas(GritRec *gr)
 
 	if(gr->bRiff)	// Single GRF item
 	{
-		chunk_t *chunk= grit_prep_grf(gr);
+		RECORD rec= { 0, 0, NULL };
+		grit_prep_grf(gr, &rec);
 		strcat(strcpy(str, gr->symName), "Grf");
 
-		xp_array_gas(fout, str, chunk, chunk->size+8, 
+		xp_array_gas(fout, str, rec.data, rec_size(&rec), 
 			grit_type_size(gr->gfxDataType));
 
-		chunk_free(chunk);
+		free(rec.data);
 	}
 	else			// Separate items
 	{
@@ -562,7 +588,8 @@ bool grit_xp_bin(GritRec *gr)
 
 	char fpath[MAXPATHLEN], str[MAXPATHLEN];
 	const char *fmode= gr->bAppend ? "a+b" : "wb";
-	const char *exts[4]= {"img.bin", "map.bin", "meta.bin", "pal.bin" };
+	const char *exts[GRIT_ITEM_MAX]= {"img.bin", "map.bin", "meta.bin", 
+		"pal.bin", "seg.bin" };
 
 	path_repl_ext(str, gr->dstPath, NULL, MAXPATHLEN);
 	
@@ -600,8 +627,8 @@ bool grit_xp_gbfs(GritRec *gr)
 
 	// for new data
 	int gr_count;
-	BYTE *gr_data[4];
-	GBFS_ENTRY gr_gben[4];
+	BYTE *gr_data[GRIT_ITEM_MAX];
+	GBFS_ENTRY gr_gben[GRIT_ITEM_MAX];
 
 	// for total data
 	int gb_count;
@@ -643,6 +670,14 @@ bool grit_xp_gbfs(GritRec *gr)
 		gr_data[ii++]= gr->_palRec.data;
 	}
 
+	// Gfx segment offsets
+	if(gr->gfxProcMode == GRIT_EXPORT && gr->_gfxSegRec.data)
+	{
+		grit_gbfs_entry_init(&gr_gben[ii], &gr->_gfxSegRec, 
+			gr->symName, E_AFX_SEGS);
+		gr_data[ii++]= gr->_gfxSegRec.data;
+	}
+
 	gb_count= gr_count= ii;
 
 	// --- create header and finish entries ---
@@ -832,113 +867,40 @@ int grit_gbfs_entry_init(GBFS_ENTRY *gben, const RECORD *rec,
 // --------------------------------------------------------------------
 
 
-//! Create a RIFF chunk.
-chunk_t *chunk_create(const char *id, const RECORD *rec)
-{
-	return chunk_create(id, rec->data, rec_size(rec));
-}
-
-//! Create a RIFF chunk
+//! Write a RIFF chunk: id, size and the data, padded to 4 bytes.
 /*!
 	\note PONDER: Is ckSize always 4-aligned or just the chunk?
 */
-chunk_t *chunk_create(const char *id, const void *data, uint size)
+bool chunk_write(CprsSink *sink, const char *id, const void *data, uint size)
 {
-	uint ii;
+	uint size4= ALIGN4(size);
+	BYTE header[8];
 
-	size= ALIGN4(size);
-	chunk_t *chunk= (chunk_t*)malloc(size+8);
+	memcpy(header, id, 4);
+	write32le(&header[4], size4);
 
-	for(ii=0; ii<4; ii++)
-		chunk->id[ii]= id[ii];
-
-	chunk->size= size;	
-	memcpy(&chunk->data, data, size);
-
-	return chunk;
+	return cprs_sink_write(sink, header, 8) && 
+		cprs_sink_write(sink, data, size) && 
+		cprs_sink_fill(sink, 0, size4-size);
 }
 
-
-//! Merge multiple chunks into a single large one.
-/*!	\param id		Parent name.
-	\param cklist	Array of child-chunks to merge.
-	\param count	Length of \a cklist.
-	\param groupID	Group identifier for parent ("RIFF", "LIST", etc.).
-		Can be NULL.
-	\return	Merged chunks with under the name of \a id.
+//! Write the GRF RIFF straight from the item records.
+/*!	\return	Number of bytes written; 0 on failure.
 */
-chunk_t *chunk_merge(const char *id, chunk_t *cklist[], uint count, const char *groupID)
-{
-	uint ii;
-	uint size= 0;
-
-	for(ii=0; ii<count; ii++)
-		if(cklist[ii] != NULL)
-			size += align(cklist[ii]->size,4)+8;
-
-	chunk_t *chunk;
-	u8 *dst;
-
-	// Split creation into with or without group id.
-	if(groupID)
-	{
-		// Make room for groupsID+total_size+id+data
-		chunk= (chunk_t*)malloc(size+8+4);
-		chunk_t *sub= (chunk_t*)chunk->data;
-
-		for(ii=0; ii<4; ii++)
-		{
-			chunk->id[ii]= groupID[ii];
-			chunk->data[ii]= id[ii];
-		}
-
-		chunk->size= size+4;
-		dst= chunk->data+4;
-	}
-	else
-	{
-		chunk= (chunk_t*)malloc(size+8);	
-		for(ii=0; ii<4; ii++)
-			chunk->id[ii]= id[ii];
-		chunk->size= size;
-		dst= chunk->data;
-	}
-
-
-	for(ii=0; ii<count; ii++)
-	{
-		if(cklist[ii] != NULL)
-		{
-			size= cklist[ii]->size+8;
-			memcpy(dst, cklist[ii], size);
-			dst += size;
-		}
-	}
-
-	return chunk;
-	
-}
-
-//! Free a RIFF chunk
-void chunk_free(chunk_t *chunk)
-{
-	free(chunk);
-}
-
-chunk_t *grit_prep_grf(GritRec *gr)
+uint grit_grf_write(GritRec *gr, CprsSink *sink)
 {
 	GrfHeader hdr;
-	chunk_t *cklist[5]=  { NULL };
+	const RECORD *recs[GRIT_ITEM_MAX]= { NULL };
 
 	// Semi-constant data.
 
-	const char *ckIDs[4]= 
+	const char *ckIDs[GRIT_ITEM_MAX]= 
 	{
 		"GFX ",
 		(gr->isMetaTiled() ? "MTIL" : "MAP "),
-		"MMAP",	"PAL "
+		"MMAP",	"PAL ", "GSEG"
 	};
-	uint bpps[4]= { gr->gfxBpp, 16, 16, 16 };
+	uint bpps[GRIT_ITEM_MAX]= { gr->gfxBpp, 16, 16, 16, 32 };
 	if(gr->mapLayout == GRIT_MAP_AFFINE)
 		bpps[GRIT_ITEM_MAP]= 8;
 
@@ -957,25 +919,49 @@ chunk_t *grit_prep_grf(GritRec *gr)
 		hdr.metaHeight= gr->metaHeight;
 	}
 
+	// RIFF size comes first, so total the chunks before writing
+	uint size= 4 + 8+sizeof(GrfHeader);
+
 	DataItem item;
 	for(eint id=GRIT_ITEM_GFX; id<GRIT_ITEM_MAX; id++)
 	{
 		grit_prep_item(gr, id, &item);
 		if(item.procMode == GRIT_EXPORT)
 		{
-			hdr.attrs[id]= bpps[id];
-			cklist[id+1]= chunk_create(ckIDs[id], item.pRec);
+			// The header only has room for the first four
+			if(id < countof(hdr.attrs))
+			{
+				hdr.attrs[id]= bpps[id];
+				hdr.cprsAttrs[id]= item.compression;
+			}
+			recs[id]= item.pRec;
+			size += 8+ALIGN4(rec_size(item.pRec));
 		}
 	}
 
-	// Create header chunk and merge
-	cklist[0]= chunk_create("HDR ", &hdr, sizeof(GrfHeader));
-	chunk_t *chunk= chunk_merge("GRF ", cklist, 5, "RIFF");
+	BYTE riff[12];
+	memcpy(&riff[0], "RIFF", 4);
+	write32le(&riff[4], size);
+	memcpy(&riff[8], "GRF ", 4);
+
+	bool bOK= cprs_sink_write(sink, riff, 12) && 
+		chunk_write(sink, "HDR ", &hdr, sizeof(GrfHeader));
 
-	for(int ii=0; ii<5; ii++)
-		chunk_free(cklist[ii]);	
+	for(eint id=GRIT_ITEM_GFX; id<GRIT_ITEM_MAX && bOK; id++)
+		if(recs[id] != NULL)
+			bOK= chunk_write(sink, ckIDs[id], recs[id]->data, rec_size(recs[id]));
 
-	return chunk;
+	return bOK ? size+8 : 0;
+}
+
+//! Build the GRF RIFF in memory, for the C and asm exporters.
+bool grit_prep_grf(GritRec *gr, RECORD *rec)
+{
+	CprsSink sink;
+	cprs_sink_buffer(&sink);
+	grit_grf_write(gr, &sink);
+
+	return cprs_sink_detach(&sink, rec) != 0;
 }
 
 //! Export to GRF : Grit RIFF
@@ -990,14 +976,21 @@ bool grit_xp_grf(GritRec *gr)
 		lprintf(LOG_WARNING, "  No append mode for GRF yet.\n");
 
 	FILE *fout= fopen(gr->dstPath, "wb");
+	if(fout == NULL)
+		return false;
 
-	chunk_t *chunk= grit_prep_grf(gr);
-	fwrite(chunk, 1, chunk->size+8, fout);
-	chunk_free(chunk);
+	// Straight from the records to the file
+	CprsSink sink;
+	cprs_sink_file(&sink, fout);
+	grit_grf_write(gr, &sink);
+	bool bOK= cprs_sink_close(&sink);
 
 	fclose(fout);
 
-	return true;
+	if(!bOK)
+		lprintf(LOG_ERROR, "  Can't write GRF to %s.\n", gr->dstPath);
+
+	return bOK;
 }
 
 
@@ -1059,6 +1052,14 @@ void grit_xp_decl(FILE *fp, DataItem *item)
 	uint count= ALIGN4(size)/dtype;
 
 	fprintf(fp, "#define %sLen %d\n", item->name, size);
+
+	// LZ77 data must go through the matching BIOS routine: 
+	// LZ77UnCompVram for 0, LZ77UnCompWram for 1. Same for LZ11.
+	uint codec= item->compression & GRIT_CPRS_MASK;
+	if(codec == GRIT_CPRS_LZ77 || codec == GRIT_CPRS_LZ11)
+		fprintf(fp, "#define %sLzWram %d\n", item->name, 
+			(item->compression & GRIT_CPRS_WRAM) ? 1 : 0);
+
 	fprintf(fp, "%s %s %s[%d];\n\n", cTypeSpec, cCTypes[dtype], 
 		item->name, count);
 }
@@ -1174,6 +1175,56 @@ bool grit_xp_h(GritRec *gr)
 	return true;
 }
 
+//! Print the compression of an item for the preface.
+/*!	\param mode	Requested compression.
+	\param used	Compression that was used (auto resolved).
+	\param rec	The item's data, for the decode estimate.
+	\param segs	Segment offsets if \a rec is segmented; NULL if not.
+	\return	Estimated decode cycles.
+*/
+uint grit_preface_cprs(FILE *fp, uint mode, uint used, const RECORD *rec, 
+	const RECORD *segs)
+{
+	const char *diff= (used & GRIT_CPRS_DIFF16) ? "diff16" : "diff8";
+	const char *wram= (used & GRIT_CPRS_WRAM) ? "/wram" : "";
+	bool bAuto= (mode & GRIT_CPRS_MASK) == GRIT_CPRS_AUTO || 
+		(mode & GRIT_CPRS_DIFF_AUTO);
+
+	if((used & GRIT_CPRS_DIFF) && (used & GRIT_CPRS_MASK) == GRIT_CPRS_OFF)
+		fprintf(fp, "%s filtered", diff);
+	else if(used & GRIT_CPRS_DIFF)
+		fprintf(fp, "%s+%s%s%s compressed", diff, 
+			c_cprsNames[used & GRIT_CPRS_MASK], wram, bAuto ? " (auto)" : "");
+	else
+		fprintf(fp, "%s%s%s compressed", 
+			c_cprsNames[used & GRIT_CPRS_MASK], wram, bAuto ? " (auto)" : "");
+
+	if(segs == NULL || segs->data == NULL)
+	{
+		uint cycles= grit_decode_cycles(rec, used);
+		fprintf(fp, " (~%d cycles)", cycles);
+
+		return cycles;
+	}
+
+	// Segments are decoded one at a time; the largest one counts too
+	uint ii, segN= rec_size(segs)/4-1, cycles= 0, segMax= 0;
+	for(ii=0; ii<segN; ii++)
+	{
+		uint start= read32le(&segs->data[ii*4]);
+		RECORD seg= { 1, (int)(read32le(&segs->data[ii*4+4])-start), 
+			&rec->data[start] };
+		uint segCycles= grit_decode_cycles(&seg, used);
+
+		cycles += segCycles;
+		segMax= MAX(segMax, segCycles);
+	}
+	fprintf(fp, " in %d segments (~%d cycles, ~%d for the largest)", 
+		segN, cycles, segMax);
+
+	return cycles;
+}
+
 //! Creates data preface, containing a data description
 /*!
 	The preface describres a little bit about the preferred 
@@ -1187,6 +1238,7 @@ bool grit_xp_h(GritRec *gr)
 bool grit_preface(GritRec *gr, FILE *fp, const char *cmt)
 {
 	int tmp, size=0;
+	uint cycles= 0;
 	int aw, ah, mw, mh;
 	char hline[80], str2[16]="", str[96]="";
 
@@ -1238,7 +1290,9 @@ bool grit_preface(GritRec *gr, FILE *fp, const char *cmt)
 	{
 		tmp= rec_size(&gr->_palRec);
 		fprintf(fp, "%s\t+ palette %d entries, ", cmt, tmp/2);
-		fprintf(fp, "%s compressed\n", c_cprsNames[gr->palCompression]);
+		cycles += grit_preface_cprs(fp, gr->palCompression, gr->_palCprs, 
+			&gr->_palRec);
+		fputs("\n", fp);
 		
 		sprintf(str2, "%d + ", tmp);
 		strcat(str, str2);
@@ -1263,6 +1317,8 @@ bool grit_preface(GritRec *gr, FILE *fp, const char *cmt)
 					fputs("|f", fp);
 				if(gr->mapRedux & GRIT_RDX_PBANK)
 					fputs("|p", fp);
+				if(gr->mapRedux & GRIT_RDX_ORDER)
+					fputs("|o", fp);
 				fputs(" reduced) ", fp);
 			}
 
@@ -1277,7 +1333,9 @@ bool grit_preface(GritRec *gr, FILE *fp, const char *cmt)
 			break;
 		}
 
-		fprintf(fp, "%s compressed\n", c_cprsNames[gr->gfxCompression]);
+		cycles += grit_preface_cprs(fp, gr->gfxCompression, gr->_gfxCprs, 
+			&gr->_gfxRec, &gr->_gfxSegRec);
+		fputs("\n", fp);
 
 		tmp= rec_size(&gr->_gfxRec);
 		sprintf(str2, "%d + ", tmp);
@@ -1299,7 +1357,9 @@ bool grit_preface(GritRec *gr, FILE *fp, const char *cmt)
 			fputs("affine map, ", fp);				break;
 		}
 
-		fprintf(fp, "%s compressed, ", c_cprsNames[gr->mapCompression]);
+		cycles += grit_preface_cprs(fp, gr->mapCompression, gr->_mapCprs, 
+			&gr->_mapRec);
+		fputs(", ", fp);
 		
 		tmp= rec_size(&gr->_mapRec);
 		sprintf(str2, "%d + ", tmp);
@@ -1325,6 +1385,7 @@ bool grit_preface(GritRec *gr, FILE *fp, const char *cmt)
 	{
 		str[tmp-2]= '=';
 		fprintf(fp, "%s\tTotal size: %s%d\n", cmt, str, size);
+		fprintf(fp, "%s\tDecode estimate: ~%d cycles\n", cmt, cycles);
 	}
 
 	time( &aclock );
@@ -0,0 +1,519 @@
+//
+//! \file cprs_bench.cpp
+//!   Compression benchmark.
+//! \date 20261017 - 20261017
+//
+/* === NOTES ===
+  * Not built by default: `make cprs_bench'.
+  * Runs every codec over a corpus of gfx, map and palette records
+	and reports size, ratio, compression and decompression speed
+	and whether the data survives cprs_decompress(), plus the
+	estimated decode cycles on the GBA (cprs_decode_cycles()). -o writes
+	the same as JSON, one result per line, so runs can be diffed.
+  * The corpus is synthetic, so that it's the same everywhere. Real
+	records can be added as files, e.g. grit's -ftb output.
+  * -p also times LZ77 on the gfx inputs at every level, single-
+	threaded and with all threads, and checks that both give the
+	same output.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <cldib.h>
+#include <grit.h>
+#include "cprs.h"
+
+
+// --------------------------------------------------------------------
+// CONSTANTS
+// --------------------------------------------------------------------
+
+
+const char appHelpText[]=
+"cprs_bench: grit compression benchmark.\n"
+"usage: cprs_bench [args] [files]\n\n"
+"files          Extra records to compress, e.g. from grit -ftb\n"
+"-j{n}          Threads [cores]\n"
+"-s{n}          Size of the gfx inputs in KB [256]\n"
+"-r{n}          Repetitions; the fastest one counts [3]\n"
+"-o {file}      Write a JSON summary to file\n"
+"-p             Also time LZ77 with 1 vs n threads\n";
+
+//! Shortest time to measure in one go (seconds). Small records
+//!   are compressed repeatedly until it's reached.
+#define BENCH_TIME_MIN	0.02
+
+
+// --------------------------------------------------------------------
+// CLASSES
+// --------------------------------------------------------------------
+
+
+//! Benchmark input.
+struct BenchInput
+{
+	std::string	name;
+	const char	*kind;		//!< "gfx", "map", "pal" or "file".
+	std::vector<u8>	data;
+};
+
+//! Codec to benchmark.
+struct BenchCodec
+{
+	const char	*name;
+	ECprsTag	tag;
+	u32			flags;
+};
+
+//! Result for one input and codec.
+struct BenchResult
+{
+	const BenchInput	*input;
+	const BenchCodec	*codec;
+	uint	size;			//!< Compressed size; 0 if compression failed.
+	double	tCprs, tDecprs;	//!< Seconds per run.
+	uint	cycles;			//!< Estimated GBA decode cycles.
+	bool	bRoundTrip;		//!< Decompresses to the input.
+};
+
+
+// --------------------------------------------------------------------
+// FUNCTIONS
+// --------------------------------------------------------------------
+
+
+//! Simple LCG, so that inputs are the same on every run.
+static u32 bench_rand(u32 *seed)
+{
+	*seed= *seed*1103515245 + 12345;
+	return (*seed>>16) & 0x7FFF;
+}
+
+//! Add a synthetic input.
+static BenchInput &bench_add(std::vector<BenchInput> &inputs,
+	const char *name, const char *kind, uint size)
+{
+	inputs.push_back(BenchInput());
+
+	BenchInput &in= inputs.back();
+	in.name= name;
+	in.kind= kind;
+	in.data.resize(size);
+
+	return in;
+}
+
+//! Fill \a inputs with synthetic data; \a size bytes for gfx.
+/*!	- tiles: 8bpp tiles picked from a small set, with the odd pixel changed.
+	- bitmap: 16bpp gradients with noise.
+	- gradient: smooth 8bpp ramps.
+	- noise: random bytes; the worst case for every codec.
+	- map: 64x64 screen entries; runs of tiles, a blank background
+	  and flipped tiles.
+	- pal: 256 colors in 16-color ramps.
+*/
+static void bench_make_inputs(std::vector<BenchInput> &inputs, uint size)
+{
+	uint ii, jj;
+	u32 seed= 12345;
+
+	// Tileset-like
+	std::vector<u8> pool(64*64);
+	for(ii=0; ii<pool.size(); ii++)
+		pool[ii]= bench_rand(&seed)%5 ? bench_rand(&seed)&3 : bench_rand(&seed)&15;
+
+	BenchInput *in= &bench_add(inputs, "tiles", "gfx", size);
+	for(ii=0; ii<size; ii += 64)
+	{
+		const u8 *tile= &pool[bench_rand(&seed)%64*64];
+		for(jj=0; jj<64 && ii+jj<size; jj++)
+			in->data[ii+jj]= tile[jj] ^ (bench_rand(&seed)%64 == 0);
+	}
+
+	// Bitmap-like
+	in= &bench_add(inputs, "bitmap", "gfx", size);
+	for(ii=0; ii+1<size; ii += 2)
+	{
+		uint x= ii/2%240, y= ii/2/240;
+		u16 clr= GBA_RGB16((x/8+y/16)&31, (y/8)&31, (x/16+bench_rand(&seed)%2)&31);
+		in->data[ii]= clr&255;
+		in->data[ii+1]= clr>>8;
+	}
+
+	in= &bench_add(inputs, "gradient", "gfx", size);
+	for(ii=0; ii<size; ii++)
+		in->data[ii]= (ii%256 + ii/256/8) & 255;
+
+	in= &bench_add(inputs, "noise", "gfx", size);
+	for(ii=0; ii<size; ii++)
+		in->data[ii]= bench_rand(&seed) & 255;
+
+	// Map-like: rows of consecutive tiles over a blank background
+	in= &bench_add(inputs, "map", "map", 64*64*2);
+	for(ii=0; ii<64*64; ii++)
+	{
+		uint x= ii%64, y= ii/64, se= 0;
+		if(x/16 % 2 != y/8 % 2)
+			se= 1 + (y%8)*16 + x%16;
+		if(bench_rand(&seed)%16 == 0)
+			se= bench_rand(&seed)%128 | (bench_rand(&seed)&3)<<10;
+		se |= (y/32)<<12;
+		in->data[2*ii]= se&255;
+		in->data[2*ii+1]= se>>8;
+	}
+
+	// Palette-like: 16-color ramps
+	in= &bench_add(inputs, "pal", "pal", 256*2);
+	for(ii=0; ii<256; ii++)
+	{
+		uint bank= ii/16, kk= ii%16*2;
+		u16 clr= GBA_RGB16(kk*(bank&1), kk*(bank>>1&1), kk*((bank>>2&1) | (bank==0)));
+		in->data[2*ii]= clr&255;
+		in->data[2*ii+1]= clr>>8;
+	}
+}
+
+//! Add the contents of file \a fpath as an input.
+static bool bench_load_input(std::vector<BenchInput> &inputs, const char *fpath)
+{
+	FILE *fp= fopen(fpath, "rb");
+	if(fp == NULL)
+		return false;
+
+	fseek(fp, 0, SEEK_END);
+	long size= ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	// Keep to the 24-bit size field
+	if(size <= 0 || size >= 0x1000000)
+	{
+		fclose(fp);
+		return false;
+	}
+
+	// Strip the directory, with either separator
+	const char *name= fpath, *sep;
+	for(sep= fpath; *sep; sep++)
+		if(*sep == '/' || *sep == '\\')
+			name= sep+1;
+	BenchInput &in= bench_add(inputs, name, "file", size);
+	bool bOK= fread(in.data.data(), 1, size, fp) == (size_t)size;
+	fclose(fp);
+
+	if(!bOK)
+		inputs.pop_back();
+
+	return bOK;
+}
+
+//! Run \a fn \a reps times; returns the fastest time in seconds.
+/*!	Fast runs are repeated until BENCH_TIME_MIN has passed, and the
+	average of those is what counts for that repetition.
+*/
+template<class F>
+static double bench_time(F fn, int reps)
+{
+	double best= 1e30;
+
+	for(int ii=0; ii<reps; ii++)
+	{
+		int count= 0;
+		std::chrono::duration<double> dt;
+
+		auto t0= std::chrono::steady_clock::now();
+		do
+		{
+			fn();
+			count++;
+			dt= std::chrono::steady_clock::now()-t0;
+		} while(dt.count() < BENCH_TIME_MIN);
+
+		if(dt.count()/count < best)
+			best= dt.count()/count;
+	}
+
+	return best;
+}
+
+//! Compress and decompress \a in with \a codec.
+static BenchResult bench_run(const BenchInput &in, const BenchCodec &codec,
+	CprsContext *ctx, int reps)
+{
+	BenchResult res= { &in, &codec, 0, 0, 0, 0, false };
+	RECORD src= { 1, (int)in.data.size(), (BYTE*)in.data.data() };
+	RECORD cprs= { 0, 0, NULL }, back= { 0, 0, NULL };
+
+	// Reuse one buffer sink, so allocation doesn't count
+	CprsSink sink;
+	cprs_sink_buffer(&sink);
+
+	res.tCprs= bench_time([&]
+	{
+		sink.size= 0;
+		cprs_compress_to(&sink, &src, codec.tag, codec.flags, ctx);
+	}, reps);
+	res.size= cprs_sink_detach(&sink, &cprs);
+
+	if(res.size == 0)
+		return res;
+
+	res.cycles= cprs_decode_cycles(&cprs, codec.flags);
+
+	res.tDecprs= bench_time([&]
+	{
+		cprs_decompress(&back, &cprs);
+	}, reps);
+
+	res.bRoundTrip= rec_size(&back) == rec_size(&src) &&
+		memcmp(back.data, src.data, rec_size(&src)) == 0;
+
+	free(cprs.data);
+	free(back.data);
+
+	return res;
+}
+
+//! MB/s for \a size bytes in \a time seconds.
+static double bench_mbps(uint size, double time)
+{
+	return time > 0 ? size/time/(1024.0*1024.0) : 0;
+}
+
+//! Quote \a str as a JSON string, escaping quotes, backslashes and control chars.
+static std::string bench_json_str(const char *str)
+{
+	std::string out= "\"";
+	char buf[8];
+
+	for( ; *str; str++)
+	{
+		unsigned char ch= *str;
+		if(ch == '"' || ch == '\\')
+		{
+			out += '\\';
+			out += ch;
+		}
+		else if(ch < 0x20)
+		{
+			sprintf(buf, "\\u%04x", ch);
+			out += buf;
+		}
+		else
+			out += ch;
+	}
+
+	return out + "\"";
+}
+
+//! Write the results as JSON.
+static bool bench_write_json(const char *fpath,
+	const std::vector<BenchResult> &results, int threads, int reps)
+{
+	FILE *fp= fopen(fpath, "w");
+	if(fp == NULL)
+		return false;
+
+	fprintf(fp, "{\n\t\"threads\": %d,\n\t\"reps\": %d,\n\t\"results\": [\n",
+		threads, reps);
+
+	for(size_t ii=0; ii<results.size(); ii++)
+	{
+		const BenchResult &res= results[ii];
+		uint srcS= res.input->data.size();
+
+		fprintf(fp, "\t\t{\"input\": %s, \"kind\": %s, "
+			"\"codec\": %s, \"tag\": %d, \"flags\": %u, "
+			"\"src_size\": %u, \"size\": %u, \"ratio\": %.4f, "
+			"\"compress_mbps\": %.2f, \"decompress_mbps\": %.2f, "
+			"\"decode_cycles\": %u, \"roundtrip\": %s}%s\n",
+			bench_json_str(res.input->name.c_str()).c_str(), 
+			bench_json_str(res.input->kind).c_str(),
+			bench_json_str(res.codec->name).c_str(), res.codec->tag, res.codec->flags,
+			srcS, res.size, srcS ? (double)res.size/srcS : 0,
+			bench_mbps(srcS, res.tCprs), bench_mbps(srcS, res.tDecprs),
+			res.cycles, res.bRoundTrip ? "true" : "false",
+			ii+1 < results.size() ? "," : "");
+	}
+
+	fprintf(fp, "\t]\n}\n");
+
+	return fclose(fp) == 0;
+}
+
+//! Time LZ77 on the gfx inputs with 1 and with \a threads threads.
+/*!	\return	False if the outputs differ.
+*/
+static bool bench_lz77_threads(const std::vector<BenchInput> &inputs,
+	CprsContext *ctx, int threads, int reps)
+{
+	bool bOK= true;
+
+	printf("\nLZ77, 1 vs %d threads\n", threads);
+	printf("%-10s %5s %10s %10s %10s %8s\n",
+		"input", "level", "size", "1 thr (s)", "n thr (s)", "speedup");
+
+	for(uint in=0; in<inputs.size(); in++)
+	{
+		if(strcmp(inputs[in].kind, "gfx") != 0)
+			continue;
+
+		RECORD src= { 1, (int)inputs[in].data.size(), (BYTE*)inputs[in].data.data() };
+
+		for(int level=0; level<=CPRS_LEVEL_MAX; level++)
+		{
+			RECORD ser= { 0, 0, NULL }, par= { 0, 0, NULL };
+			u32 flags= BFN_PREP(level, CPRS_LEVEL);
+
+			par_set_threads(1);
+			double tSer= bench_time([&]
+			{
+				cprs_compress(&ser, &src, CPRS_LZ77_TAG, flags, ctx);
+			}, reps);
+			par_set_threads(threads);
+			double tPar= bench_time([&]
+			{
+				cprs_compress(&par, &src, CPRS_LZ77_TAG, flags, ctx);
+			}, reps);
+
+			bool same= rec_size(&ser) == rec_size(&par) &&
+				memcmp(ser.data, par.data, rec_size(&ser)) == 0;
+
+			printf("%-10s %5d %10d %10.3f %10.3f %7.2fx%s\n",
+				inputs[in].name.c_str(), level, rec_size(&par), tSer, tPar,
+				tSer/tPar, same ? "" : "  MISMATCH");
+
+			if(!same)
+				bOK= false;
+
+			free(ser.data);
+			free(par.data);
+		}
+	}
+
+	return bOK;
+}
+
+int main(int argc, char **argv)
+{
+	int ii, threads= 0, sizeKB= 256, reps= 3;
+	bool bThreads= false;
+	const char *jsonPath= NULL;
+	std::vector<const char*> files;
+
+	for(ii=1; ii<argc; ii++)
+	{
+		if(argv[ii][0] != '-')
+		{
+			files.push_back(argv[ii]);
+			continue;
+		}
+
+		switch(argv[ii][1])
+		{
+		case 'j':	threads= strtoul(&argv[ii][2], NULL, 0);	break;
+		case 's':	sizeKB= strtoul(&argv[ii][2], NULL, 0);		break;
+		case 'r':	reps= strtoul(&argv[ii][2], NULL, 0);		break;
+		case 'p':	bThreads= true;								break;
+		case 'o':
+			if(++ii < argc)
+			{
+				jsonPath= argv[ii];
+				break;
+			}
+			// -o without a file name
+			// fall through
+		default:
+			fputs(appHelpText, stdout);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(sizeKB < 1 || sizeKB > 16383)	// 24-bit size field
+		sizeKB= 256;
+	if(reps < 1)
+		reps= 1;
+
+	par_set_threads(threads);
+	threads= par_get_threads();
+
+	std::vector<BenchInput> inputs;
+	bench_make_inputs(inputs, sizeKB*1024);
+	for(uint in=0; in<files.size(); in++)
+		if(!bench_load_input(inputs, files[in]))
+			fprintf(stderr, "Can't read %s; skipped\n", files[in]);
+
+	const BenchCodec codecs[]=
+	{
+		{ "raw",		CPRS_FAKE_TAG,	0 },
+		{ "lz77",		CPRS_LZ77_TAG,	0 },
+		{ "lz77-1",		CPRS_LZ77_TAG,	BFN_PREP(1, CPRS_LEVEL) },
+		{ "lz77-6",		CPRS_LZ77_TAG,	BFN_PREP(6, CPRS_LEVEL) },
+		{ "lz77-9",		CPRS_LZ77_TAG,	BFN_PREP(9, CPRS_LEVEL) },
+		{ "lz77-s",		CPRS_LZ77_TAG,	CPRS_LEVEL_DECODE },
+		{ "lz77w-6",	CPRS_LZ77_TAG,	BFN_PREP(6, CPRS_LEVEL) | CPRS_WRAM },
+		{ "lz11",		CPRS_LZ11_TAG,	0 },
+		{ "lz11-9",		CPRS_LZ11_TAG,	BFN_PREP(9, CPRS_LEVEL) },
+		{ "huff",		CPRS_HUFF_TAG,	0 },
+		{ "huff4",		CPRS_HUFF4_TAG,	0 },
+		{ "huff8",		CPRS_HUFF8_TAG,	0 },
+		{ "rle",		CPRS_RLE_TAG,	0 },
+		{ "rle-9",		CPRS_RLE_TAG,	BFN_PREP(9, CPRS_LEVEL) },
+		{ "diff8",		CPRS_DIFF8_TAG,	0 },
+		{ "diff16",		CPRS_DIFF16_TAG,0 },
+	};
+	const uint codecN= sizeof(codecs)/sizeof(codecs[0]);
+
+	CprsContext *ctx= cprs_alloc();
+	std::vector<BenchResult> results;
+	int result= EXIT_SUCCESS;
+
+	printf("%d threads, best of %d\n", threads, reps);
+	printf("%-10s %-4s %-8s %8s %8s %6s %10s %10s %10s %s\n",
+		"input", "kind", "codec", "in", "out", "ratio",
+		"cprs MB/s", "dec MB/s", "dec cyc", "check");
+
+	for(uint in=0; in<inputs.size(); in++)
+	{
+		for(uint cc=0; cc<codecN; cc++)
+		{
+			// Diff16 only works on whole halfwords
+			if(codecs[cc].tag == CPRS_DIFF16_TAG && inputs[in].data.size()&1)
+				continue;
+
+			BenchResult res= bench_run(inputs[in], codecs[cc], ctx, reps);
+			results.push_back(res);
+
+			uint srcS= inputs[in].data.size();
+			printf("%-10s %-4s %-8s %8u %8u %6.3f %10.2f %10.2f %10u %s\n",
+				inputs[in].name.c_str(), inputs[in].kind, codecs[cc].name,
+				srcS, res.size, (double)res.size/srcS,
+				bench_mbps(srcS, res.tCprs), bench_mbps(srcS, res.tDecprs),
+				res.cycles,
+				res.size == 0 ? "FAILED" : res.bRoundTrip ? "ok" : "MISMATCH");
+
+			if(!res.bRoundTrip)
+				result= EXIT_FAILURE;
+		}
+	}
+
+	if(bThreads && !bench_lz77_threads(inputs, ctx, threads, reps))
+		result= EXIT_FAILURE;
+
+	cprs_free(ctx);
+
+	if(jsonPath && !bench_write_json(jsonPath, results, threads, reps))
+	{
+		fprintf(stderr, "Can't write %s\n", jsonPath);
+		result= EXIT_FAILURE;
+	}
+
+	return result;
+}
+
+// EOF
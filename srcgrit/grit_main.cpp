@@ -5,6 +5,32 @@
 //! \author cearn
 //
 /* === NOTES ===
+  * 20261017:
+    - Compression levels: a number after the type, like -gzl9.
+      LZ77 and LZ11 use them: 1 (fast) to 9 (optimal parse). 
+      RLE only has 9, an optimal parse.
+    - -j{n} : number of threads for parallel work.
+    - -Za (or -Zauto) and related: keep the smallest compression.
+    - -Zv : decompress and compare all compressed data.
+    - -gzh4, -gzh8 (and related): 4 or 8bit Huffman only.
+    - -gzd{type}, -gzD{type} (and related): diff filter before 
+      compression; always or only where it helps.
+    - -gzlw (and related): LZ77 for LZ77UnCompWram, which may 
+      use distance-1 matches. The header says which via fooLzWram.
+    - -gzx (and related): NDS LZ11, with levels like -gzl.
+    - -gzls (and related): LZ77/LZ11 parse for decoding speed, 
+      within a few percent of the smallest output.
+    - -Zcache {dir} : keep compression results in dir and reuse them 
+      when the same data is compressed the same way again.
+    - -gzS{n} : compress gfx in segments of n tiles (metatiles with 
+      -Mw/-Mh; pixel rows for bitmaps), each on its own, plus an 
+      offset table, so the target can unpack one segment.
+    - -Zt{n} : auto compression weighs decode time as well as size;
+      1000 estimated decode cycles count as n bytes.
+    - -mRo : reorder the reduced tileset so similar tiles are 
+      neighbours, for better LZ77 compression. Combines with the 
+      other -mR options, e.g. -mR4o; a bare -mRo is -mRto. 
+      Ignored without tile reduction (-mR!o).
   * 20100201, jv:
     - Removed bpp and size restriction of external tileset.
 	- Added -mp and -mB options.
@@ -40,6 +66,7 @@
 #include "grit_version.h"
 #endif
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -80,7 +107,18 @@ const char appHelpText[]=
 "\n--- Graphics options (base: \"-g\") ---\n"
 "-g | -g!       Include  or exclude gfx data [inc]\n"
 "-gu(8|16|32)   Gfx data type: u8, u16, u32 [u32]\n"
-"-gz[!lhr0]     Gfx compression: off, lz77, huff, RLE, off+header [off]\n"
+"-gz[!lhr0ax]   Gfx compression: off, lz77, huff, RLE, off+header, auto, \n"
+"                 NDS lz11 [off]\n"
+"                 lz77/lz11 level may follow: 1 fastest .. 9 smallest [0]\n"
+"                 or s: fastest to decode, up to 3% over smallest\n"
+"                 rle level may follow: 9 smallest, others greedy [0]\n"
+"                 huff width may follow: h4, h8 [smaller of both]\n"
+"                 auto (or -gzauto) keeps the smallest of all\n"
+"                 d before the type diff filters first (-gzdl),\n"
+"                 D only where it helps (-gzDl)\n"
+"                 w after l, x or a: lz77 for WRAM, not VRAM (-gzlw9)\n"
+"-gzS{n}        Compress gfx in segments of n (meta)tiles or pixel rows,\n"
+"                 with an offset table (fooTilesSegs) [0: one stream]\n"
 "-ga{n}         Gfx pixel offset (non-zero pixels) [0]\n"
 "-gA{n}         Gfx pixel offset n (all pixels) [0]\n"
 "-gb | -gt      Gfx format, bitmap or tile [tile]\n"
@@ -98,7 +136,8 @@ const char appHelpText[]=
 "\n--- Map options (base: \"-m\") ---\n"
 "-m | -m!       Include or exclude map data [exc]\n"
 "-mu(8|16|32)   Map data type: u8, u16, u32 [u16]\n"
-"-mz[!lhr0]     Map compression: off, lz77, huff, RLE, off+header [off]\n"
+"-mz[!lhr0ax]   Map compression: off, lz77, huff, RLE, off+header, auto, lz11 [off]\n"
+"                 a level may follow, like -gz\n"
 "-ma{n}         Map-entry offset n (non-zero entries) [0]\n"
 "-mp{n}         NEW: Force mapsel palette to n\n"
 "-mB{n}:{(iphv[n])+}     NEW: Custom mapsel bitformat\n"
@@ -108,11 +147,15 @@ const char appHelpText[]=
 "-mR[48a]       Common tile reduction combos: reg 4bpp (-mRtpf), \n"
 "                 reg 8bpp (-mRtf), affine (-mRt), respectively\n"
 "-mR!           No tile reduction (not advised)\n"
+"-mRo           Reorder tileset for compression; combine with the \n"
+"                 above (-mR8o, -mRtfo). Alone it means -mRto,\n"
+"                 which replaces the default -mR8: no flip reduction\n"
 "-mL[fsa]       Map layout: reg flat, reg sbb, affine [reg flat]\n"
 "\n--- Palette options (base: \"-p\") ---\n"
 "-p | -p!       Include or exclude pal data [inc]\n"
 "-pu(8|16|32)   Pal data-type: u8, u16 , u32 [u16]\n"
-"-pz[!lhr0]     Pal compression: off, lz77, huff, RLE, off+header [off]\n"
+"-pz[!lhr0ax]   Pal compression: off, lz77, huff, RLE, off+header, auto, lz11 [off]\n"
+"                 a level may follow, like -gz\n"
 "-ps{n}         Pal range start [0]\n"
 "-pe{n}         Pal range end (exclusive) [pal size]\n"
 "-pn{n}         Pal count [pal size]. Overrides -pe\n"
@@ -141,7 +184,12 @@ const char appHelpText[]=
 //"-q             Quiet mode; no report at the end\n"
 "-U(8|16|32)    All data type: u8, u16, u32\n"
 "-W{n}          Warning/log level 1, 2 or 3 [1]\n"
-"-Z[!lhr0]      All compression: off, lz77, huff, RLE, off+header [off]\n"
+"-j{n}          Number of threads for compression [cores]\n"
+"-Z[!lhr0ax]    All compression: off, lz77, huff, RLE, off+header, auto, lz11 [off]\n"
+"                 a level may follow, like -gz\n"
+"-Zv            Check compressed data by decompressing it\n"
+"-Zt{n}         Auto compression: n bytes per 1000 decode cycles [0]\n"
+"-Zcache {dir}  Reuse compression results stored in dir\n"
 "\nNew options: -fr, -ftr, -gS, -O, -pS, -S, -Z0 (et al)\n";
 
 
@@ -152,7 +200,7 @@ const char appHelpText[]=
 
 bool grit_parse(GritRec *gr, const strvec &args);
 
-int grit_parse_cprs(const char *key, const strvec &args);
+int grit_parse_cprs(const char *key, const strvec &args, int *level);
 bool grit_parse_mapsel_format(const char *key, MapselFormat *pmf);
 
 bool grit_parse_pal(GritRec *gr, const strvec &args);
@@ -182,22 +230,91 @@ int run_main(int argc, char **argv);
 //! Searches for compression options
 /*!
 	\param key	Base compression options (-Z, -gz, etc)
-	\return	GRIT_CPRS_foo flag, or -1 if no sub-flag found.
+	\param level	Receives the compression level that may follow 
+		the type (-gzl9); 0 if there is none.
+	\return	GRIT_CPRS_foo flag, or -1 if no sub-flag found. A 'd' 
+		or 'D' before the type adds GRIT_CPRS_DIFF or 
+		GRIT_CPRS_DIFF_AUTO (-gzdl); on its own it's just the filter. 
+		A 'w' after lz77, lz11 or auto adds GRIT_CPRS_WRAM (-gzlw9). 
+		An 's' instead of a level gives GRIT_CPRS_LEVEL_DECODE; numeric 
+		levels are capped at GRIT_CPRS_LEVEL_MAX.
 */
-int grit_parse_cprs(const char *key, const strvec &args)
+int grit_parse_cprs(const char *key, const strvec &args, int *level)
 {
-	// compression
-	const char *str= CLI_STR(key, "");
-	switch(*str)
+	int ii, mode= -1, filter= 0, count= args.size(), keyLen= strlen(key);
+	const char *str= "";
+
+	// compression. Other options can share the key (-Zv), so use 
+	// the first one with a known type.
+	for(ii=1; ii<count && mode == -1; ii++)
 	{
-	case 'h':	return GRIT_CPRS_HUFF;
-	case 'l':	return GRIT_CPRS_LZ77;
-	case 'r':	return GRIT_CPRS_RLE;
-	case '!':	return GRIT_CPRS_OFF;
-	case '0':	return GRIT_CPRS_HEADER;
-	default:
-		return -1;		
+		if(strncmp(key, args[ii], keyLen) != 0)
+			continue;
+
+		str= &args[ii][keyLen];
+		if(*str == '\0' && ii < count-1)	// separate field
+			str= args[ii+1];
+
+		filter= 0;
+		if(*str == 'd' || *str == 'D')
+			filter= (*str++ == 'd') ? GRIT_CPRS_DIFF : GRIT_CPRS_DIFF_AUTO;
+
+		switch(*str)
+		{
+		case 'h':	mode= GRIT_CPRS_HUFF;	break;
+		case 'l':	mode= GRIT_CPRS_LZ77;	break;
+		case 'x':	mode= GRIT_CPRS_LZ11;	break;
+		case 'r':	mode= GRIT_CPRS_RLE;	break;
+		case '!':	mode= GRIT_CPRS_OFF;	break;
+		case '0':	mode= GRIT_CPRS_HEADER;	break;
+		case 'a':	mode= GRIT_CPRS_AUTO;	break;
+		case '\0':
+			if(filter)
+				mode= GRIT_CPRS_OFF;
+			break;
+		}
+	}
+
+	if(mode == -1)
+		return -1;
+
+	// Skip the type; auto can be spelled out (-Zauto)
+	if(*str != '\0')
+		str += (strncmp(str, "auto", 4) == 0) ? 4 : 1;
+
+	// Huffman takes a symbol width instead of a level (-gzh4)
+	if(mode == GRIT_CPRS_HUFF)
+	{
+		if(*str == '4')
+			mode= GRIT_CPRS_HUFF4;
+		else if(*str == '8')
+			mode= GRIT_CPRS_HUFF8;
+		*level= 0;
+		return mode | filter;
+	}
+
+	// LZ77 for WRAM instead of VRAM (-gzlw, -gzxw, -gzaw)
+	if((mode == GRIT_CPRS_LZ77 || mode == GRIT_CPRS_LZ11 || 
+		mode == GRIT_CPRS_AUTO) && *str == 'w')
+	{
+		mode |= GRIT_CPRS_WRAM;
+		str++;
+	}
+
+	// level; 's' for decoding speed (-gzls)
+	// Numbers past the top are capped; only 's' gets the decode level.
+	if(*str == 's' && (mode & GRIT_CPRS_MASK) != GRIT_CPRS_RLE)
+		*level= GRIT_CPRS_LEVEL_DECODE;
+	else if(isdigit(*str))
+	{
+		*level= strtoul(str, NULL, 10);
+		if(*level > GRIT_CPRS_LEVEL_MAX)
+			*level= GRIT_CPRS_LEVEL_MAX;
 	}
+	else
+		*level= 0;
+
+	return mode | filter;
 }
 
 //! Parse mapsel-format string into the format proper.
@@ -280,14 +397,17 @@ bool grit_parse_mapsel_format(const char *key, MapselFormat *pmf)
 //! Searches for palette options.
 bool grit_parse_pal(GritRec *gr, const strvec &args)
 {
-	int val;
+	int val, level;
 	if( CLI_BOOL("-p!") == false)
 	{
 		gr->palProcMode= GRIT_EXPORT;
 
 		gr->palDataType= CLI_INT("-pu", 16)>>4;
-		if( (val= grit_parse_cprs("-pz", args)) != -1 )
+		if( (val= grit_parse_cprs("-pz", args, &level)) != -1 )
+		{
 			gr->palCompression= val;
+			gr->palCprsLevel= level;
+		}
 
 		// Range
 		gr->palStart= CLI_INT("-ps", 0);
@@ -320,7 +440,7 @@ bool grit_parse_pal(GritRec *gr, const strvec &args)
 //! Searches for graphics options
 bool grit_parse_gfx(GritRec *gr, const strvec &args)
 {
-	int val;
+	int val, level;
 	const char *pstr;
 
 	if(CLI_BOOL("-g!") == false)
@@ -328,8 +448,12 @@ bool grit_parse_gfx(GritRec *gr, const strvec &args)
 		gr->gfxProcMode= GRIT_EXPORT;
 
 		gr->gfxDataType= CLI_INT("-gu", 32)>>4;
-		if( (val= grit_parse_cprs("-gz", args)) != -1 )
+		if( (val= grit_parse_cprs("-gz", args, &level)) != -1 )
+		{
 			gr->gfxCompression= val;
+			gr->gfxCprsLevel= level;
+		}
+		gr->gfxSegSize= MAX(CLI_INT("-gzS", 0), 0);
 
 		// pixel offset
 		gr->gfxOffset= CLI_INT("-gA", 0);
@@ -398,7 +522,7 @@ bool grit_parse_gfx(GritRec *gr, const strvec &args)
 //! Searches for tilemap options
 bool grit_parse_map(GritRec *gr, const strvec &args)
 {
-	int val;
+	int val, level;
 	const char *pstr;
 
 	// no map args or excluded	
@@ -411,8 +535,11 @@ bool grit_parse_map(GritRec *gr, const strvec &args)
 	gr->mapProcMode= GRIT_EXPORT;
 
 	gr->mapDataType= CLI_INT("-mu", 16)>>4;
-	if( (val= grit_parse_cprs("-mz", args)) != -1 )
+	if( (val= grit_parse_cprs("-mz", args, &level)) != -1 )
+	{
 		gr->mapCompression= val;
+		gr->mapCprsLevel= level;
+	}
 
 	// Tile reduction
 	pstr= CLI_STR("-mR", "");
@@ -430,6 +557,14 @@ bool grit_parse_map(GritRec *gr, const strvec &args)
 		if(strchr(pstr, 'p'))
 			gr->mapRedux |= GRIT_RDX_PBANK;
 	}
+	if(pstr[0] && strchr(pstr, 'o'))
+	{
+		if(gr->mapRedux & GRIT_RDX_TILE)
+			gr->mapRedux |= GRIT_RDX_ORDER;
+		else
+			lprintf(LOG_WARNING, 
+"-mRo needs tile reduction; ignoring reorder for -mR%s\n", pstr);
+	}
 
 	MapselFormat mf;
 
@@ -605,7 +740,7 @@ int grit_parse_log(GritRec *gr, const strvec &args)
 */
 bool grit_parse(GritRec *gr, const strvec &args)
 {
-	int val;
+	int val, level;
 
 	// === GLOBAL options ===
 
@@ -619,13 +754,19 @@ bool grit_parse(GritRec *gr, const strvec &args)
 	}
 
 	// Overall compression
-	if( (val= grit_parse_cprs("-Z", args)) != -1)
+	if( (val= grit_parse_cprs("-Z", args, &level)) != -1)
 	{
 		gr->palCompression= val;
 		gr->gfxCompression= val;
 		gr->mapCompression= val;
+		gr->palCprsLevel= level;
+		gr->gfxCprsLevel= level;
+		gr->mapCprsLevel= level;
 	}
 
+	gr->bCprsVerify= CLI_BOOL("-Zv");
+	gr->cprsTimeWeight= MAX(CLI_INT("-Zt", 0), 0);
+
 	grit_parse_pal(gr, args);
 	grit_parse_gfx(gr, args);
 	grit_parse_map(gr, args);
@@ -676,7 +817,7 @@ bool grit_parse(GritRec *gr, const strvec &args)
 //! Special parse for shared data (grs assumed to be set-up first)
 bool grit_parse_shared(GritRec *gr, const strvec &args)
 {
-	int val;
+	int val, level;
 	GritShared *grs = gr->shared;
 
 	// datatype: 8, 16, 32
@@ -688,12 +829,17 @@ bool grit_parse_shared(GritRec *gr, const strvec &args)
 	}
 
 	// Overall compression
-	if( (val= grit_parse_cprs("-Z", args)) != -1)
+	if( (val= grit_parse_cprs("-Z", args, &level)) != -1)
 	{
 		gr->palCompression= val;
 		gr->gfxCompression= val;
+		gr->palCprsLevel= level;
+		gr->gfxCprsLevel= level;
 	}
 
+	gr->bCprsVerify= CLI_BOOL("-Zv");
+	gr->cprsTimeWeight= MAX(CLI_INT("-Zt", 0), 0);
+
 	grit_parse_pal(gr, args);
 	grit_parse_gfx(gr, args);	
 
@@ -1141,6 +1287,12 @@ int run_main(int argc, char **argv)
 		// --- Option and file inits ---
 		args_gather(args, argc, argv);
 		log_init(grit_parse_log(NULL, args), NULL);
+		par_set_threads(CLI_INT("-j", 0));
+
+		const char *cacheDir= CLI_STR("-Zcache", "");
+		if(!cprs_cache_set_dir(cacheDir))
+			lprintf(LOG_WARNING, "Can't use %s as compression cache; "
+				"not caching.\n", cacheDir);
 
 		for(ii=1; ii<args.size(); ii++)
 		{
@@ -1168,6 +1320,12 @@ int run_main(int argc, char **argv)
 		else
 			result= run_individual(gr, args, fpaths);
 
+		uint hits, stores;
+		cprs_cache_stats(&hits, &stores);
+		if(hits || stores)
+			lprintf(LOG_STATUS, "Compression cache: %d reused, %d stored.\n", 
+				hits, stores);
+
 		lprintf(LOG_STATUS, "Done!\n");
 	}
 	catch(const char *msg)